@@ -1,4 +1,84 @@
 
+// Index of the outflow n of a cell: one plane per neighbour, or the four outflows of a cell next to each other with -DOUTFLOW_QUADS (see flowLayout.h)
+#ifdef OUTFLOW_QUADS
+#define OUTFLOW(n, cell, cells) ((cell) * 4 + (n) - 1)
+#else
+#define OUTFLOW(n, cell, cells) ((n) * (cells) + (cell))
+#endif
+
+// Scalar type of the substates: double, or float with -DREAL=float (see flowPrecision.h)
+#ifndef REAL
+#define REAL double
+#endif
+
+
+/*	Minimization algorithm of the differences for one cell, shared by kernel1 and kernel4 (the
+	gather step is built from this file followed by kernel4.cl): m is the mobile thickness of the
+	central cell, h[0] its altitude and h[1..4] the total heights of its neighbours. The outflows
+	towards the neighbours are written to flows[1..4], zero for the eliminated ones.
+	*/
+void outflows(const REAL m, const REAL* h, const float dFactor, REAL* flows)
+{
+	/*	A dry cell has nothing to distribute: the loop below could round the average of three or
+		more equal kept heads above them and leave tiny outflows (see outflows in flow.h).
+		*/
+	if (m == 0.0)
+	{
+		for (int n = 1; n < 5; n++)
+			flows[n] = 0.0;
+		return;
+	}
+
+	/*	Cells that are eliminated cannot receive flows from the central one.
+		Note that even the central cell can be either eliminated or not eliminated.
+		In the last case, a part of its mass thickness remains within the cell.
+		This amount can be tougth as a residual flow.
+		*/
+	bool eliminated[5] = { false, false, false, false, false };
+
+	// H average over the not eliminated cells
+	REAL average;
+
+	/*	Other variables:
+		counter is the counter of not eliminated cells
+		n is the for loop index
+		again represents the continuation ctriterion in the do while cicle
+		*/
+	int counter;
+	bool again;
+
+	/*	Here is the main loop of the algorithm. It evaluates the equilibrium condition in the
+	   neighbourhood by computing an average height and eliminating those cells whose total height (H)
+	   is greater than the computed average. When no cells are eliminated during an iteration, the
+	   loop stops and the equilibrium condition is obtained by considering outflows computed as:
+	   (average - H[i]) * dumping_factor
+	   where dumping_factor is a relaxation rate parameter used to make the simulation more realistic.
+	   */
+	do
+	{
+		again = false;
+		counter = 0;
+		average = m;
+		for (int n = 0; n < 5; n++)
+			if (eliminated[n] == false)
+			{
+				average += h[n];
+				counter++;
+			}
+		average = average / counter;
+
+		for (int n = 0; n < 5; n++)
+			if ((average <= h[n]) && (eliminated[n] == false))
+			{
+				eliminated[n] = true;
+				again = true;
+			}
+	} while (again);
+
+	for (int n = 1; n < 5; n++)
+		flows[n] = eliminated[n] ? 0.0 : (average - h[n]) * dFactor;
+}
+
 
 __kernel void kernel1(
 	const int nrows,
@@ -6,9 +86,9 @@ __kernel void kernel1(
 	const float dFactor,
 	const int nneighbors,
 	const float noDataValue,
-	__global double* z,
-	__global double* hThickness,
-	__global double* sOverflow
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow
 )
 {
 	int i = get_global_id(0);
@@ -36,30 +116,13 @@ __kernel void kernel1(
 		Vj[4] = j;   // column of the neighbor at south
 
 
-		/*	Cells that are eliminated cannot receive flows from the central one.
-			Note that even the central cell can be either eliminated or not eliminated.
-			In the last case, a part of its mass thickness remains within the cell.
-			This amount can be tougth as a residual flow.
-			*/
-		bool eliminated[5] = { false, false, false, false, false };
-
 		/*	m is a quantity referred to the central cell indicating the mobile part of h,
 			i.e. the amount of h that can be distributed to the nighbours
 			In this example it is always m = h
 			*/
-		double m;
+		REAL m;
 		// H = z + h, except for the central cell where H = z
-		double h[5];
-		// H average over the not eliminated cells
-		double average;
-
-		/*	Other variables:
-			counter is the counter of not eliminated cells
-			n is the for loop index
-			again represents the continuation ctriterion in the do while cicle
-			*/
-		int counter;
-		bool again;
+		REAL h[5];
 
 		/*	Here starts the algorithm. m is initialised to the whole lava thickness inside
 			the cell and H[0] to the unmovable part of the central cell, i.e. the topographic
@@ -73,45 +136,80 @@ __kernel void kernel1(
 		for (int n = 1; n < nneighbors; n++)
 			h[n] = z[(Vi[n] * ncols) + Vj[n]] + hThickness[(Vi[n] * ncols) + Vj[n]];
 
-		/*	Here is the main loop of the algorithm. It evaluates the equilibrium condition in the
-		   neighbourhood by computing an average height and eliminating those cells whose total height (H)
-		   is greater than the computed average. When no cells are eliminated during an iteration, the
-		   loop stops and the equilibrium condition is obtained by considering outflows computed as:
-		   (average - H[i]) * dumping_factor
-		   where dumping_factor is a relaxation rate parameter used to make the simulation more realistic.
-		   */
-		do
-		{
-			again = false;
-			counter = 0;
-			average = m;
-			for (int n = 0; n < nneighbors; n++)
-				if (eliminated[n] == false)
-				{
-					average += h[n];
-					counter++;
-				}
-			average = average / counter;
-
-			for (int n = 0; n < nneighbors; n++)
-				if ((average <= h[n]) && (eliminated[n] == false))
-				{
-					eliminated[n] = true;
-					again = true;
-				}
-		} while (again);
+		REAL flows[5];
+		outflows(m, h, dFactor, flows);
 
 		/* Here, outflows are evaluated and correspongid substates updated.
 		 * Note that So[0] is not updated deliberately. In fact, So[0] is a
 		 * ficticious flow introduced since the central cell belongs to
 		 * its own neighborhood and has index 0.
+		 * Eliminated neighbours get a zero outflow, so that no reset kernel is needed between steps.
 		*/
-		double flow;
 		for (int n = 1; n < nneighbors; n++)
-			if (eliminated[n] == false)
-			{
-				flow = (average - h[n]) * dFactor;
-				sOverflow[n * (nrows * ncols) + i * ncols + j] = flow;
-			}
+			sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)] = flows[n];
+	}
+}
+
+/*	Closed-form variant of kernel1 (see flowSorted.h): the five heads are sorted with a fixed
+	network, the cells that keep receiving flows are the ones of the largest prefix of the sorted
+	heads whose highest head is below the prefix average, found with a single prefix-sum scan, in
+	constant time. The outflows are equal to the ones of kernel1 up to rounding: the average is
+	summed in sorted order, and a head within an ulp of an average can be kept by one and not the
+	other.
+	*/
+__kernel void kernel1_sorted(
+	const int nrows,
+	const int ncols,
+	const float dFactor,
+	const int nneighbors,
+	const float noDataValue,
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow
+)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	if (z[(i * ncols) + j] != noDataValue && i < nrows - 1 && j < ncols - 1 && i > 0 && j > 0)
+	{
+		REAL m = hThickness[(i * ncols) + j];
+		REAL h[5];
+		h[0] = z[(i * ncols) + j];
+		h[1] = z[((i - 1) * ncols) + j] + hThickness[((i - 1) * ncols) + j];
+		h[2] = z[(i * ncols) + j - 1] + hThickness[(i * ncols) + j - 1];
+		h[3] = z[(i * ncols) + j + 1] + hThickness[(i * ncols) + j + 1];
+		h[4] = z[((i + 1) * ncols) + j] + hThickness[((i + 1) * ncols) + j];
+
+		REAL s[5] = { h[0], h[1], h[2], h[3], h[4] };
+		REAL low;
+		low = fmin(s[0], s[1]); s[1] = fmax(s[0], s[1]); s[0] = low;
+		low = fmin(s[3], s[4]); s[4] = fmax(s[3], s[4]); s[3] = low;
+		low = fmin(s[2], s[4]); s[4] = fmax(s[2], s[4]); s[2] = low;
+		low = fmin(s[2], s[3]); s[3] = fmax(s[2], s[3]); s[2] = low;
+		low = fmin(s[0], s[3]); s[3] = fmax(s[0], s[3]); s[0] = low;
+		low = fmin(s[0], s[2]); s[2] = fmax(s[0], s[2]); s[0] = low;
+		low = fmin(s[1], s[4]); s[4] = fmax(s[1], s[4]); s[1] = low;
+		low = fmin(s[1], s[3]); s[3] = fmax(s[1], s[3]); s[1] = low;
+		low = fmin(s[1], s[2]); s[2] = fmax(s[1], s[2]); s[1] = low;
+
+		// largest stable prefix ending between two different heads, and its average
+		int kept = 0;
+		REAL sum = m;
+		REAL average = 0.0;
+		for (int k = 1; k <= 5; k++)
+		{
+			sum += s[k - 1];
+			bool boundary = k == 5 || s[k - 1] < s[k];
+			bool stable = boundary && s[k - 1] < sum / k;
+			kept = stable ? k : kept;
+			average = stable ? sum / k : average;
+		}
+
+		// the kept cells are the ones with h <= threshold; none when no prefix is stable or the cell is dry
+		REAL threshold = s[max(kept, 1) - 1];
+		bool flowing = kept > 0 && m != 0.0;
+		for (int n = 1; n < 5; n++)
+			sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)] = flowing && h[n] <= threshold ? (average - h[n]) * dFactor : 0.0;
 	}
-}
\ No newline at end of file
+}
@@ -1,13 +1,25 @@
 
+// Index of the outflow n of a cell: one plane per neighbour, or the four outflows of a cell next to each other with -DOUTFLOW_QUADS (see flowLayout.h)
+#ifdef OUTFLOW_QUADS
+#define OUTFLOW(n, cell, cells) ((cell) * 4 + (n) - 1)
+#else
+#define OUTFLOW(n, cell, cells) ((n) * (cells) + (cell))
+#endif
+
+// Scalar type of the substates: double, or float with -DREAL=float (see flowPrecision.h)
+#ifndef REAL
+#define REAL double
+#endif
+
 
 __kernel void kernel2(
 	const int nrows,
 	const int ncols,
 	const int nneighbors,
 	const float noDataValue,
-	__global double* z,
-	__global double* hThickness,
-	__global double* sOverflow
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow
 )
 {
 	int i = get_global_id(0);
@@ -44,14 +56,186 @@ __kernel void kernel2(
 		 *  4 |  1
 		 *
 		 */
-		double temph = hThickness[(i * ncols) + j];
+		REAL temph = hThickness[(i * ncols) + j];
 		int x;
 		for (int n = 1; n < 5; n++)
 		{
 			x = 5 - n;
-			temph += sOverflow[x * (nrows * ncols) + Vi[n] * ncols + Vj[n]];
-			temph -= sOverflow[n * (nrows * ncols) + i * ncols + j];
+			temph += sOverflow[OUTFLOW(x, Vi[n] * ncols + Vj[n], nrows * ncols)];
+			temph -= sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)];
 		}
 		hThickness[i * ncols + j] = temph;
 	}
-}
\ No newline at end of file
+}
+
+// sum + term into sum, with the rounding error of the addition added to error (TwoSum)
+void twoSum(REAL* sum, REAL* error, const REAL term)
+{
+	REAL result = *sum + term;
+	REAL b = result - *sum;
+	*error += (*sum - (result - b)) + (term - b);
+	*sum = result;
+}
+
+/*	kernel2 with compensated (Kahan) summation, for --precision=mixed: the rounding errors of the
+	balance and the part of the new thickness that does not fit in REAL are carried to the next
+	step in hCompensation, so that hThickness + hCompensation keeps the lava volume (see flowPrecision.h).
+	*/
+__kernel void kernel2_compensated(
+	const int nrows,
+	const int ncols,
+	const int nneighbors,
+	const float noDataValue,
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow,
+	__global REAL* hCompensation
+)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	if (z[(i * ncols) + j] != noDataValue && i < nrows - 1 && j < ncols - 1 && i > 0 && j > 0)
+	{
+		int Vi[5] = { i, i - 1, i, i, i + 1 };
+		int Vj[5] = { j, j, j - 1, j + 1, j };
+
+		REAL sum = hThickness[(i * ncols) + j];
+		REAL error = hCompensation[(i * ncols) + j];
+		for (int n = 1; n < 5; n++)
+		{
+			twoSum(&sum, &error, sOverflow[OUTFLOW(5 - n, Vi[n] * ncols + Vj[n], nrows * ncols)]);
+			twoSum(&sum, &error, -sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)]);
+		}
+		REAL temph = sum + error;
+		hCompensation[(i * ncols) + j] = (sum - temph) + error;
+		hThickness[(i * ncols) + j] = temph;
+	}
+}
+
+// Side of the work-groups of the monitored kernels, see stepChangeArgs in openClExecutor.h
+#define CHANGE_GROUP 16
+
+/*	Reduces the change of the cells of a work-group in local memory: the first work-item writes
+	the largest change of the thickness, the total outflow and the count of wet cells of the group
+	to change[3 * group] to change[3 * group + 2], and the host reduces the groups (see convergence.h).
+	The count is summed as an integer, so that it stays exact in float; written as a REAL it is at
+	most CHANGE_GROUP * CHANGE_GROUP, which float holds exactly too.
+	*/
+void reduceChange(REAL delta, REAL outflow, uint wetCell, __local REAL* maxDelta, __local REAL* total, __local uint* wet, __global REAL* change)
+{
+	int l = get_local_id(0) * get_local_size(1) + get_local_id(1);
+	maxDelta[l] = delta;
+	total[l] = outflow;
+	wet[l] = wetCell;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int s = (get_local_size(0) * get_local_size(1)) / 2; s > 0; s /= 2)
+	{
+		if (l < s)
+		{
+			maxDelta[l] = fmax(maxDelta[l], maxDelta[l + s]);
+			total[l] += total[l + s];
+			wet[l] += wet[l + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (l == 0)
+	{
+		int group = get_group_id(0) * get_num_groups(1) + get_group_id(1);
+		change[3 * group] = maxDelta[0];
+		change[3 * group + 1] = total[0];
+		change[3 * group + 2] = (REAL)wet[0];
+	}
+}
+
+/*	kernel2 measuring the step, for --converge. The launch is rounded up to whole work-groups, so
+	the cells past row1 and col1 are left out; their work-items only take part in the reduction.
+	*/
+__kernel void kernel2_monitored(
+	const int nrows,
+	const int ncols,
+	const int nneighbors,
+	const float noDataValue,
+	const int row1,
+	const int col1,
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow,
+	__global REAL* change
+)
+{
+	__local REAL maxDelta[CHANGE_GROUP * CHANGE_GROUP];
+	__local REAL total[CHANGE_GROUP * CHANGE_GROUP];
+	__local uint wet[CHANGE_GROUP * CHANGE_GROUP];
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	REAL delta = 0;
+	REAL outflow = 0;
+	uint wetCell = 0;
+	if (i < row1 && j < col1 && i < nrows - 1 && j < ncols - 1 && i > 0 && j > 0 && z[(i * ncols) + j] != noDataValue)
+	{
+		int Vi[5] = { i, i - 1, i, i, i + 1 };
+		int Vj[5] = { j, j, j - 1, j + 1, j };
+
+		REAL h = hThickness[(i * ncols) + j];
+		REAL temph = h;
+		for (int n = 1; n < 5; n++)
+		{
+			temph += sOverflow[OUTFLOW(5 - n, Vi[n] * ncols + Vj[n], nrows * ncols)];
+			temph -= sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)];
+			outflow += sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)];
+		}
+		hThickness[i * ncols + j] = temph;
+		delta = fabs(temph - h);
+		wetCell = h != 0;
+	}
+	reduceChange(delta, outflow, wetCell, maxDelta, total, wet, change);
+}
+
+// kernel2_compensated measuring the step, as kernel2_monitored
+__kernel void kernel2_compensated_monitored(
+	const int nrows,
+	const int ncols,
+	const int nneighbors,
+	const float noDataValue,
+	const int row1,
+	const int col1,
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* sOverflow,
+	__global REAL* hCompensation,
+	__global REAL* change
+)
+{
+	__local REAL maxDelta[CHANGE_GROUP * CHANGE_GROUP];
+	__local REAL total[CHANGE_GROUP * CHANGE_GROUP];
+	__local uint wet[CHANGE_GROUP * CHANGE_GROUP];
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	REAL delta = 0;
+	REAL outflow = 0;
+	uint wetCell = 0;
+	if (i < row1 && j < col1 && i < nrows - 1 && j < ncols - 1 && i > 0 && j > 0 && z[(i * ncols) + j] != noDataValue)
+	{
+		int Vi[5] = { i, i - 1, i, i, i + 1 };
+		int Vj[5] = { j, j, j - 1, j + 1, j };
+
+		REAL h = hThickness[(i * ncols) + j];
+		REAL sum = h;
+		REAL error = hCompensation[(i * ncols) + j];
+		for (int n = 1; n < 5; n++)
+		{
+			twoSum(&sum, &error, sOverflow[OUTFLOW(5 - n, Vi[n] * ncols + Vj[n], nrows * ncols)]);
+			twoSum(&sum, &error, -sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)]);
+			outflow += sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)];
+		}
+		REAL temph = sum + error;
+		hCompensation[(i * ncols) + j] = (sum - temph) + error;
+		hThickness[(i * ncols) + j] = temph;
+		delta = fabs(temph - h);
+		wetCell = h != 0;
+	}
+	reduceChange(delta, outflow, wetCell, maxDelta, total, wet, change);
+}
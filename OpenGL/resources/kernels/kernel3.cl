@@ -1,12 +1,24 @@
 
+// Index of the outflow n of a cell: one plane per neighbour, or the four outflows of a cell next to each other with -DOUTFLOW_QUADS (see flowLayout.h)
+#ifdef OUTFLOW_QUADS
+#define OUTFLOW(n, cell, cells) ((cell) * 4 + (n) - 1)
+#else
+#define OUTFLOW(n, cell, cells) ((n) * (cells) + (cell))
+#endif
+
+// Scalar type of the substates: double, or float with -DREAL=float (see flowPrecision.h)
+#ifndef REAL
+#define REAL double
+#endif
+
 
 __kernel void kernel3(
 	const int nrows,
 	const int ncols,
 	const int nneighbors,
 	const float noDataValue,
-	__global double* z,
-	__global double* sOverflow
+	__global REAL* z,
+	__global REAL* sOverflow
 )
 {
 	int i = get_global_id(0);
@@ -15,6 +27,6 @@ __kernel void kernel3(
 	if (z[(i * ncols) + j] != noDataValue && i < nrows - 1 && j < ncols - 1 && i>0 && j>0)
 	{
 		for (int n = 1; n < 5; n++)
-			sOverflow[n * (nrows * ncols) + i * ncols + j] = 0.0;
+			sOverflow[OUTFLOW(n, i * ncols + j, nrows * ncols)] = 0.0;
 	}
 }
\ No newline at end of file
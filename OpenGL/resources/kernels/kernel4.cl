@@ -0,0 +1,74 @@
+// Built after kernel1.cl, which defines REAL and the minimization (outflows)
+
+
+/*	Outflows of the cell (i, j) as kernel1 computes them, into flows[1..4] instead of sOverflow
+	(zero for the eliminated neighbours).
+	*/
+void cellOutflows(
+	const int i,
+	const int j,
+	const int ncols,
+	const float dFactor,
+	__global REAL* z,
+	__global REAL* hThickness,
+	REAL* flows
+)
+{
+	int Vi[5] = { i, i - 1, i, i, i + 1 };
+	int Vj[5] = { j, j, j - 1, j + 1, j };
+
+	REAL h[5];
+	h[0] = z[(i * ncols) + j];
+	for (int n = 1; n < 5; n++)
+		h[n] = z[(Vi[n] * ncols) + Vj[n]] + hThickness[(Vi[n] * ncols) + Vj[n]];
+	outflows(hThickness[(i * ncols) + j], h, dFactor, flows);
+}
+
+/*	Outflow-free step (see gatherExecutor.h): the cells of the balance region
+	[row0, row1) x [col0, col1) compute their own outflows and the inflows from their
+	neighbours, and write their new thickness into hNext; the other cells copy it.
+	*/
+__kernel void kernel4(
+	const int nrows,
+	const int ncols,
+	const float dFactor,
+	const int nneighbors,
+	const float noDataValue,
+	const int row0,
+	const int row1,
+	const int col0,
+	const int col1,
+	__global REAL* z,
+	__global REAL* hThickness,
+	__global REAL* hNext
+)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	if (z[(i * ncols) + j] != noDataValue && i >= row0 && i < row1 && j >= col0 && j < col1 && i < nrows - 1 && j < ncols - 1 && i > 0 && j > 0)
+	{
+		int Vi[5] = { i, i - 1, i, i, i + 1 };
+		int Vj[5] = { j, j, j - 1, j + 1, j };
+		REAL own[5];
+		REAL neighbour[5];
+		cellOutflows(i, j, ncols, dFactor, z, hThickness, own);
+
+		// the same sums as kernel2, a neighbour out of the bounds of kernel1 or with no data sends nothing
+		REAL temph = hThickness[(i * ncols) + j];
+		for (int n = 1; n < 5; n++)
+		{
+			REAL inflow = 0.0;
+			if (Vi[n] > 0 && Vi[n] < nrows - 1 && Vj[n] > 0 && Vj[n] < ncols - 1 && z[(Vi[n] * ncols) + Vj[n]] != noDataValue)
+			{
+				cellOutflows(Vi[n], Vj[n], ncols, dFactor, z, hThickness, neighbour);
+				inflow = neighbour[5 - n];
+			}
+			temph += inflow;
+			temph -= own[n];
+		}
+		hNext[(i * ncols) + j] = temph;
+	}
+	else
+		hNext[(i * ncols) + j] = hThickness[(i * ncols) + j];
+}
@@ -18,6 +18,7 @@
 #include "flow.h"
 #include "openClTester.h"
 #include "initProgram.h"
+#include "simulation.h"
 
 
 
@@ -37,9 +38,15 @@ float lastFrame = 0.0f;
 
 int main(int argc, char** argv)
 {
-	if (initProgram(argc, argv) == -1)
+	// -1: done without the viewer (a test, a benchmark or a conversion), -2: the same with a failed check
+	int status = initProgram(argc, argv);
+	if (status == -1)
 		return 0;
+	if (status == -2)
+		return 1;
 
+	// the window is created while the startup tasks run on the worker pool
+	double windowStart = startupGraph.Now();
 	GLFWwindow* window;
 
 	/* Initialize the library */
@@ -71,11 +78,16 @@ int main(int argc, char** argv)
 		std::cout << "Error!" << std::endl;
 
 	std::cout << glGetString(GL_VERSION) << std::endl;
+	startupGraph.Record("window and GL context", windowStart, startupGraph.Now());
 
+	if (finishStartup() == -1)
 	{
-		positions = calculateVertices(nrows, ncols, dimension, ZData.values, cellsize, LData.values);
-		indices = calculatePositions(nrows, ncols, ZData.values);
-		calculateNormal(positions, indices, 13, 10);
+		glfwTerminate();
+		return 0;
+	}
+
+	{
+		double resourcesStart = startupGraph.Now();
 
 		VertexArray va;
 		VertexBuffer vb(positions.data(), positions.size() * sizeof(float));
@@ -93,7 +105,7 @@ int main(int argc, char** argv)
 		ShaderHandler shader("../../../OpenGL/resources/shaders/Basic.shader");
 		shader.Bind();
 
-		Texture texture("../../../OpenGL/resources/textures/texture.png");
+		Texture texture(textureImage);
 		texture.Bind();
 
 		va.Unbind();
@@ -102,6 +114,8 @@ int main(int argc, char** argv)
 		shader.Unbind();
 
 		Renderer renderer;
+		startupGraph.Record("GL resources", resourcesStart, startupGraph.Now());
+		bool firstFrame = true;
 
 		float r = 0.0f;
 		float increment = 0.5f;
@@ -152,31 +166,43 @@ int main(int argc, char** argv)
 
 			va.Bind();
 
-			if (steps > 0 && flag == true)
+			if (replaying)
+			{
+				// recorded lava flow, one frame per rendered frame
+				if (flag == true)
+					replaySeek((long long)replayFrame + 1);
+			}
+			else if (steps > 0 && flag == true)
 			{
 				// lava flow
-				if (parallel)
-					run(nrows, ncols, VON_NEUMANN_NEIGHBORS, NoDataValue);
-				else
-					globalTransitionFunction(Z.data(), H.data(), So, dumping_factor, nrows, ncols, neighborhood, NoDataValue);
+				simulationStep();
 				
 				//resetNormals(positions, nrows * ncols, 13, 10);
 				//calculateNormal(positions, indices, 13, 10);				
 				updateLava(positions, H, nrows * ncols, 13, 3);
-
-				steps--;
-
 			}
 			vb.UpdateData(positions.data(), positions.size() * sizeof(float));
 
 			/* Swap front and back buffers */
 			glfwSwapBuffers(window);
 
+			if (firstFrame)
+			{
+				startupGraph.Record("first frame", currentFrame - glfwGetTime() + startupGraph.Now(), startupGraph.Now());
+				startupGraph.Report(std::cout);
+				std::cout << "Time to first frame: " << startupGraph.Now() << " seconds" << std::endl << std::endl;
+				firstFrame = false;
+			}
+
 			/* Poll for and process events */
 			glfwPollEvents();
 		}
 
 	}
+	// completes the recording with its index
+	recordingWriter.reset();
+	if (!exportPath.empty())
+		exportLava(exportPath);
 	glfwTerminate();
 	return 0;
 }
@@ -206,6 +232,35 @@ void processInput(GLFWwindow* window)
 		flag = true;
 	if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS)
 		flag = false;
+
+	if (replaying)
+	{
+		// single frame steps react to the key press only, scrubbing keeps going while the key is held
+		static bool leftWasPressed = false;
+		static bool rightWasPressed = false;
+		bool leftPressed = glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS;
+		bool rightPressed = glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS;
+		if (leftPressed && !leftWasPressed)
+		{
+			flag = false;
+			replaySeek((long long)replayFrame - 1);
+		}
+		if (rightPressed && !rightWasPressed)
+		{
+			flag = false;
+			replaySeek((long long)replayFrame + 1);
+		}
+		leftWasPressed = leftPressed;
+		rightWasPressed = rightPressed;
+
+		long long scrub = std::max<long long>(1, replayReader.GetFrameCount() / 200);
+		if (glfwGetKey(window, GLFW_KEY_PAGE_UP) == GLFW_PRESS)
+			replaySeek((long long)replayFrame + scrub);
+		if (glfwGetKey(window, GLFW_KEY_PAGE_DOWN) == GLFW_PRESS)
+			replaySeek((long long)replayFrame - scrub);
+		if (glfwGetKey(window, GLFW_KEY_HOME) == GLFW_PRESS)
+			replaySeek(0);
+	}
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GL_TRUE);
 }
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file. The view stays valid until Close() or destruction.
+class MappedFile
+{
+	private:
+		const char* m_Data;
+		size_t m_Size;
+		void* m_File;		// HANDLE on Windows, file descriptor otherwise
+		void* m_Mapping;	// file mapping object (Windows only)
+
+	public:
+		MappedFile();
+		MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const std::string& path);
+		void Close();
+
+		inline const char* GetData() const { return m_Data; }
+		inline size_t GetSize() const { return m_Size; }
+		inline bool IsOpen() const { return m_Data != nullptr; }
+};
@@ -0,0 +1,113 @@
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <iomanip>
+
+TaskGraph::TaskGraph(): m_Pool(nullptr), m_Epoch(std::chrono::steady_clock::now())
+{
+}
+
+TaskGraph::TaskId TaskGraph::Add(const std::string& name, std::function<void()> fn, const std::vector<TaskId>& dependencies)
+{
+	TaskId id = (TaskId)m_Tasks.size();
+	m_Tasks.push_back({ name, std::move(fn), {}, (int)dependencies.size(), false, nullptr, 0.0, 0.0 });
+	for (TaskId dependency : dependencies)
+		m_Tasks[dependency].dependents.push_back(id);
+	return id;
+}
+
+void TaskGraph::Start(ThreadPool& pool)
+{
+	m_Pool = &pool;
+	for (TaskId id = 0; id < (TaskId)m_Tasks.size(); id++)
+		if (m_Tasks[id].pending == 0 && m_Tasks[id].fn)
+			m_Pool->Submit([this, id]() { Execute(id); });
+}
+
+void TaskGraph::Execute(TaskId id)
+{
+	m_Tasks[id].start = Now();
+	std::exception_ptr error;
+	try
+	{
+		m_Tasks[id].fn();
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+	Finish(id, error);
+}
+
+void TaskGraph::Finish(TaskId id, std::exception_ptr error)
+{
+	std::vector<TaskId> ready;
+	std::vector<TaskId> failed;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		Task& task = m_Tasks[id];
+		task.end = Now();
+		task.error = error;
+		task.done = true;
+
+		for (TaskId dependent : task.dependents)
+		{
+			Task& next = m_Tasks[dependent];
+			if (error && !next.error)
+				next.error = error;
+			if (--next.pending == 0)
+				(next.error ? failed : ready).push_back(dependent);
+		}
+	}
+	m_Finished.notify_all();
+
+	for (TaskId next : ready)
+		m_Pool->Submit([this, next]() { Execute(next); });
+	for (TaskId next : failed)
+		Finish(next, m_Tasks[next].error);
+}
+
+void TaskGraph::Wait(TaskId id)
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Finished.wait(lock, [this, id]() { return m_Tasks[id].done; });
+	if (m_Tasks[id].error)
+		std::rethrow_exception(m_Tasks[id].error);
+}
+
+void TaskGraph::WaitAll()
+{
+	for (TaskId id = 0; id < (TaskId)m_Tasks.size(); id++)
+		if (m_Tasks[id].fn)
+			Wait(id);
+}
+
+double TaskGraph::Now() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Epoch).count();
+}
+
+void TaskGraph::Record(const std::string& name, double start, double end)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Recorded.push_back({ name, start, end });
+}
+
+void TaskGraph::Report(std::ostream& out)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	std::vector<Stage> order(m_Recorded);
+	for (const Task& task : m_Tasks)
+		if (task.done)
+			order.push_back({ task.error ? task.name + " (failed)" : task.name, task.start, task.end });
+	std::sort(order.begin(), order.end(), [](const Stage& a, const Stage& b) { return a.start < b.start; });
+
+	out << "Startup stages (seconds from launch):" << std::endl;
+	out << std::fixed << std::setprecision(3);
+	for (const Stage& stage : order)
+		out << "\t" << std::left << std::setw(28) << stage.name << std::right
+			<< " start " << std::setw(7) << stage.start
+			<< "  end " << std::setw(7) << stage.end
+			<< "  took " << std::setw(7) << stage.end - stage.start << std::endl;
+	out << std::defaultfloat;
+}
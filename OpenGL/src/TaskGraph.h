@@ -0,0 +1,68 @@
+#pragma once
+
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+
+/*
+Small dependency graph of named tasks run on a ThreadPool. A task is submitted as soon as all
+the tasks it depends on are done; a failing task fails its dependents too, and Wait rethrows
+the exception. Start and end time of every task are kept for the timing report, which can
+also include stages timed by the caller (e.g. work that must stay on the main thread).
+*/
+class TaskGraph
+{
+	public:
+		typedef int TaskId;
+
+	private:
+		struct Task
+		{
+			std::string name;
+			std::function<void()> fn;
+			std::vector<TaskId> dependents;
+			int pending;
+			bool done;
+			std::exception_ptr error;
+			double start;
+			double end;
+		};
+
+		struct Stage
+		{
+			std::string name;
+			double start;
+			double end;
+		};
+
+		std::vector<Task> m_Tasks;
+		std::vector<Stage> m_Recorded;
+		ThreadPool* m_Pool;
+		std::mutex m_Mutex;
+		std::condition_variable m_Finished;
+		std::chrono::steady_clock::time_point m_Epoch;
+
+		void Execute(TaskId id);
+		void Finish(TaskId id, std::exception_ptr error);
+
+	public:
+		TaskGraph();
+
+		TaskGraph(const TaskGraph&) = delete;
+		TaskGraph& operator=(const TaskGraph&) = delete;
+
+		// Tasks must all be added before Start
+		TaskId Add(const std::string& name, std::function<void()> fn, const std::vector<TaskId>& dependencies = {});
+		void Start(ThreadPool& pool);
+
+		void Wait(TaskId id);
+		void WaitAll();
+
+		// Seconds elapsed since the graph was created
+		double Now() const;
+		void Record(const std::string& name, double start, double end);
+		void Report(std::ostream& out);
+};
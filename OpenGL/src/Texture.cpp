@@ -5,9 +5,32 @@
 
 Texture::Texture(const std::string& path): m_RenderedID(0), m_FilePath(path), m_LocalBuffer(nullptr), m_Width(0), m_Height(0), m_BPP(0)
 {
+	ImageData image = DecodeImage(path);
+	m_LocalBuffer = image.pixels;
+	m_Width = image.width;
+	m_Height = image.height;
+	m_BPP = image.bpp;
+
+	Upload();
+}
+
+Texture::Texture(ImageData& image): m_RenderedID(0), m_LocalBuffer(image.pixels), m_Width(image.width), m_Height(image.height), m_BPP(image.bpp)
+{
+	image.pixels = nullptr;
+
+	Upload();
+}
+
+ImageData Texture::DecodeImage(const std::string& path)
+{
+	ImageData image;
 	stbi_set_flip_vertically_on_load(1);
-	m_LocalBuffer = stbi_load(path.c_str(), &m_Width, &m_Height, &m_BPP, 4);
+	image.pixels = stbi_load(path.c_str(), &image.width, &image.height, &image.bpp, 4);
+	return image;
+}
 
+void Texture::Upload()
+{
 	GLCall(glGenTextures(1, &m_RenderedID));
 	GLCall(glBindTexture(GL_TEXTURE_2D, m_RenderedID));
 
@@ -22,6 +45,7 @@ Texture::Texture(const std::string& path): m_RenderedID(0), m_FilePath(path), m_
 
 	if (m_LocalBuffer)
 		stbi_image_free(m_LocalBuffer);
+	m_LocalBuffer = nullptr;
 }
 
 Texture::~Texture()
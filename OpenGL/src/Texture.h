@@ -2,6 +2,15 @@
 
 #include "Renderer.h"
 
+// Decoded RGBA pixels, owned until handed to a Texture
+struct ImageData
+{
+	unsigned char* pixels = nullptr;
+	int width = 0;
+	int height = 0;
+	int bpp = 0;
+};
+
 class Texture
 {
 	private:
@@ -10,10 +19,17 @@ class Texture
 		unsigned char* m_LocalBuffer;
 		int m_Width, m_Height, m_BPP;	// m_BPP - bytes per pixel
 
+		void Upload();
+
 	public:
 		Texture(const std::string& path);
+		// Uploads an image decoded beforehand (possibly on another thread) and frees its pixels
+		Texture(ImageData& image);
 		~Texture();
 
+		// Decodes an image file; safe to call without a GL context
+		static ImageData DecodeImage(const std::string& path);
+
 		void Bind(unsigned int slot = 0) const;
 		void UnBind() const;
 
@@ -0,0 +1,95 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <exception>
+
+ThreadPool::ThreadPool(unsigned int threads): m_Stopping(false)
+{
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	for (unsigned int t = 0; t < threads; t++)
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stopping = true;
+	}
+	m_Available.notify_all();
+
+	for (std::thread& worker : m_Workers)
+		worker.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Tasks.push_back(std::move(task));
+	}
+	m_Available.notify_one();
+}
+
+void ThreadPool::ParallelFor(int begin, int end, const std::function<void(int, int)>& fn)
+{
+	int count = end - begin;
+	if (count <= 0)
+		return;
+
+	int bands = std::min(count, (int)GetSize() + 1);
+	int pending = bands - 1;
+	std::exception_ptr error;
+	std::mutex doneMutex;
+	std::condition_variable done;
+
+	auto runBand = [&](int b)
+	{
+		try
+		{
+			fn(begin + int((long long)count * b / bands), begin + int((long long)count * (b + 1) / bands));
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(doneMutex);
+			if (!error)
+				error = std::current_exception();
+		}
+	};
+
+	for (int b = 1; b < bands; b++)
+		Submit([&, b]()
+		{
+			runBand(b);
+			std::lock_guard<std::mutex> lock(doneMutex);
+			if (--pending == 0)
+				done.notify_one();
+		});
+	runBand(0);
+
+	std::unique_lock<std::mutex> lock(doneMutex);
+	done.wait(lock, [&]() { return pending == 0; });
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void ThreadPool::WorkerLoop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Available.wait(lock, [this]() { return m_Stopping || !m_Tasks.empty(); });
+			if (m_Tasks.empty())
+				return;
+			task = std::move(m_Tasks.front());
+			m_Tasks.pop_front();
+		}
+		task();
+	}
+}
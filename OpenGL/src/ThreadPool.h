@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads consuming a FIFO queue of tasks
+class ThreadPool
+{
+	private:
+		std::vector<std::thread> m_Workers;
+		std::deque<std::function<void()>> m_Tasks;
+		std::mutex m_Mutex;
+		std::condition_variable m_Available;
+		bool m_Stopping;
+
+		void WorkerLoop();
+
+	public:
+		// threads = 0 starts one worker per hardware thread
+		ThreadPool(unsigned int threads = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void Submit(std::function<void()> task);
+
+		// Splits [begin, end) into one contiguous band per worker plus one for the calling thread,
+		// runs fn(bandBegin, bandEnd) on each and returns when all the bands are done, so that
+		// consecutive calls are separated by a barrier. The first exception thrown is rethrown.
+		void ParallelFor(int begin, int end, const std::function<void(int, int)>& fn);
+
+		inline unsigned int GetSize() const { return (unsigned int)m_Workers.size(); }
+};
@@ -211,7 +211,7 @@ static void resetNormals(std::vector<float>& vertices, unsigned int n, unsigned
 	}
 }
 
-static void updateLava(std::vector<float>& vertices, std::vector<double> lava, unsigned int n, unsigned int vSize, unsigned int offset)
+static void updateLava(std::vector<float>& vertices, const std::vector<double>& lava, unsigned int n, unsigned int vSize, unsigned int offset)
 {
 	for (int i = 0; i < n; i++)
 		if (lava[i] > 0 && lava[i] < lavaMax)
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "paddedGrid.h"
+#include "threadedExecutor.h"
+#include <vector>
+
+/*
+Temporally blocked CPU step (--block-steps=K). The unblocked steps stream Z, H and the outflows
+through memory at every step; here the grid is split into tiles of blockTile x blockTile cells,
+and each tile is copied with a halo into a small padded grid (see paddedGrid.h) that stays in
+cache while it is advanced K steps, after which only the tile itself is written back.
+
+The halo is 2K cells, not K: the new thickness of a cell depends on the outflows of its
+neighbours, which depend on the thickness of their own neighbours, so one step reads the state
+up to two cells away. Starting from the tile and its 2K halo, the cells that are still exact
+after step s are the tile grown by 2(K - s), so each step only updates those (a trapezoid in
+time), and the halo cells of a tile are recomputed by the neighbouring tiles (overlapped tiles).
+The tiles read the old thickness and write the new one into a second buffer, which then becomes
+H (ping-pong, as the gather step); where the grid is clipped, the halo of the padded grid is
+the one of the whole grid, so the results are identical to K unblocked steps.
+
+Only the tiles covering the cells the lava can reach in K steps (the active region grown by 2K)
+are advanced. The cost is the work of the halos, (1 + 4K / blockTile) times the cells of a step
+or so, against one pass over memory every K steps instead of every step; see --bench=blocking.
+*/
+
+std::vector<double> HBlocked;
+Region lastBlockRegion = { 0, 0, 0, 0 };
+
+void initBlocked()
+{
+	HBlocked = H;
+	lastBlockRegion = { 0, 0, 0, 0 };
+}
+
+// Advances the cells of a tile depth steps, from Sh into next; local is the scratch padded grid
+static void advanceTile(PaddedGrid& local, const Region& tile, const double* Sz, const double* Sh, double* next, double dumping_factor, int r, int c, double nodata, int depth)
+{
+	Region extended = intersect(dilate(tile, 2 * depth), gridRegion(r, c));
+	loadPaddedRegion(local, Sz, Sh, r, c, nodata, extended);
+
+	Region inner = { tile.row0 - extended.row0, tile.row1 - extended.row0, tile.col0 - extended.col0, tile.col1 - extended.col0 };
+	for (int s = depth - 1; s >= 0; s--)
+		paddedTransitionFunction(local, dumping_factor, dilate(inner, 2 * s + 1), dilate(inner, 2 * s));
+
+	for (int i = tile.row0; i < tile.row1; i++)
+	{
+		const double* row = local.h.data() + local.Index(i - extended.row0, inner.col0);
+		std::copy(row, row + (tile.col1 - tile.col0), next + size_t(i) * c + tile.col0);
+	}
+}
+
+// Tiles [t0, t1) of a region split in tiles of size x size cells, columns first
+static void advanceTiles(int t0, int t1, const Region& region, int size, const double* Sz, const double* Sh, double* next, double dumping_factor, int r, int c, double nodata, int depth)
+{
+	static thread_local PaddedGrid local;
+	int tileCols = (region.col1 - region.col0 + size - 1) / size;
+	for (int t = t0; t < t1; t++)
+	{
+		int i = region.row0 + (t / tileCols) * size;
+		int j = region.col0 + (t % tileCols) * size;
+		Region tile = { i, std::min(i + size, region.row1), j, std::min(j + size, region.col1) };
+		advanceTile(local, tile, Sz, Sh, next, dumping_factor, r, c, nodata, depth);
+	}
+}
+
+// depth steps on the cells of region (on the simulation pool when threaded); Sh then holds the new thickness and next the old one
+void runBlocked(const double* Sz, std::vector<double>& Sh, std::vector<double>& next, double dumping_factor, int r, int c, double nodata, const Region& region, int depth, int size)
+{
+	Region blocks = intersect(region, interiorRegion(r, c));
+	Region cells = enclose(blocks, lastBlockRegion);
+	lastBlockRegion = blocks;
+	if (isEmpty(cells))
+		return;
+
+	// the cells left out of the tiles keep their thickness
+	for (int i = cells.row0; i < cells.row1; i++)
+		for (int j = cells.col0; j < cells.col1; j++)
+			if (!inside(blocks, i, j))
+				next[size_t(i) * c + j] = Sh[size_t(i) * c + j];
+
+	if (!isEmpty(blocks))
+	{
+		int tiles = ((blocks.row1 - blocks.row0 + size - 1) / size) * ((blocks.col1 - blocks.col0 + size - 1) / size);
+		if (threaded)
+			simulationPool->ParallelFor(0, tiles, [&](int t0, int t1)
+			{
+				advanceTiles(t0, t1, blocks, size, Sz, Sh.data(), next.data(), dumping_factor, r, c, nodata, depth);
+			});
+		else
+			advanceTiles(0, tiles, blocks, size, Sz, Sh.data(), next.data(), dumping_factor, r, c, nodata, depth);
+	}
+	Sh.swap(next);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include "blockedExecutor.h"
+#include "threadedExecutor.h"
+#include "solverTester.h"
+#include "stepTester.h"
+
+#include "util.hpp"
+
+// Runs steps on a copy of the grid in blocks of depth steps (the unblocked fused sweep on the simulation pool when depth is 0); returns the steps per second and the final thickness
+static double timeBlocking(const std::vector<double>& z, const std::vector<double>& h, int r, int c, double nodata, int steps, int depth, std::vector<double>& result)
+{
+	Region grid = gridRegion(r, c);
+	result = h;
+	util::Timer timer;
+	if (depth == 0)
+	{
+		size_t size = size_t(r) * c;
+		std::vector<double> so(size * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+		double* planes[VON_NEUMANN_NEIGHBORS] = { NULL };		// So[0] is not used
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			planes[n] = so.data() + (n - 1) * size;
+		timer.reset();
+		for (int s = 0; s < steps; s++)
+			runThreaded(const_cast<double*>(z.data()), result.data(), planes, dumping_factor, r, c, nodata, grid, grid);
+	}
+	else
+	{
+		std::vector<double> next = h;
+		lastBlockRegion = { 0, 0, 0, 0 };
+		for (int s = 0; s < steps; s += depth)
+			runBlocked(z.data(), result, next, dumping_factor, r, c, nodata, grid, std::min(depth, steps - s), blockTile);
+		lastBlockRegion = { 0, 0, 0, 0 };
+	}
+	return steps / (static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0);
+}
+
+// The fastest block depth on a grid, as a speedup over the unblocked steps
+struct BlockingGain
+{
+	int depth = 0;
+	double speedup = 0;
+};
+
+/*	Times the blocks of depth 1 to 8 against the unblocked fused sweep, the step they replace: the
+	reference run when serial, the threaded sweep otherwise. The thickness must be the one of the
+	reference run. Returns the failed comparisons, and the best depth in gain.
+	*/
+static int compareBlocking(const BenchGrid& grid, const ReferenceRun& reference, BlockingGain& gain)
+{
+	std::vector<double> result, differing;
+	double unblocked = grid.steps / reference.seconds;
+	if (threaded)
+	{
+		unblocked = timeBlocking(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, 0, result);
+		if (result != reference.h)
+			differing = result;
+	}
+	std::cout << "unblocked " << unblocked << " steps/s";
+	gain = BlockingGain();
+	for (int depth = 1; depth <= 8; depth++)
+	{
+		double rate = timeBlocking(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, depth, result);
+		if (differing.empty() && result != reference.h)
+			differing = result;
+		if (rate / unblocked > gain.speedup)
+			gain = { depth, rate / unblocked };
+		std::cout << ", k=" << depth << " " << rate << " (" << rate / unblocked << "x)";
+	}
+	std::cout << ", ";
+	return !compareWithReference(differing.empty() ? result : differing, reference);
+}
+
+// Returns the failed comparisons
+int testBlocking(const char* zPath, const char* lPath)
+{
+	std::cout << "Temporal blocking benchmark, " << blockTile << "x" << blockTile << " tiles" << std::endl;
+
+	/*	From 4096x4096 on the substates outgrow the last level cache of most machines, so the
+		unblocked steps become bound by the memory bandwidth: the crossover is the smallest grid
+		from which a block depth beats them on every larger grid, so that a single noisy win on a
+		small grid does not count.
+		*/
+	const int sizes[6] = { 256, 512, 1024, 2048, 4096, 8192 };
+	BenchGrids grids = [&sizes](int index, BenchGrid& grid)
+	{
+		if (index == 6)
+			return false;
+		grid.r = grid.c = sizes[index];
+		grid.label = "random, all wet, " + std::to_string((size_t(grid.r) * grid.c * (2 + VON_NEUMANN_NEIGHBORS) * sizeof(double)) >> 20) + " MB of substates";
+		grid.steps = 8 * std::max(1, (1 << 21) / (grid.r * grid.c));
+		randomLavaField(grid.r, grid.c, index + 1, 1.0, 0.0, grid.z, grid.h);
+		return true;
+	};
+	int crossover[2] = { 0, 0 };
+	BlockingGain crossoverGain[2];
+	BenchStep step = [&](const BenchGrid& grid, const ReferenceRun& reference)
+	{
+		BlockingGain gain;
+		int failures = compareBlocking(grid, reference, gain);
+		if (grid.index < 0)
+			return failures;
+		if (gain.speedup <= 1)
+			crossover[threaded] = 0;
+		else if (crossover[threaded] == 0)
+		{
+			crossover[threaded] = grid.r;
+			crossoverGain[threaded] = gain;
+		}
+		return failures;
+	};
+	int failures = benchStep(zPath, lPath, grids, 40, step);
+
+	for (int backend = 0; backend < 2; backend++)
+	{
+		std::cout << "\tcrossover, " << (backend == 1 ? "threaded" : "serial") << ": ";
+		if (crossover[backend] == 0)
+			std::cout << "no block depth beats the unblocked steps up to " << sizes[5] << "x" << sizes[5] << std::endl;
+		else
+			std::cout << "blocks beat the unblocked steps from " << crossover[backend] << "x" << crossover[backend] << " (k=" << crossoverGain[backend].depth
+				<< ", " << crossoverGain[backend].speedup << "x)" << std::endl;
+	}
+	return reportFailures(failures);
+}
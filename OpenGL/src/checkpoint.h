@@ -0,0 +1,226 @@
+#pragma once
+
+#include "globals.h"
+#include "MappedFile.h"
+#include "openClExecutor.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Checkpoint/restart of the simulation state. A checkpoint holds the step counters, the model
+parameters, the thickness layer H and the four outflow layers So[1..4]. Z is not stored since
+it comes from the input grid; a hash of it is kept to refuse restarting on different terrain.
+
+The stepping loop only pays for a memcpy of the state into a snapshot: the snapshot is handed
+to a background thread that writes it to a temporary file and renames it over the previous
+checkpoint, so a crash while writing never leaves a truncated checkpoint behind. If the writer
+is still busy when the next checkpoint is due, the pending snapshot is replaced by the newer one.
+*/
+
+const char CHECKPOINT_MAGIC[8] = { 'L', 'A', 'V', 'A', 'C', 'K', 'P', '\0' };
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t neighbors;		// VON_NEUMANN_NEIGHBORS
+	uint32_t nrows;
+	uint32_t ncols;
+	uint64_t step;			// steps already computed
+	int64_t remaining;		// steps still to compute
+	double dumpingFactor;
+	double NoDataValue;
+	uint64_t zHash;			// FNV-1a of the Z layer
+	uint64_t payloadOffset;	// H followed by So[1..neighbors-1], nrows * ncols doubles each
+};
+
+static uint64_t hashLayer(const double* values, size_t count)
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t k = 0; k < count * sizeof(double); k++)
+	{
+		hash ^= bytes[k];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+class CheckpointWriter
+{
+	private:
+		struct Snapshot
+		{
+			CheckpointHeader header;
+			std::vector<double> payload;
+		};
+
+		std::string m_Path;
+		Snapshot m_Pending;
+		bool m_HasPending;
+		bool m_Stopping;
+		std::mutex m_Mutex;
+		std::condition_variable m_Wake;
+		std::thread m_Thread;
+
+		void Write(const Snapshot& snapshot)
+		{
+			std::string temp = m_Path + ".tmp";
+			FILE* out = fopen(temp.c_str(), "wb");
+			if (out == NULL)
+			{
+				std::cout << "Cannot write checkpoint " << temp << std::endl;
+				return;
+			}
+			char padding[64] = {};
+			fwrite(&snapshot.header, sizeof(snapshot.header), 1, out);
+			fwrite(padding, 1, snapshot.header.payloadOffset - sizeof(snapshot.header), out);
+			fwrite(snapshot.payload.data(), sizeof(double), snapshot.payload.size(), out);
+			bool failed = ferror(out) != 0;
+			if (fclose(out) != 0 || failed)
+			{
+				std::cout << "Cannot write checkpoint " << temp << std::endl;
+				return;
+			}
+
+#if defined(_WIN32)
+			// rename does not replace an existing file on Windows
+			remove(m_Path.c_str());
+#endif
+			if (rename(temp.c_str(), m_Path.c_str()) != 0)
+				std::cout << "Cannot replace checkpoint " << m_Path << std::endl;
+		}
+
+		void Loop()
+		{
+			Snapshot snapshot;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_Mutex);
+					m_Wake.wait(lock, [this]() { return m_Stopping || m_HasPending; });
+					if (!m_HasPending)
+						return;
+					std::swap(snapshot, m_Pending);
+					m_HasPending = false;
+				}
+				Write(snapshot);
+			}
+		}
+
+	public:
+		CheckpointWriter(const std::string& path): m_Path(path), m_HasPending(false), m_Stopping(false)
+		{
+			m_Thread = std::thread(&CheckpointWriter::Loop, this);
+		}
+
+		// Writes the last pending snapshot, if any, before returning
+		~CheckpointWriter()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Stopping = true;
+			}
+			m_Wake.notify_one();
+			m_Thread.join();
+		}
+
+		// Copies the state into the pending snapshot; layers are nrows * ncols doubles each, missing outflow layers are stored as zeros
+		void Save(const CheckpointHeader& header, const double* h, double* const so[])
+		{
+			size_t n = size_t(header.nrows) * header.ncols;
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Pending.header = header;
+			m_Pending.payload.resize(n * header.neighbors);
+			memcpy(m_Pending.payload.data(), h, n * sizeof(double));
+			for (uint32_t k = 1; k < header.neighbors; k++)
+				if (so[k])
+					memcpy(m_Pending.payload.data() + n * k, so[k], n * sizeof(double));
+				else
+					memset(m_Pending.payload.data() + n * k, 0, n * sizeof(double));
+			m_HasPending = true;
+			lock.unlock();
+			m_Wake.notify_one();
+		}
+};
+
+std::unique_ptr<CheckpointWriter> checkpointWriter;
+
+// Snapshots the current state into the background writer
+static void saveCheckpoint()
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.neighbors = VON_NEUMANN_NEIGHBORS;
+	header.nrows = nrows;
+	header.ncols = ncols;
+	header.step = currentStep;
+	header.remaining = steps;
+	header.dumpingFactor = dumping_factor;
+	header.NoDataValue = NoDataValue;
+	header.zHash = zHash;
+	header.payloadOffset = 64 * ((sizeof(header) + 63) / 64);
+
+	if (parallel && !gather)
+	{
+		// the device holds the outflows; H is copied back after every step
+		std::vector<double> deviceSo(SoSize);
+		readDevice(SoB, SoSize, deviceSo.data());
+		double* planes[VON_NEUMANN_NEIGHBORS];
+		for (int k = 0; k < VON_NEUMANN_NEIGHBORS; k++)
+			planes[k] = deviceSo.data() + size_t(k) * nrows * ncols;
+		checkpointWriter->Save(header, H.data(), planes);
+	}
+	else
+		checkpointWriter->Save(header, H.data(), So);
+}
+
+static void checkpointIfDue()
+{
+	if (checkpointWriter && checkpointInterval > 0 && currentStep % checkpointInterval == 0)
+		saveCheckpoint();
+}
+
+// Restores H, So, the step counters and the parameters from a checkpoint; Z must be loaded already
+static void restoreCheckpoint(const std::string& path)
+{
+	MappedFile file;
+	if (!file.Open(path))
+		throw std::runtime_error("Cannot open checkpoint: " + path);
+	if (file.GetSize() < sizeof(CheckpointHeader) || memcmp(file.GetData(), CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+		throw std::runtime_error("Not a checkpoint: " + path);
+
+	const CheckpointHeader& header = *reinterpret_cast<const CheckpointHeader*>(file.GetData());
+	size_t n = size_t(header.nrows) * header.ncols;
+	if (header.version != CHECKPOINT_VERSION || header.neighbors != VON_NEUMANN_NEIGHBORS)
+		throw std::runtime_error("Unsupported checkpoint version: " + path);
+	if (header.nrows != (uint32_t)nrows || header.ncols != (uint32_t)ncols)
+		throw std::runtime_error("Checkpoint grid size does not match the input grids");
+	if (header.payloadOffset + n * header.neighbors * sizeof(double) > file.GetSize())
+		throw std::runtime_error("Truncated checkpoint: " + path);
+	if (header.zHash != zHash)
+		throw std::runtime_error("Checkpoint was taken on a different altitudes grid");
+
+	const double* payload = reinterpret_cast<const double*>(file.GetData() + header.payloadOffset);
+	H.assign(payload, payload + n);
+	for (int k = 1; k < VON_NEUMANN_NEIGHBORS; k++)
+		if (So[k])
+			memcpy(So[k], payload + n * k, n * sizeof(double));
+
+	currentStep = int(header.step);
+	steps = int(header.remaining);
+	dumping_factor = float(header.dumpingFactor);
+
+	std::cout << "Restarted from " << path << " at step " << currentStep << ", " << steps << " steps to go" << std::endl;
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Compact domain (--compact). The cells the transition function updates, the interior cells with
+data, are stored contiguously in Z-order (Morton order: the cells of a 2^k x 2^k square are
+consecutive, so the neighbours of a cell are mostly close to it in memory), followed by the
+ghost cells: the no-data and border cells next to them, which are never updated but are read
+as neighbours (they hold their altitude and their frozen thickness, and the lava flowing into
+them is lost). The neighbour table, built once when the grid is loaded, gives the four
+neighbours of each cell as compact indices; every cell has exactly four, so the rows of the
+table need no offsets (a CSR table with a constant degree) and replace initNeighborhood.
+
+The kernels run over the updated cells only, with no bounds and no no-data test, so memory and
+time follow the area with data instead of the grid rectangle: 88 bytes per updated cell (Z, H,
+the four outflows, the four neighbours and the grid index) and 56 per ghost, against 56 per
+cell of the grid. The outflows are stored per cell as with --layout=quads and the ghosts have
+zero outflows. The operations of a cell are the ones of flow.h, so the results are identical.
+The compact indices are size_t, as the grid offsets of the other steps, so the domain holds as
+many cells as the grid.
+
+The steps follow the active region (see simulation.h): the codes of the cells of a box lie
+between the codes of its corners, so the cells of the outflow and balance regions are found in
+one range of the domain by binary search, and the cells of that range outside the box are
+skipped with a bounds test. A range can be much longer than the box when the box straddles a
+large power of two boundary, at worst the whole domain, so a step costs between the cells of
+the box and the cells of the domain. As in the fused sweep, the outflows of the previous outflow
+region are cleared when it is not covered (clearCompactOutflows), and H is updated over the
+balance region.
+*/
+
+struct CompactDomain
+{
+	size_t cells = 0;		// updated cells, stored first
+	size_t ghosts = 0;		// their neighbours that are not updated, stored after them
+	int rows = 0;		// of the grid
+	int cols = 0;
+	std::vector<double> z, h, so;		// so: the outflow n of cell k at 4 * k + n - 1
+	std::vector<size_t> neighbors;	// the neighbour n of cell k at 4 * k + n - 1
+	std::vector<size_t> gridIndex;	// of every compact cell, ghosts included
+
+	size_t Bytes() const
+	{
+		return (z.size() + h.size() + so.size()) * sizeof(double) + neighbors.size() * sizeof(size_t) + gridIndex.size() * sizeof(size_t);
+	}
+};
+
+CompactDomain compactDomain;
+
+// Cells per index of the ParallelFor of the threaded steps, whose int range would not hold the cells of a large domain
+const size_t COMPACT_CHUNK = 4096;
+
+// Interleaves the bits of i and j
+static inline uint64_t mortonCode(uint32_t i, uint32_t j)
+{
+	uint64_t code = 0;
+	for (int b = 0; b < 32; b++)
+		code |= (uint64_t((i >> b) & 1) << (2 * b + 1)) | (uint64_t((j >> b) & 1) << (2 * b));
+	return code;
+}
+
+// Builds the domain of an r x c grid, with the thickness of Sh; mask, when given, leaves out the cells where it is 0
+void buildCompactDomain(CompactDomain& d, const double* Sz, const double* Sh, int r, int c, double nodata, const unsigned char* mask = NULL)
+{
+	Region interior = interiorRegion(r, c);
+	std::vector<std::pair<uint64_t, size_t> > order;
+	for (int i = interior.row0; i < interior.row1; i++)
+		for (int j = interior.col0; j < interior.col1; j++)
+			if (Sz[size_t(i) * c + j] != nodata && (!mask || mask[size_t(i) * c + j]))
+				order.push_back(std::make_pair(mortonCode(i, j), size_t(i) * c + j));
+	std::sort(order.begin(), order.end());
+
+	const size_t noCell = SIZE_MAX;
+	d.cells = order.size();
+	d.ghosts = 0;
+	d.rows = r;
+	d.cols = c;
+	d.gridIndex.resize(order.size());
+	std::vector<size_t> compactIndex(size_t(r) * c, noCell);
+	for (size_t k = 0; k < d.cells; k++)
+	{
+		d.gridIndex[k] = order[k].second;
+		compactIndex[order[k].second] = k;
+	}
+
+	const ptrdiff_t offsets[VON_NEUMANN_NEIGHBORS] = { 0, -c, -1, 1, c };
+	d.neighbors.resize(d.cells * (VON_NEUMANN_NEIGHBORS - 1));
+	for (size_t k = 0; k < d.cells; k++)
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			size_t neighbor = d.gridIndex[k] + offsets[n];
+			if (compactIndex[neighbor] == noCell)
+			{
+				compactIndex[neighbor] = d.cells + d.ghosts++;
+				d.gridIndex.push_back(neighbor);
+			}
+			d.neighbors[k * (VON_NEUMANN_NEIGHBORS - 1) + n - 1] = compactIndex[neighbor];
+		}
+
+	d.z.resize(d.gridIndex.size());
+	d.h.resize(d.gridIndex.size());
+	for (size_t k = 0; k < d.gridIndex.size(); k++)
+	{
+		d.z[k] = Sz[d.gridIndex[k]];
+		d.h[k] = Sh[d.gridIndex[k]];
+	}
+	d.so.assign(d.gridIndex.size() * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+}
+
+// Whether the compact cell k is in a region of the grid
+static inline bool insideCompact(const CompactDomain& d, size_t k, const Region& region)
+{
+	return inside(region, int(d.gridIndex[k] / d.cols), int(d.gridIndex[k] % d.cols));
+}
+
+// The first updated cell whose Morton code is not below code
+static size_t compactLowerBound(const CompactDomain& d, uint64_t code)
+{
+	size_t low = 0, high = d.cells;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (mortonCode(uint32_t(d.gridIndex[middle] / d.cols), uint32_t(d.gridIndex[middle] % d.cols)) < code)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// The updated cells [k0, k1) holding the ones of a region of the grid, with others
+static void compactRange(const CompactDomain& d, const Region& region, size_t& k0, size_t& k1)
+{
+	Region cells = intersect(region, gridRegion(d.rows, d.cols));
+	if (isEmpty(cells))
+	{
+		k0 = k1 = 0;
+		return;
+	}
+	k0 = compactLowerBound(d, mortonCode(cells.row0, cells.col0));
+	k1 = compactLowerBound(d, mortonCode(cells.row1 - 1, cells.col1 - 1) + 1);
+}
+
+// The thickness of the updated cells of a region into Sh
+void storeCompactThickness(const CompactDomain& d, double* Sh, const Region& region)
+{
+	size_t k0, k1;
+	compactRange(d, region, k0, k1);
+	for (size_t k = k0; k < k1; k++)
+		if (insideCompact(d, k, region))
+			Sh[d.gridIndex[k]] = d.h[k];
+}
+
+// Zeroes the outflows of the updated cells of a region, as clearOutflows (flow.h)
+void clearCompactOutflows(CompactDomain& d, const Region& region)
+{
+	size_t k0, k1;
+	compactRange(d, region, k0, k1);
+	for (size_t k = k0; k < k1; k++)
+		if (insideCompact(d, k, region))
+			std::fill(&d.so[k * (VON_NEUMANN_NEIGHBORS - 1)], &d.so[k * (VON_NEUMANN_NEIGHBORS - 1)] + VON_NEUMANN_NEIGHBORS - 1, 0.0);
+}
+
+// kernel1_outflow_computation of flow.h for the cells of region among [k0, k1), on the neighbour table
+static void compactOutflows(CompactDomain& d, size_t k0, size_t k1, const Region& region, double dumping_factor)
+{
+	for (size_t k = k0; k < k1; k++)
+	{
+		if (!insideCompact(d, k, region))
+			continue;
+		const size_t* cells = &d.neighbors[k * (VON_NEUMANN_NEIGHBORS - 1)];
+		double H[VON_NEUMANN_NEIGHBORS];
+		H[0] = d.z[k];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			H[n] = d.z[cells[n - 1]] + d.h[cells[n - 1]];
+
+		double flows[VON_NEUMANN_NEIGHBORS];
+		outflows(d.h[k], H, dumping_factor, flows);
+		double* so = &d.so[k * (VON_NEUMANN_NEIGHBORS - 1)];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			so[n - 1] = flows[n];
+	}
+}
+
+// kernel2_mass_balance of flow.h for the cells of region among [k0, k1)
+static void compactBalance(CompactDomain& d, size_t k0, size_t k1, const Region& region)
+{
+	for (size_t k = k0; k < k1; k++)
+	{
+		if (!insideCompact(d, k, region))
+			continue;
+		const size_t* cells = &d.neighbors[k * (VON_NEUMANN_NEIGHBORS - 1)];
+		const double* so = &d.so[k * (VON_NEUMANN_NEIGHBORS - 1)];
+		double h = d.h[k];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			h += d.so[cells[n - 1] * (VON_NEUMANN_NEIGHBORS - 1) + VON_NEUMANN_NEIGHBORS - n - 1];
+			h -= so[n - 1];
+		}
+		d.h[k] = h;
+	}
+}
+
+// Runs fn over [k0, k1) on the pool, in chunks of COMPACT_CHUNK cells
+static void compactParallelFor(ThreadPool& pool, size_t k0, size_t k1, const std::function<void(size_t, size_t)>& fn)
+{
+	int chunks = int((k1 - k0 + COMPACT_CHUNK - 1) / COMPACT_CHUNK);
+	pool.ParallelFor(0, chunks, [&](int c0, int c1) { fn(k0 + size_t(c0) * COMPACT_CHUNK, std::min(k1, k0 + size_t(c1) * COMPACT_CHUNK)); });
+}
+
+// One step on the cells of the domain in the outflow and balance regions, the outflows before the balances (on the pool when given)
+void compactTransitionFunction(CompactDomain& d, double dumping_factor, ThreadPool* pool, const Region& outflow, const Region& balance)
+{
+	size_t outflow0, outflow1, balance0, balance1;
+	compactRange(d, outflow, outflow0, outflow1);
+	compactRange(d, balance, balance0, balance1);
+	if (pool)
+	{
+		compactParallelFor(*pool, outflow0, outflow1, [&](size_t k0, size_t k1) { compactOutflows(d, k0, k1, outflow, dumping_factor); });
+		compactParallelFor(*pool, balance0, balance1, [&](size_t k0, size_t k1) { compactBalance(d, k0, k1, balance); });
+	}
+	else
+	{
+		compactOutflows(d, outflow0, outflow1, outflow, dumping_factor);
+		compactBalance(d, balance0, balance1, balance);
+	}
+}
+
+// One step on compactDomain (on the simulation pool when threaded), then H updated over balance
+void runCompact(double* Sh, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	compactTransitionFunction(compactDomain, dumping_factor, threaded ? &*simulationPool : NULL, outflow, balance);
+	storeCompactThickness(compactDomain, Sh, balance);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "globals.h"
+#include <iostream>
+
+/*
+Convergence monitor (--converge[=TOLERANCE], --converge-steps=N). The mass balance measures every
+step: the largest change of the thickness of a cell, the total outflow over the cells and the cells
+with lava, fused in its sweep on the CPU (see kernel2_mass_balance in flow.h and runThreaded) and
+reduced per work-group on the device (see kernel2_monitored). The outflow is compared per wet cell:
+a total grows with the extent of the flow, so a wide flow would never settle under a tolerance that
+suits a small one. Once the largest change and the outflow per wet cell stay within the tolerance
+for N consecutive steps the flow has settled: the remaining steps are dropped and reported as saved,
+and the viewer goes on rendering the last state without stepping.
+
+A step within the tolerance moves no cell by more than it, so N steps within it move a cell by at
+most N times the tolerance; the lava can still creep slower than that after the stop.
+*/
+
+StepChange stepChange;		// of the last step, filled by the backend when converge is set
+int settledSteps = 0;		// consecutive steps within the tolerance
+
+// Clears the change before a step is measured into it
+static StepChange* beginStepChange()
+{
+	if (!converge)
+		return NULL;
+	stepChange = StepChange();
+	return &stepChange;
+}
+
+// Counts the measured step; returns true once convergeSteps consecutive steps have settled
+static bool stepSettled(const StepChange& change)
+{
+	if (change.maxDelta <= convergeTolerance && change.MeanOutflow() <= convergeTolerance)
+		settledSteps++;
+	else
+		settledSteps = 0;
+	return settledSteps >= convergeSteps;
+}
+
+// Stops the run when the flow has settled, reporting the steps it saves
+static void stopIfConverged()
+{
+	if (!converge || steps <= 0 || !stepSettled(stepChange))
+		return;
+	std::cout << "Converged at step " << currentStep << ": max |dh| " << stepChange.maxDelta << ", outflow per wet cell " << stepChange.MeanOutflow()
+		<< " within " << convergeTolerance << " for " << convergeSteps << " steps, " << steps << " steps saved" << std::endl;
+	steps = 0;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "ThreadPool.h"
+#include <vector>
+
+#include "flow.h"
+
+/*
+Substate layouts. The kernels of flow.h are templates over a layout policy (PlaneLayout, over
+the separate Z, H and So[1..4] planes, is the one of the simulation), so that the storage of the
+grid can change without touching the algorithm. The layouts below own their substates and add
+Load/StoreThickness to move from/to the planes:
+
+ - PlaneGrid: PlaneLayout over planes of its own, as the simulation stores them. kernel2 reads
+   six different cache lines per cell: its h, its four outflows and the inflows.
+ - QuadLayout: the four outflows of a cell next to each other (So[cell * 4 + n - 1]), so a cell
+   writes one cache line in kernel1 and reads its outflows from one in kernel2.
+ - PackedLayout: quads for the outflows and Z and H of a cell in one {z, h} record, so kernel1
+   finds the altitude and the thickness of a neighbour in the same line.
+
+The kernels are the same in every layout, so the results are identical; which one is faster
+depends on the grid size and the backend, see --bench=layout.
+*/
+
+struct PlaneGrid : PlaneLayout
+{
+	static const char* Name() { return "plane"; }
+
+	std::vector<double> z, h, so;
+	double* planes[VON_NEUMANN_NEIGHBORS];
+
+	void Load(const double* Z, const double* H, size_t n)
+	{
+		z.assign(Z, Z + n);
+		h.assign(H, H + n);
+		so.assign(n * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+		planes[0] = NULL;
+		for (int k = 1; k < VON_NEUMANN_NEIGHBORS; k++)
+			planes[k] = so.data() + (k - 1) * n;
+		Sz = z.data();
+		Sh = h.data();
+		So = planes;
+	}
+	void StoreThickness(double* H) const { std::copy(h.begin(), h.end(), H); }
+};
+
+struct QuadLayout
+{
+	static const char* Name() { return "quads"; }
+	typedef double Real;
+	static const bool Compensated = false;
+
+	std::vector<double> z, h, so;
+
+	void Load(const double* Z, const double* H, size_t n)
+	{
+		z.assign(Z, Z + n);
+		h.assign(H, H + n);
+		so.assign(n * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+	}
+	void StoreThickness(double* H) const { std::copy(h.begin(), h.end(), H); }
+
+	double Altitude(size_t k) const { return z[k]; }
+	double Thickness(size_t k) const { return h[k]; }
+	void SetThickness(size_t k, double value) { h[k] = value; }
+	double Outflow(size_t k, int n) const { return so[k * (VON_NEUMANN_NEIGHBORS - 1) + n - 1]; }
+	void SetOutflow(size_t k, int n, double value) { so[k * (VON_NEUMANN_NEIGHBORS - 1) + n - 1] = value; }
+};
+
+struct PackedLayout
+{
+	static const char* Name() { return "packed"; }
+	typedef double Real;
+	static const bool Compensated = false;
+
+	struct Cell
+	{
+		double z;
+		double h;
+	};
+
+	std::vector<Cell> cells;
+	std::vector<double> so;
+
+	void Load(const double* Z, const double* H, size_t n)
+	{
+		cells.resize(n);
+		for (size_t k = 0; k < n; k++)
+			cells[k] = { Z[k], H[k] };
+		so.assign(n * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+	}
+	void StoreThickness(double* H) const
+	{
+		for (size_t k = 0; k < cells.size(); k++)
+			H[k] = cells[k].h;
+	}
+
+	double Altitude(size_t k) const { return cells[k].z; }
+	double Thickness(size_t k) const { return cells[k].h; }
+	void SetThickness(size_t k, double value) { cells[k].h = value; }
+	double Outflow(size_t k, int n) const { return so[k * (VON_NEUMANN_NEIGHBORS - 1) + n - 1]; }
+	void SetOutflow(size_t k, int n, double value) { so[k * (VON_NEUMANN_NEIGHBORS - 1) + n - 1] = value; }
+};
+
+// The fused sweep of the region overload of globalTransitionFunction (flow.h)
+template <class Layout>
+void layoutTransitionFunction(Layout& g, double dumping_factor, int r, int c, double nodata, const Region& outflow, const Region& balance)
+{
+	Region sweep = interiorRegion(r, c);
+	Region k1 = intersect(outflow, sweep);
+	Region k2 = intersect(balance, sweep);
+	int row0 = std::min(k1.row0, k2.row0);
+	int row1 = std::max(k1.row1, k2.row1);
+
+	typename Layout::Real noData(nodata);
+	Neighborhood V;
+	for (int i = row0; i <= row1; i++)
+	{
+		if (i >= k1.row0 && i < k1.row1)
+			for (int j = k1.col0; j < k1.col1; j++)
+				if (g.Altitude(size_t(i) * c + j) != noData)
+					kernel1_outflow_computation(g, c, i, j, dumping_factor, V);
+
+		int b = i - 1;
+		if (b >= k2.row0 && b < k2.row1)
+			for (int j = k2.col0; j < k2.col1; j++)
+				if (g.Altitude(size_t(b) * c + j) != noData)
+					kernel2_mass_balance(g, c, b, j, V);
+	}
+}
+
+// The two passes of runThreaded (threadedExecutor.h)
+template <class Layout>
+void layoutTransitionFunctionThreaded(ThreadPool& pool, Layout& g, double dumping_factor, int r, int c, double nodata, const Region& outflow, const Region& balance)
+{
+	Region sweep = interiorRegion(r, c);
+	Region k1 = intersect(outflow, sweep);
+	Region k2 = intersect(balance, sweep);
+	if (isEmpty(k1))
+		return;
+
+	typename Layout::Real noData(nodata);
+	pool.ParallelFor(k1.row0, k1.row1, [&](int row0, int row1)
+	{
+		Neighborhood V;
+		for (int i = row0; i < row1; i++)
+			for (int j = k1.col0; j < k1.col1; j++)
+				if (g.Altitude(size_t(i) * c + j) != noData)
+					kernel1_outflow_computation(g, c, i, j, dumping_factor, V);
+	});
+
+	pool.ParallelFor(k2.row0, k2.row1, [&](int row0, int row1)
+	{
+		Neighborhood V;
+		for (int i = row0; i < row1; i++)
+			for (int j = k2.col0; j < k2.col1; j++)
+				if (g.Altitude(size_t(i) * c + j) != noData)
+					kernel2_mass_balance(g, c, i, j, V);
+	});
+}
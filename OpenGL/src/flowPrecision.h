@@ -0,0 +1,153 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include "flowLayout.h"
+#include <vector>
+
+/*
+Precision policies. A PrecisionGrid is a layout of flow.h (see flowLayout.h) whose Real is the
+type of the substates and of the arithmetic of the policy, so that the kernels of flow.h run in
+single precision, halving the memory traffic (and using the fp32 units of the devices with a
+poor fp64 throughput, see the -DREAL build option of the OpenCL kernels); the double reference
+is the simulation itself:
+ - FloatPrecision: float substates and arithmetic.
+ - MixedPrecision: float substates and arithmetic, with compensated (Kahan) summation in the
+   mass balance. The rounding error of every addition of the balance is kept (TwoSum) and the
+   part of the new thickness that does not fit in a float is carried to the next step in a
+   compensation layer, so h + compensation is the thickness with about twice the precision.
+
+The outflow leaving a cell and the one entering its neighbour are the same stored value, so the
+steps conserve the lava volume up to the rounding of the balance (and the lava flowing into the
+no-data and border cells, which is lost in every mode). With u = 2^-24 the float unit roundoff,
+that rounding moves the total volume V by up to about 9u V per step in float, a drift growing
+with the steps; with the compensation it is about 20u^2 V per step, so |V(N) - V(0)| stays
+below 20 N u^2 V, 7e-9 V after 10^5 steps. The outflows themselves are computed in float in
+both modes, from altitudes stored in float too: around 1000 m a float is only exact to about
+6e-5 m, and that rounding of the heads (z + h) changes which neighbours are eliminated where the
+heads are close, so the thickness drifts away from the double one as the steps go, by up to
+about 2 m on the input DEMs after 1000 steps; see --bench=precision.
+*/
+
+struct FloatPrecision
+{
+	typedef float Real;
+	static const bool Compensated = false;
+	static const char* Name() { return "float"; }
+};
+
+struct MixedPrecision
+{
+	typedef float Real;
+	static const bool Compensated = true;
+	static const char* Name() { return "mixed"; }
+};
+
+// Z, H, the compensation of H (mixed precision only) and the outflow planes in the precision of a policy
+template <class Precision>
+struct PrecisionGrid
+{
+	typedef typename Precision::Real Real;
+	static const bool Compensated = Precision::Compensated;
+
+	int rows = 0;
+	int cols = 0;
+	size_t size = 0;
+	Real nodata = 0;
+	std::vector<Real> z, h, compensation, so;
+
+	void Load(const double* Z, const double* H, int r, int c, double noDataValue)
+	{
+		rows = r;
+		cols = c;
+		size = size_t(r) * c;
+		nodata = Real(noDataValue);
+		z.assign(Z, Z + size);
+		h.assign(H, H + size);
+		// the compensation starts with the part of H lost in the conversion
+		compensation.resize(Precision::Compensated ? size : 0);
+		for (size_t k = 0; k < compensation.size(); k++)
+			compensation[k] = Real(H[k] - double(h[k]));
+		so.assign(size * (VON_NEUMANN_NEIGHBORS - 1), Real(0));
+	}
+
+	// The thickness of the cells of a region, compensation included, into H
+	void StoreThickness(double* H, const Region& region) const
+	{
+		Region cells = intersect(region, gridRegion(rows, cols));
+		for (int i = cells.row0; i < cells.row1; i++)
+			for (int j = cells.col0; j < cells.col1; j++)
+			{
+				size_t k = size_t(i) * cols + j;
+				H[k] = Precision::Compensated ? double(h[k]) + double(compensation[k]) : double(h[k]);
+			}
+	}
+
+	// Zeroes the outflows of the cells of a region, as clearOutflows (flow.h)
+	void ClearOutflows(const Region& region)
+	{
+		Region cells = intersect(region, gridRegion(rows, cols));
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			for (int i = cells.row0; i < cells.row1; i++)
+				std::fill(Outflows(n) + size_t(i) * cols + cells.col0, Outflows(n) + size_t(i) * cols + cells.col1, Real(0));
+	}
+
+	// Total lava volume, in cell units
+	double Volume() const
+	{
+		double volume = 0;
+		for (size_t k = 0; k < size; k++)
+			volume += Precision::Compensated ? double(h[k]) + double(compensation[k]) : double(h[k]);
+		return volume;
+	}
+
+	Real* Outflows(int n) { return so.data() + (n - 1) * size; }
+
+	Real Altitude(size_t k) const { return z[k]; }
+	Real Thickness(size_t k) const { return h[k]; }
+	void SetThickness(size_t k, Real value) { h[k] = value; }
+	Real Outflow(size_t k, int n) const { return so[(n - 1) * size + k]; }
+	void SetOutflow(size_t k, int n, Real value) { so[(n - 1) * size + k] = value; }
+	Real Compensation(size_t k) const { return compensation[k]; }
+	void SetCompensation(size_t k, Real value) { compensation[k] = value; }
+};
+
+// The substates of the CPU step with --precision=float or mixed
+PrecisionGrid<FloatPrecision> floatGrid;
+PrecisionGrid<MixedPrecision> mixedGrid;
+
+void initPrecision()
+{
+	if (precision == PRECISION_FLOAT)
+		floatGrid.Load(Z.data(), H.data(), nrows, ncols, NoDataValue);
+	else
+		mixedGrid.Load(Z.data(), H.data(), nrows, ncols, NoDataValue);
+}
+
+void clearPrecisionOutflows(const Region& region)
+{
+	if (precision == PRECISION_FLOAT)
+		floatGrid.ClearOutflows(region);
+	else
+		mixedGrid.ClearOutflows(region);
+}
+
+template <class Precision>
+static void runPrecision(PrecisionGrid<Precision>& g, double* Sh, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	if (threaded)
+		layoutTransitionFunctionThreaded(*simulationPool, g, dumping_factor, g.rows, g.cols, g.nodata, outflow, balance);
+	else
+		layoutTransitionFunction(g, dumping_factor, g.rows, g.cols, g.nodata, outflow, balance);
+	g.StoreThickness(Sh, balance);
+}
+
+// One step in the selected precision (on the simulation pool when threaded), then H updated over balance
+void runPrecision(double* Sh, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	if (precision == PRECISION_FLOAT)
+		runPrecision(floatGrid, Sh, dumping_factor, outflow, balance);
+	else
+		runPrecision(mixedGrid, Sh, dumping_factor, outflow, balance);
+}
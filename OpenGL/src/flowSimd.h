@@ -0,0 +1,298 @@
+#pragma once
+
+#include "globals.h"
+#include "flow.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLOW_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only emit AVX instructions in functions built for those targets; MSVC always does
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+/*
+Vectorized kernel1: the minimization of the differences for 2 (SSE2), 4 (AVX2) or 8 (AVX-512)
+adjacent cells of a row at once, one cell per lane.
+
+The eliminated[] flags become lane masks and the do/while loop a loop of at most 5 passes that
+every lane goes through. That gives the same result as the scalar loop, bit for bit:
+ - a pass of the scalar loop either eliminates at least one of the 5 cells or is the last one,
+   so after 5 passes a lane has either converged, and its average is the one of its last pass,
+   or has eliminated all 5 cells and writes zero outflows only;
+ - once a lane has converged, the passes done for the other lanes recompute the same average
+   from the same cells, and eliminate nothing;
+ - the sums are accumulated in the same order as the scalar loop and the excluded terms are
+   masked out (blend), not added as 0.0, so even the sign of zero is preserved. The division,
+   the comparisons (ordered <=, unordered !=) and the final (average - H) * dumping_factor are
+   the same IEEE operations on the same operands.
+The passes stop early when no lane of the group eliminated anything. Like the scalar kernel,
+the eliminated neighbours and the lanes with m = 0 get zero outflows; the no-data lanes are left
+untouched.
+Cells beyond the last full group are left to the scalar kernel.
+*/
+
+enum SimdLevel
+{
+	SIMD_OFF = 0,
+	SIMD_SSE2 = 1,
+	SIMD_AVX2 = 2,
+	SIMD_AVX512 = 3
+};
+
+static const char* simdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+		case SIMD_SSE2: return "SSE2";
+		case SIMD_AVX2: return "AVX2";
+		case SIMD_AVX512: return "AVX-512";
+		default: return "scalar";
+	}
+}
+
+SimdLevel simdLevel = SIMD_OFF;
+
+// Widest instruction set supported by both the CPU and the operating system
+static SimdLevel detectSimdLevel()
+{
+#if !defined(FLOW_SIMD_X86)
+	return SIMD_OFF;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		if ((xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0)
+			return SIMD_AVX512;
+		if ((xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0)
+			return SIMD_AVX2;
+	}
+	return sse2 ? SIMD_SSE2 : SIMD_OFF;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	return __builtin_cpu_supports("sse2") ? SIMD_SSE2 : SIMD_OFF;
+#endif
+}
+
+#if defined(FLOW_SIMD_X86)
+
+SIMD_TARGET("sse2")
+static void kernel1_outflow_row_sse2(int c, int i, int j0, int j1, double* Sz, double* Sh, double* So[], double dumping_factor, double nodata, Neighborhood& V)
+{
+	const __m128d nd = _mm_set1_pd(nodata);
+	const __m128d df = _mm_set1_pd(dumping_factor);
+	const __m128d one = _mm_set1_pd(1.0);
+	int j = j0;
+	for (; j + 2 <= j1; j += 2)
+	{
+		size_t k = size_t(i) * c + j;
+		__m128d valid = _mm_cmpneq_pd(_mm_loadu_pd(Sz + k), nd);
+		if (_mm_movemask_pd(valid) == 0)
+			continue;
+
+		__m128d m = _mm_loadu_pd(Sh + k);
+		__m128d H[VON_NEUMANN_NEIGHBORS];
+		H[0] = _mm_loadu_pd(Sz + k);
+		H[1] = _mm_add_pd(_mm_loadu_pd(Sz + k - c), _mm_loadu_pd(Sh + k - c));
+		H[2] = _mm_add_pd(_mm_loadu_pd(Sz + k - 1), _mm_loadu_pd(Sh + k - 1));
+		H[3] = _mm_add_pd(_mm_loadu_pd(Sz + k + 1), _mm_loadu_pd(Sh + k + 1));
+		H[4] = _mm_add_pd(_mm_loadu_pd(Sz + k + c), _mm_loadu_pd(Sh + k + c));
+
+		__m128d eliminated[VON_NEUMANN_NEIGHBORS];
+		for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			eliminated[n] = _mm_setzero_pd();
+
+		__m128d average = m;
+		for (int pass = 0; pass < VON_NEUMANN_NEIGHBORS; pass++)
+		{
+			__m128d counter = _mm_setzero_pd();
+			average = m;
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				__m128d e = eliminated[n];
+				average = _mm_or_pd(_mm_and_pd(e, average), _mm_andnot_pd(e, _mm_add_pd(average, H[n])));
+				counter = _mm_or_pd(_mm_and_pd(e, counter), _mm_andnot_pd(e, _mm_add_pd(counter, one)));
+			}
+			average = _mm_div_pd(average, counter);
+
+			__m128d again = _mm_setzero_pd();
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				__m128d newly = _mm_andnot_pd(eliminated[n], _mm_cmple_pd(average, H[n]));
+				eliminated[n] = _mm_or_pd(eliminated[n], newly);
+				again = _mm_or_pd(again, newly);
+			}
+			if (_mm_movemask_pd(again) == 0)
+				break;
+		}
+
+		__m128d wet = _mm_cmpneq_pd(m, _mm_setzero_pd());
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			__m128d flow = _mm_and_pd(wet, _mm_andnot_pd(eliminated[n], _mm_mul_pd(_mm_sub_pd(average, H[n]), df)));
+			__m128d old = _mm_loadu_pd(So[n] + k);
+			_mm_storeu_pd(So[n] + k, _mm_or_pd(_mm_and_pd(valid, flow), _mm_andnot_pd(valid, old)));
+		}
+	}
+	for (; j < j1; j++)
+		if (get(Sz, c, i, j) != nodata)
+			kernel1_outflow_computation(c, i, j, Sz, Sh, So, dumping_factor, V);
+}
+
+SIMD_TARGET("avx2")
+static void kernel1_outflow_row_avx2(int c, int i, int j0, int j1, double* Sz, double* Sh, double* So[], double dumping_factor, double nodata, Neighborhood& V)
+{
+	const __m256d nd = _mm256_set1_pd(nodata);
+	const __m256d df = _mm256_set1_pd(dumping_factor);
+	const __m256d one = _mm256_set1_pd(1.0);
+	int j = j0;
+	for (; j + 4 <= j1; j += 4)
+	{
+		size_t k = size_t(i) * c + j;
+		__m256d valid = _mm256_cmp_pd(_mm256_loadu_pd(Sz + k), nd, _CMP_NEQ_UQ);
+		if (_mm256_movemask_pd(valid) == 0)
+			continue;
+
+		__m256d m = _mm256_loadu_pd(Sh + k);
+		__m256d H[VON_NEUMANN_NEIGHBORS];
+		H[0] = _mm256_loadu_pd(Sz + k);
+		H[1] = _mm256_add_pd(_mm256_loadu_pd(Sz + k - c), _mm256_loadu_pd(Sh + k - c));
+		H[2] = _mm256_add_pd(_mm256_loadu_pd(Sz + k - 1), _mm256_loadu_pd(Sh + k - 1));
+		H[3] = _mm256_add_pd(_mm256_loadu_pd(Sz + k + 1), _mm256_loadu_pd(Sh + k + 1));
+		H[4] = _mm256_add_pd(_mm256_loadu_pd(Sz + k + c), _mm256_loadu_pd(Sh + k + c));
+
+		__m256d eliminated[VON_NEUMANN_NEIGHBORS];
+		for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			eliminated[n] = _mm256_setzero_pd();
+
+		__m256d average = m;
+		for (int pass = 0; pass < VON_NEUMANN_NEIGHBORS; pass++)
+		{
+			__m256d counter = _mm256_setzero_pd();
+			average = m;
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				average = _mm256_blendv_pd(_mm256_add_pd(average, H[n]), average, eliminated[n]);
+				counter = _mm256_blendv_pd(_mm256_add_pd(counter, one), counter, eliminated[n]);
+			}
+			average = _mm256_div_pd(average, counter);
+
+			__m256d again = _mm256_setzero_pd();
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				__m256d newly = _mm256_andnot_pd(eliminated[n], _mm256_cmp_pd(average, H[n], _CMP_LE_OQ));
+				eliminated[n] = _mm256_or_pd(eliminated[n], newly);
+				again = _mm256_or_pd(again, newly);
+			}
+			if (_mm256_movemask_pd(again) == 0)
+				break;
+		}
+
+		__m256d wet = _mm256_cmp_pd(m, _mm256_setzero_pd(), _CMP_NEQ_UQ);
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			__m256d flow = _mm256_and_pd(wet, _mm256_andnot_pd(eliminated[n], _mm256_mul_pd(_mm256_sub_pd(average, H[n]), df)));
+			__m256d old = _mm256_loadu_pd(So[n] + k);
+			_mm256_storeu_pd(So[n] + k, _mm256_blendv_pd(old, flow, valid));
+		}
+	}
+	for (; j < j1; j++)
+		if (get(Sz, c, i, j) != nodata)
+			kernel1_outflow_computation(c, i, j, Sz, Sh, So, dumping_factor, V);
+}
+
+SIMD_TARGET("avx512f")
+static void kernel1_outflow_row_avx512(int c, int i, int j0, int j1, double* Sz, double* Sh, double* So[], double dumping_factor, double nodata, Neighborhood& V)
+{
+	const __m512d nd = _mm512_set1_pd(nodata);
+	const __m512d df = _mm512_set1_pd(dumping_factor);
+	const __m512d one = _mm512_set1_pd(1.0);
+	int j = j0;
+	for (; j + 8 <= j1; j += 8)
+	{
+		size_t k = size_t(i) * c + j;
+		__mmask8 valid = _mm512_cmp_pd_mask(_mm512_loadu_pd(Sz + k), nd, _CMP_NEQ_UQ);
+		if (valid == 0)
+			continue;
+
+		__m512d m = _mm512_loadu_pd(Sh + k);
+		__m512d H[VON_NEUMANN_NEIGHBORS];
+		H[0] = _mm512_loadu_pd(Sz + k);
+		H[1] = _mm512_add_pd(_mm512_loadu_pd(Sz + k - c), _mm512_loadu_pd(Sh + k - c));
+		H[2] = _mm512_add_pd(_mm512_loadu_pd(Sz + k - 1), _mm512_loadu_pd(Sh + k - 1));
+		H[3] = _mm512_add_pd(_mm512_loadu_pd(Sz + k + 1), _mm512_loadu_pd(Sh + k + 1));
+		H[4] = _mm512_add_pd(_mm512_loadu_pd(Sz + k + c), _mm512_loadu_pd(Sh + k + c));
+
+		__mmask8 eliminated[VON_NEUMANN_NEIGHBORS] = { 0, 0, 0, 0, 0 };
+
+		__m512d average = m;
+		for (int pass = 0; pass < VON_NEUMANN_NEIGHBORS; pass++)
+		{
+			__m512d counter = _mm512_setzero_pd();
+			average = m;
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				__mmask8 keep = (__mmask8)~eliminated[n];
+				average = _mm512_mask_add_pd(average, keep, average, H[n]);
+				counter = _mm512_mask_add_pd(counter, keep, counter, one);
+			}
+			average = _mm512_div_pd(average, counter);
+
+			__mmask8 again = 0;
+			for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+			{
+				__mmask8 newly = _mm512_mask_cmp_pd_mask((__mmask8)~eliminated[n], average, H[n], _CMP_LE_OQ);
+				eliminated[n] |= newly;
+				again |= newly;
+			}
+			if (again == 0)
+				break;
+		}
+
+		__mmask8 wet = _mm512_cmp_pd_mask(m, _mm512_setzero_pd(), _CMP_NEQ_UQ);
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			__m512d flow = _mm512_maskz_mul_pd((__mmask8)(wet & ~eliminated[n]), _mm512_sub_pd(average, H[n]), df);
+			_mm512_mask_storeu_pd(So[n] + k, (__mmask8)valid, flow);
+		}
+	}
+	for (; j < j1; j++)
+		if (get(Sz, c, i, j) != nodata)
+			kernel1_outflow_computation(c, i, j, Sz, Sh, So, dumping_factor, V);
+}
+
+#endif
+
+// Selects the row kernel used by the outflow passes; the requested level is lowered to what the CPU supports
+SimdLevel initSimd(SimdLevel requested)
+{
+	simdLevel = std::min(requested, detectSimdLevel());
+	outflowRowKernel = NULL;
+#if defined(FLOW_SIMD_X86)
+	if (simdLevel == SIMD_AVX512)
+		outflowRowKernel = kernel1_outflow_row_avx512;
+	else if (simdLevel == SIMD_AVX2)
+		outflowRowKernel = kernel1_outflow_row_avx2;
+	else if (simdLevel == SIMD_SSE2)
+		outflowRowKernel = kernel1_outflow_row_sse2;
+#endif
+	return simdLevel;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "globals.h"
+#include <algorithm>
+
+#include "flow.h"
+
+/*
+Closed-form alternative to the elimination loop of kernel1.
+
+The loop keeps the cells whose head H is below the average (m + sum of the kept H) / kept and
+starts over until nothing is eliminated. The kept cells are always the ones with the smallest
+heads, and the loop stops at the largest such prefix that is stable, i.e. whose highest head is
+still below the prefix average: a prefix between the current one and the next one the loop jumps
+to has an average not above the current average, which is not above its highest head, so it is
+never stable. Hence, with the five heads sorted (a fixed 9 comparator network, min/max only):
+
+	k* = max { k : sorted[k-1] < (m + sorted[0] + ... + sorted[k-1]) / k }
+
+found with one scan of the prefix sums. Equal heads are never split (if sorted[k-1] = sorted[k]
+and k is stable, so is k + 1), which the scan enforces explicitly against rounding, so the kept
+cells are the ones with H <= sorted[k*-1], and the average is the one of the scan, which is above
+all of them by construction. The outflows follow with selects: the solver runs in constant time,
+with no data-dependent loop, and a dry cell gets zero outflows as in the loop.
+With exact arithmetic the two solvers agree. In floating point they are only equal up to
+rounding: the average is summed in sorted order instead of index order, and the two can keep
+different cells when a head is within rounding of an average. The outflows then differ by a few
+ulps of the heads; --bench=solver fails when they differ by more than SORTED_TOLERANCE ulps of
+the highest head of the grid (see solverTester.h).
+*/
+
+static inline void compareExchange(double& a, double& b)
+{
+	double low = std::min(a, b);
+	b = std::max(a, b);
+	a = low;
+}
+
+void kernel1_outflow_sorted(int c, int i, int j, double* Sz, double* Sh, double* So[], double dumping_factor)
+{
+	double m = get(Sh, c, i, j);
+	double H[VON_NEUMANN_NEIGHBORS];
+	H[0] = get(Sz, c, i, j);
+	H[1] = get(Sz, c, i - 1, j) + get(Sh, c, i - 1, j);
+	H[2] = get(Sz, c, i, j - 1) + get(Sh, c, i, j - 1);
+	H[3] = get(Sz, c, i, j + 1) + get(Sh, c, i, j + 1);
+	H[4] = get(Sz, c, i + 1, j) + get(Sh, c, i + 1, j);
+
+	double s[VON_NEUMANN_NEIGHBORS] = { H[0], H[1], H[2], H[3], H[4] };
+	compareExchange(s[0], s[1]);
+	compareExchange(s[3], s[4]);
+	compareExchange(s[2], s[4]);
+	compareExchange(s[2], s[3]);
+	compareExchange(s[0], s[3]);
+	compareExchange(s[0], s[2]);
+	compareExchange(s[1], s[4]);
+	compareExchange(s[1], s[3]);
+	compareExchange(s[1], s[2]);
+
+	// largest stable prefix ending between two different heads, and its average
+	int kept = 0;
+	double sum = m;
+	double average = 0;
+	for (int k = 1; k <= VON_NEUMANN_NEIGHBORS; k++)
+	{
+		sum += s[k - 1];
+		bool boundary = k == VON_NEUMANN_NEIGHBORS || s[k - 1] < s[k];
+		bool stable = boundary && s[k - 1] < sum / k;
+		kept = stable ? k : kept;
+		average = stable ? sum / k : average;
+	}
+
+	// the kept cells are the ones with H <= threshold; none when no prefix is stable or the cell is dry
+	double threshold = s[std::max(kept, 1) - 1];
+	bool flowing = kept > 0 && m != 0;
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		set(So[n], c, i, j, flowing && H[n] <= threshold ? (average - H[n]) * dumping_factor : 0.0);
+}
+
+// Row kernel for outflowRowKernel
+static void kernel1_outflow_row_sorted(int c, int i, int j0, int j1, double* Sz, double* Sh, double* So[], double dumping_factor, double nodata, Neighborhood& V)
+{
+	for (int j = j0; j < j1; j++)
+		if (get(Sz, c, i, j) != nodata)
+			kernel1_outflow_sorted(c, i, j, Sz, Sh, So, dumping_factor);
+}
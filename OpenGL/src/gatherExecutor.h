@@ -0,0 +1,154 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include "openClExecutor.h"
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Outflow-free gather step (--gather). Instead of storing the outflows of every cell in So and
+reading them back in the mass balance, each cell computes its own outflows and the inflows from
+its four neighbours, by running the minimization of those neighbours again, and writes its new
+thickness into a second buffer, which then becomes H (ping-pong). So and SoB are not allocated
+at all: about 24 bytes per cell (Z, H and the second buffer) instead of 56, for five
+minimizations per cell instead of one. Every cell only writes its own thickness and only reads
+the old one, so a single pass over any partition of the grid is race free.
+
+The outflows are computed by the minimization of kernel1 (outflows in flow.h) and added up in the order of kernel2, and a
+neighbour outside the bounds of the outflow sweep or with no data sends nothing (its So would
+be zero), so the thickness is identical to the one of the So based step.
+
+The second buffer equals H outside the cells updated by the last step: each step updates the
+balance region and copies H over the cells of the previous balance region left out of it.
+*/
+
+std::vector<double> HNext;
+Region lastGatherRegion = { 0, 0, 0, 0 };
+
+// kernel1 for one cell, into flows[1..4] instead of So (zero for the eliminated neighbours)
+static inline void cellOutflows(int c, int i, int j, const double* Sz, const double* Sh, double dumping_factor, double flows[VON_NEUMANN_NEIGHBORS])
+{
+	size_t k = size_t(i) * c + j;
+	size_t cells[VON_NEUMANN_NEIGHBORS] = { k, k - c, k - 1, k + 1, k + c };
+	double H[VON_NEUMANN_NEIGHBORS];
+	H[0] = Sz[k];
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		H[n] = Sz[cells[n]] + Sh[cells[n]];
+	outflows(Sh[k], H, dumping_factor, flows);
+}
+
+// New thickness of a cell of the sweep: kernel2 with the outflows recomputed
+static inline double gatherCell(int c, int i, int j, const double* Sz, const double* Sh, double dumping_factor, double nodata, const Region& sweep)
+{
+	static const int di[VON_NEUMANN_NEIGHBORS] = { 0, -1, 0, 0, 1 };
+	static const int dj[VON_NEUMANN_NEIGHBORS] = { 0, 0, -1, 1, 0 };
+	double own[VON_NEUMANN_NEIGHBORS];
+	double neighbour[VON_NEUMANN_NEIGHBORS];
+	cellOutflows(c, i, j, Sz, Sh, dumping_factor, own);
+
+	double h = Sh[size_t(i) * c + j];
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+	{
+		int ni = i + di[n];
+		int nj = j + dj[n];
+		double inflow = 0.0;
+		if (inside(sweep, ni, nj) && Sz[size_t(ni) * c + nj] != nodata)
+		{
+			cellOutflows(c, ni, nj, Sz, Sh, dumping_factor, neighbour);
+			inflow = neighbour[VON_NEUMANN_NEIGHBORS - n];
+		}
+		h += inflow;
+		h -= own[n];
+	}
+	return h;
+}
+
+// Rows [row0, row1) of a gather step: the cells of balance are updated, the others of cells copied
+static void gatherRows(int row0, int row1, const Region& cells, const Region& balance, const Region& sweep, const double* Sz, const double* Sh, double* next, double dumping_factor, int c, double nodata)
+{
+	for (int i = row0; i < row1; i++)
+		for (int j = cells.col0; j < cells.col1; j++)
+		{
+			size_t k = size_t(i) * c + j;
+			if (inside(balance, i, j) && Sz[k] != nodata)
+				next[k] = gatherCell(c, i, j, Sz, Sh, dumping_factor, nodata, sweep);
+			else
+				next[k] = Sh[k];
+		}
+}
+
+void initGather()
+{
+	HNext = H;
+	lastGatherRegion = { 0, 0, 0, 0 };
+}
+
+// One gather step on the CPU (on the simulation pool when threaded); Sh then holds the new thickness and next the old one
+void runGather(double* Sz, std::vector<double>& Sh, std::vector<double>& next, double dumping_factor, int r, int c, double nodata, const Region& balance)
+{
+	Region sweep = interiorRegion(r, c);
+	Region k2 = intersect(balance, sweep);
+	Region cells = enclose(k2, lastGatherRegion);
+	lastGatherRegion = k2;
+	if (isEmpty(cells))
+		return;
+
+	if (threaded)
+		simulationPool->ParallelFor(cells.row0, cells.row1, [&](int row0, int row1)
+		{
+			gatherRows(row0, row1, cells, k2, sweep, Sz, Sh.data(), next.data(), dumping_factor, c, nodata);
+		});
+	else
+		gatherRows(cells.row0, cells.row1, cells, k2, sweep, Sz, Sh.data(), next.data(), dumping_factor, c, nodata);
+	Sh.swap(next);
+}
+
+// One gather step with OpenCL (kernel4), hB and hNextB are swapped and H updated
+void runGatherParallel(int nrows, int ncols, int nneighbors, float NDataValue, const Region& balance)
+{
+	try
+	{
+		cl::make_kernel<int, int, float, int, float, int, int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> kernel4(gather_step, "kernel4");
+
+		// the kernels check the same bounds themselves (0 < i < nrows - 1, 0 < j < ncols - 1)
+		Region k2 = intersect(balance, interiorRegion(nrows, ncols));
+		Region cells = enclose(k2, lastGatherRegion);
+		lastGatherRegion = k2;
+		if (isEmpty(cells))
+			return;
+
+		kernel4(
+			regionArgs(cells),
+			nrows,
+			ncols,
+			dumping_factor,
+			nneighbors,
+			NDataValue,
+			k2.row0,
+			k2.row1,
+			k2.col0,
+			k2.col1,
+			zB,
+			hB,
+			hNextB
+		);
+
+		std::swap(hB, hNextB);
+		queue.finish();
+
+		cl::copy(queue, hB, H.begin(), H.end());
+	}
+	catch (cl::Error err) {
+		std::cout << "Exception\n";
+		std::cerr
+			<< "ERROR: "
+			<< err.what()
+			<< "("
+			<< err_code(err.err())
+			<< ")"
+			<< std::endl;
+	}
+}
@@ -4,8 +4,18 @@
 
 #include "cl.hpp"
 #include<vector>
+#include <algorithm>
+// standard headers used by the worker threads; they must be seen before the get/set macros of flow.h
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <cstdint>
 #include "glm/glm.hpp"
 #include "camera.h"
+#include "region.h"
 
 struct FileData
 {
@@ -19,6 +29,24 @@ struct FileData
 
 };
 
+// Sub-window of a grid; rows are counted from the first (northernmost) row of the file
+struct GridWindow
+{
+	int row;
+	int col;
+	int rows;	// 0 = whole grid
+	int cols;
+};
+
+// Window given in world coordinates, resolved against xllcorner/yllcorner/cellsize
+struct WorldBox
+{
+	double xmin;
+	double ymin;
+	double xmax;
+	double ymax;
+};
+
 struct CellCoordinates {
 	int i;
 	int j;
@@ -40,6 +68,9 @@ float yllcorner = 0;
 
 float lavaMax = 0.0;
 int steps = 4000;
+int currentStep = 0;			// steps computed so far
+int checkpointInterval = 0;		// steps between checkpoints, 0 = no checkpoints
+uint64_t zHash = 0;				// identifies the altitudes grid in checkpoints
 
 std::vector<float> positions;
 std::vector<unsigned int> indices;
@@ -47,6 +78,10 @@ std::vector<unsigned int> indices;
 FileData ZData;
 FileData LData;
 
+GridWindow gridWindow = { 0, 0, 0, 0 };
+WorldBox worldBox;
+bool useWorldBox = false;
+
 float dumping_factor = 0.75;
 const int VON_NEUMANN_NEIGHBORS = 5;
 double* So[VON_NEUMANN_NEIGHBORS];
@@ -71,14 +106,73 @@ glm::vec3 lightPos;
 
 bool flag = false;
 bool parallel = false;
+bool threaded = false;	// multi-threaded CPU backend
+bool gather = false;	// outflow-free step, without So (see gatherExecutor.h)
+bool padded = false;	// CPU step on grids with a halo ring and a no-data mask (see paddedGrid.h)
+bool compact = false;	// CPU step on the cells with data only, in a compact array (see compactDomain.h)
+bool reach = false;		// crop the grid to the cells the lava can reach before the simulation (see reachability.h)
+double reachTolerance = 1.0;	// how far above its source head the lava may climb, in altitude units
+bool sparse = false;	// CPU step on blocks allocated when the lava reaches them (see sparseGrid.h)
+int blockSteps = 0;		// steps per temporal block on the CPU, 0 = no blocking (see blockedExecutor.h)
+int blockTile = 128;	// side of the tiles of the temporal blocks, in cells
+int numThreads = 0;		// worker threads for the CPU side, 0 = one per hardware thread
+
+// How kernel 1 finds the cells receiving outflows, see flowSorted.h
+enum OutflowSolver
+{
+	SOLVER_LOOP = 0,	// iterative elimination
+	SOLVER_SORTED = 1	// closed form on the sorted heads
+};
+OutflowSolver outflowSolver = SOLVER_LOOP;
+
+// Scalar type of the substates of the CPU and OpenCL steps, see flowPrecision.h
+enum PrecisionMode
+{
+	PRECISION_DOUBLE,
+	PRECISION_FLOAT,
+	PRECISION_MIXED
+};
+PrecisionMode precision = PRECISION_DOUBLE;
+
+// Largest change of the thickness of a cell, total outflow and cells with lava of a step, see convergence.h
+struct StepChange
+{
+	double maxDelta = 0;
+	double outflow = 0;
+	size_t wetCells = 0;		// balanced cells with lava before the step, over which the outflow is averaged
+
+	// Adds the change of another part of the step
+	void Merge(const StepChange& other)
+	{
+		maxDelta = std::max(maxDelta, other.maxDelta);
+		outflow += other.outflow;
+		wetCells += other.wetCells;
+	}
+
+	// Outflow per wet cell, which does not grow with the extent of the flow as the total does
+	double MeanOutflow() const
+	{
+		return outflow / double(std::max<size_t>(wetCells, 1));
+	}
+};
+bool converge = false;				// stop stepping once the flow has settled
+double convergeTolerance = 1e-6;	// below which maxDelta and the outflow per wet cell count as settled, in thickness units
+int convergeSteps = 100;			// consecutive settled steps that stop the run
+
+// OpenCL outflows stored per cell (So[cell * 4 + n - 1]) instead of one plane per neighbour, see flowLayout.h
+bool outflowQuads = false;
 
 cl::Context context;
 cl::Program outflow_computation;
 cl::Program mass_balance;
 cl::Program outflow_reset;
+cl::Program gather_step;
 
 cl::Buffer hB;
 cl::Buffer SoB;
+cl::Buffer hNextB;
+cl::Buffer hCompB;	// compensation of hB, --precision=mixed only
+cl::Buffer changeB;	// per work-group step change, --converge only
 cl::Buffer zB;
 
 cl::CommandQueue queue;
\ No newline at end of file
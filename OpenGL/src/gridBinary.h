@@ -0,0 +1,263 @@
+#pragma once
+
+#include "globals.h"
+#include "MappedFile.h"
+#include "gridParser.h"
+#include "gridFlt.h"
+#include "gridWriter.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+/*
+Native binary grid format. A file is a fixed 64-byte header followed by the raw values at a
+64-byte aligned offset, stored row by row in the same order as FileData::values (row 0 is the
+last row of the corresponding Ascii Grid file). Values and header fields are little endian.
+
+Loading maps the file and copies (or widens) the payload as is: no parsing is involved, so a
+large DEM is ready in the time it takes to page it in.
+*/
+
+const char GRID_BINARY_MAGIC[8] = { 'L', 'A', 'V', 'A', 'G', 'R', 'D', '\0' };
+const uint32_t GRID_BINARY_VERSION = 1;
+const uint64_t GRID_BINARY_ALIGNMENT = 64;
+
+enum GridDataType
+{
+	GRID_FLOAT32 = 1,
+	GRID_FLOAT64 = 2
+};
+
+struct GridBinaryHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t dtype;			// GridDataType
+	uint32_t ncols;
+	uint32_t nrows;
+	double xllcorner;
+	double yllcorner;
+	double cellsize;
+	double NoDataValue;
+	uint64_t payloadOffset;	// from the beginning of the file, multiple of GRID_BINARY_ALIGNMENT
+};
+
+static_assert(sizeof(GridBinaryHeader) == 64, "GridBinaryHeader must stay 64 bytes");
+
+static inline size_t gridDataTypeSize(uint32_t dtype)
+{
+	return dtype == GRID_FLOAT64 ? sizeof(double) : sizeof(float);
+}
+
+// A mapped binary grid; values stay valid as long as the view is alive
+struct GridBinaryView
+{
+	MappedFile file;
+	const GridBinaryHeader* header = nullptr;
+	const void* payload = nullptr;
+
+	size_t count() const { return size_t(header->nrows) * header->ncols; }
+};
+
+static bool isGridBinary(const char* data, size_t size)
+{
+	return size >= sizeof(GridBinaryHeader) && memcmp(data, GRID_BINARY_MAGIC, sizeof(GRID_BINARY_MAGIC)) == 0;
+}
+
+static bool isGridBinaryFile(const std::string& path)
+{
+	char magic[sizeof(GRID_BINARY_MAGIC)] = {};
+	std::ifstream in(path, std::ios::binary);
+	in.read(magic, sizeof(magic));
+	return in.gcount() == sizeof(magic) && isGridBinary(magic, sizeof(GridBinaryHeader));
+}
+
+static void openGridBinary(const std::string& path, GridBinaryView& view)
+{
+	if (!view.file.Open(path))
+		throw std::runtime_error("Cannot open file: " + path);
+	if (!isGridBinary(view.file.GetData(), view.file.GetSize()))
+		throw std::runtime_error("Not a binary grid: " + path);
+
+	view.header = reinterpret_cast<const GridBinaryHeader*>(view.file.GetData());
+	const GridBinaryHeader& h = *view.header;
+	if (h.version != GRID_BINARY_VERSION || (h.dtype != GRID_FLOAT32 && h.dtype != GRID_FLOAT64))
+		throw std::runtime_error("Unsupported binary grid version or type: " + path);
+	if (h.payloadOffset % GRID_BINARY_ALIGNMENT != 0 || h.payloadOffset + view.count() * gridDataTypeSize(h.dtype) > view.file.GetSize())
+		throw std::runtime_error("Truncated binary grid: " + path);
+
+	view.payload = view.file.GetData() + h.payloadOffset;
+}
+
+static void headerFromBinary(const GridBinaryHeader& h, FileData& data)
+{
+	data.ncols = h.ncols;
+	data.nrows = h.nrows;
+	data.xllcorner = float(h.xllcorner);
+	data.yllcorner = float(h.yllcorner);
+	data.cellsize = float(h.cellsize);
+	data.NoDataValue = float(h.NoDataValue);
+}
+
+static void readGridBinary(const GridBinaryView& view, FileData& data)
+{
+	headerFromBinary(*view.header, data);
+	data.values.resize(view.count());
+	if (view.header->dtype == GRID_FLOAT32)
+		memcpy(data.values.data(), view.payload, view.count() * sizeof(float));
+	else
+	{
+		const double* src = static_cast<const double*>(view.payload);
+		for (size_t k = 0; k < view.count(); k++)
+			data.values[k] = float(src[k]);
+	}
+}
+
+static FileData readGridBinary(const std::string& path)
+{
+	GridBinaryView view;
+	openGridBinary(path, view);
+
+	FileData data;
+	readGridBinary(view, data);
+	return data;
+}
+
+// Copies the window of a mapped grid; dst holds window.rows * window.cols values in FileData::values order
+template <typename Src, typename Dst>
+static void copyGridWindow(const GridBinaryHeader& h, const Src* src, const GridWindow& window, Dst* dst)
+{
+	for (int i = 0; i < window.rows; i++)
+	{
+		// window row i (from the top) lands in row window.rows - 1 - i, as file row window.row + i in the payload
+		const Src* from = src + size_t(h.nrows - 1 - (window.row + i)) * h.ncols + window.col;
+		Dst* to = dst + size_t(window.rows - 1 - i) * window.cols;
+		for (int j = 0; j < window.cols; j++)
+			to[j] = Dst(from[j]);
+	}
+}
+
+static void readGridBinaryWindow(const GridBinaryView& view, GridWindow window, const WorldBox* box, FileData& data, std::vector<double>& layer)
+{
+	headerFromBinary(*view.header, data);
+	window = resolveWindow(data, window, box);
+	applyWindow(data, window);
+
+	data.values.resize(size_t(data.nrows) * data.ncols);
+	if (view.header->dtype == GRID_FLOAT32)
+	{
+		copyGridWindow(*view.header, static_cast<const float*>(view.payload), window, data.values.data());
+		widenFloats(data.values, layer);
+	}
+	else
+	{
+		layer.resize(data.values.size());
+		copyGridWindow(*view.header, static_cast<const double*>(view.payload), window, layer.data());
+		for (size_t k = 0; k < layer.size(); k++)
+			data.values[k] = float(layer[k]);
+	}
+}
+
+// Creates a binary grid with the header of data, up to its payload, which the caller writes row by row
+static void createGridBinary(std::ofstream& out, const std::string& path, const FileData& data, GridDataType dtype)
+{
+	GridBinaryHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, GRID_BINARY_MAGIC, sizeof(h.magic));
+	h.version = GRID_BINARY_VERSION;
+	h.dtype = dtype;
+	h.ncols = data.ncols;
+	h.nrows = data.nrows;
+	h.xllcorner = data.xllcorner;
+	h.yllcorner = data.yllcorner;
+	h.cellsize = data.cellsize;
+	h.NoDataValue = data.NoDataValue;
+	h.payloadOffset = GRID_BINARY_ALIGNMENT;
+
+	out.open(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("Cannot create file: " + path);
+
+	char padding[GRID_BINARY_ALIGNMENT] = {};
+	out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	out.write(padding, h.payloadOffset - sizeof(h));
+}
+
+// Writes values (ncols * nrows, FileData::values order) with the header of data
+template <typename T>
+static void writeGridBinary(const std::string& path, const FileData& data, const T* values)
+{
+	static_assert(sizeof(T) == sizeof(float) || sizeof(T) == sizeof(double), "float or double payload only");
+
+	std::ofstream out;
+	createGridBinary(out, path, data, sizeof(T) == sizeof(double) ? GRID_FLOAT64 : GRID_FLOAT32);
+	out.write(reinterpret_cast<const char*>(values), std::streamsize(size_t(data.nrows) * data.ncols * sizeof(T)));
+	if (!out)
+		throw std::runtime_error("Cannot write file: " + path);
+}
+
+static void writeGridBinary(const std::string& path, const FileData& data, GridDataType dtype)
+{
+	if (dtype == GRID_FLOAT32)
+		writeGridBinary(path, data, data.values.data());
+	else
+	{
+		std::vector<double> wide(data.values.begin(), data.values.end());
+		writeGridBinary(path, data, wide.data());
+	}
+}
+
+// Loads a grid in any supported format together with its substate layer of doubles.
+// When gridWindow or worldBox select a region of interest only that region is loaded.
+static void loadLayer(const std::string& path, FileData& data, std::vector<double>& layer)
+{
+	bool windowed = gridWindow.rows > 0 || useWorldBox;
+	const WorldBox* box = useWorldBox ? &worldBox : NULL;
+
+	if (isGridBinaryFile(path))
+	{
+		GridBinaryView view;
+		openGridBinary(path, view);
+		if (windowed)
+		{
+			readGridBinaryWindow(view, gridWindow, box, data, layer);
+			return;
+		}
+		readGridBinary(view, data);
+		// a float64 payload is used as is, without the float round trip of FileData::values
+		if (view.header->dtype == GRID_FLOAT64)
+		{
+			const double* src = static_cast<const double*>(view.payload);
+			layer.assign(src, src + view.count());
+			return;
+		}
+	}
+	else if (isFltFile(path))
+		data = readFileFlt(path, gridWindow, box);
+	else if (windowed)
+		data = readFileWindow(path, gridWindow, box);
+	else
+		data = loadGrid(path);
+
+	widenFloats(data.values, layer);
+}
+
+// Converts an Ascii Grid (or a .flt/.hdr pair) into the binary format, or a binary grid back into an Ascii Grid
+static void convertGrid(const std::string& in, const std::string& out, GridDataType dtype)
+{
+	if (isGridBinaryFile(in))
+	{
+		GridBinaryView view;
+		openGridBinary(in, view);
+		FileData header;
+		headerFromBinary(*view.header, header);
+		if (view.header->dtype == GRID_FLOAT32)
+			writeFileAscii(out, header, static_cast<const float*>(view.payload));
+		else
+			writeFileAscii(out, header, static_cast<const double*>(view.payload));
+	}
+	else
+		writeGridBinary(out, isFltFile(in) ? readFileFlt(in) : loadGrid(in), dtype);
+}
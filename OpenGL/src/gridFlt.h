@@ -0,0 +1,161 @@
+#pragma once
+
+#include "globals.h"
+#include "MappedFile.h"
+#include "gridParser.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+Loader for Esri binary float grids: a .flt file of raw 32-bit floats, written row by row from
+the northernmost row like an Ascii Grid body, and a .hdr text file with the Ascii Grid header
+keywords plus BYTEORDER (LSBFIRST or MSBFIRST).
+
+The .flt file is memory mapped and each row is copied (byte swapped if the file order differs
+from the host one) into its FileData::values slot, with the same row order readFile produces.
+No text is parsed apart from the few header lines.
+*/
+
+static bool hasExtension(const std::string& path, const char* extension)
+{
+	size_t len = strlen(extension);
+	return path.size() > len && path[path.size() - len - 1] == '.'
+		&& headerKeyEquals(path.c_str() + path.size() - len, len, extension);
+}
+
+static bool isFltFile(const std::string& path)
+{
+	return hasExtension(path, "flt") || hasExtension(path, "hdr");
+}
+
+static std::string replaceExtension(const std::string& path, const char* extension)
+{
+	return path.substr(0, path.rfind('.') + 1) + extension;
+}
+
+static inline bool hostIsLittleEndian()
+{
+	const uint16_t one = 1;
+	unsigned char first;
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+// Parses a .hdr file into data; returns whether the values are stored most significant byte first
+static bool parseFltHeader(const std::string& path, FileData& data)
+{
+	MappedFile file;
+	if (!file.Open(path))
+		throw std::runtime_error("Cannot open file: " + path);
+
+	const char* p = file.GetData();
+	const char* end = p + file.GetSize();
+	bool xCenter = false, yCenter = false, msbFirst = false;
+	data.ncols = 0;
+	data.nrows = 0;
+	data.xllcorner = 0.0f;
+	data.yllcorner = 0.0f;
+	data.cellsize = 1.0f;
+	data.NoDataValue = -9999.0f;
+
+	while ((p = skipBlanks(p, end)) < end)
+	{
+		const char* key = p;
+		p = skipToken(p, end);
+		size_t keyLen = p - key;
+		const char* token = skipBlanks(p, end);
+		const char* tokenEnd = skipToken(token, end);
+		size_t tokenLen = tokenEnd - token;
+
+		if (headerKeyEquals(key, keyLen, "byteorder"))
+		{
+			if (headerKeyEquals(token, tokenLen, "msbfirst") || headerKeyEquals(token, tokenLen, "m"))
+				msbFirst = true;
+			else if (!headerKeyEquals(token, tokenLen, "lsbfirst") && !headerKeyEquals(token, tokenLen, "i"))
+				throw std::runtime_error("Unknown byte order in " + path);
+		}
+		else if (headerKeyEquals(key, keyLen, "pixeltype"))
+		{
+			if (!headerKeyEquals(token, tokenLen, "float") && !headerKeyEquals(token, tokenLen, "floats"))
+				throw std::runtime_error("Only float grids are supported: " + path);
+		}
+		else
+		{
+			float value = 0.0f;
+			bool numeric = scanFloat(token, tokenEnd, value) == tokenEnd && tokenLen > 0;
+			if (headerKeyEquals(key, keyLen, "ncols") && numeric)
+				data.ncols = static_cast<unsigned int>(value);
+			else if (headerKeyEquals(key, keyLen, "nrows") && numeric)
+				data.nrows = static_cast<unsigned int>(value);
+			else if ((headerKeyEquals(key, keyLen, "xllcorner") || (xCenter = headerKeyEquals(key, keyLen, "xllcenter"))) && numeric)
+				data.xllcorner = value;
+			else if ((headerKeyEquals(key, keyLen, "yllcorner") || (yCenter = headerKeyEquals(key, keyLen, "yllcenter"))) && numeric)
+				data.yllcorner = value;
+			else if (headerKeyEquals(key, keyLen, "cellsize") && numeric)
+				data.cellsize = value;
+			else if (headerKeyEquals(key, keyLen, "NODATA_value") && numeric)
+				data.NoDataValue = value;
+		}
+		p = skipLine(tokenEnd, end);
+	}
+
+	if (xCenter)
+		data.xllcorner -= data.cellsize / 2;
+	if (yCenter)
+		data.yllcorner -= data.cellsize / 2;
+
+	if (data.ncols == 0 || data.nrows == 0)
+		throw std::runtime_error("Invalid grid header: " + path);
+
+	return msbFirst;
+}
+
+// Copies count floats stored most significant byte first (msbFirst) or last into host order
+static inline void copyFltRow(const char* src, float* dst, size_t count, bool msbFirst)
+{
+	if (msbFirst != hostIsLittleEndian())
+	{
+		memcpy(dst, src, count * sizeof(float));
+		return;
+	}
+	// the value is assembled from the file order, so it lands in host order on either kind of host
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(src);
+	for (size_t j = 0; j < count; j++, bytes += 4)
+	{
+		uint32_t bits = msbFirst
+			? uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 | uint32_t(bytes[2]) << 8 | uint32_t(bytes[3])
+			: uint32_t(bytes[3]) << 24 | uint32_t(bytes[2]) << 16 | uint32_t(bytes[1]) << 8 | uint32_t(bytes[0]);
+		memcpy(dst + j, &bits, sizeof(bits));
+	}
+}
+
+// Loads a .flt/.hdr pair (either path can be given), or the window of it selected by window or box
+static FileData readFileFlt(const std::string& path, GridWindow window = { 0, 0, 0, 0 }, const WorldBox* box = NULL)
+{
+	FileData data;
+	bool msbFirst = parseFltHeader(replaceExtension(path, "hdr"), data);
+	// the row stride always refers to the full grid
+	size_t fullCols = data.ncols;
+
+	std::string fltPath = replaceExtension(path, "flt");
+	MappedFile file;
+	if (!file.Open(fltPath))
+		throw std::runtime_error("Cannot open file: " + fltPath);
+	if (file.GetSize() < size_t(data.nrows) * fullCols * sizeof(float))
+		throw std::runtime_error("Truncated float grid: " + fltPath);
+
+	window = resolveWindow(data, window, box);
+	applyWindow(data, window);
+
+	data.values.resize(size_t(data.nrows) * data.ncols);
+	for (int i = 0; i < window.rows; i++)
+	{
+		// file row window.row + i lands in row window.rows - 1 - i, as in readFile
+		const char* src = file.GetData() + (size_t(window.row + i) * fullCols + window.col) * sizeof(float);
+		copyFltRow(src, &data.values[size_t(window.rows - 1 - i) * window.cols], window.cols, msbFirst);
+	}
+	return data;
+}
@@ -0,0 +1,385 @@
+#pragma once
+
+#include "globals.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GRID_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+Zero-copy loader for Ascii Grid files (.asc/.dat). The file is memory mapped, the header is
+parsed once and every value is converted straight from the mapped bytes into its final slot
+of FileData::values, so no line strings, token strings or scratch vectors are built.
+
+The resulting values are laid out exactly as readFile produces them: the last row of the file
+becomes row 0, while the columns of every row keep their order.
+
+readFileParallel splits the mapped body into line-aligned chunks, one per worker. A first
+parallel pass counts the grid rows (non-blank lines) of every chunk, a prefix sum over those
+counts gives each chunk its first row, and a second parallel pass parses every row directly
+into its final slot. This relies on the usual one-row-per-line layout; files that wrap rows
+over several lines are detected and parsed serially instead.
+
+readFileWindow loads only a sub-window of the grid: rows above the window are skipped with a
+newline scan, the columns outside the window are skipped token by token without converting
+them, and reading stops after the last row of the window.
+*/
+
+static inline bool isBlank(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+static inline const char* skipBlanks(const char* p, const char* end)
+{
+	while (p < end && isBlank(*p))
+		p++;
+	return p;
+}
+
+static inline const char* skipLine(const char* p, const char* end)
+{
+	const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+	return nl ? nl + 1 : end;
+}
+
+// Converts the token starting at p (no leading blanks) into value; returns the first unparsed character or nullptr on error
+static inline const char* scanFloat(const char* p, const char* end, float& value)
+{
+	if (p < end && *p == '+')
+		p++;
+	std::from_chars_result res = std::from_chars(p, end, value);
+	if (res.ec != std::errc())
+		return nullptr;
+	return res.ptr;
+}
+
+static inline bool headerKeyEquals(const char* key, size_t len, const char* name)
+{
+	if (strlen(name) != len)
+		return false;
+	for (size_t i = 0; i < len; i++)
+		if ((key[i] | 0x20) != (name[i] | 0x20))
+			return false;
+	return true;
+}
+
+// Parses the header into data and returns a pointer to the first character of the grid body
+static const char* parseGridHeader(const char* p, const char* end, FileData& data)
+{
+	bool xCenter = false, yCenter = false;
+	data.ncols = 0;
+	data.nrows = 0;
+	data.xllcorner = 0.0f;
+	data.yllcorner = 0.0f;
+	data.cellsize = 1.0f;
+	data.NoDataValue = -9999.0f;
+
+	while (true)
+	{
+		p = skipBlanks(p, end);
+		// the body starts with the first line that does not begin with a keyword
+		if (p == end || !((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z'))
+			break;
+
+		const char* key = p;
+		while (p < end && !isBlank(*p))
+			p++;
+		size_t keyLen = p - key;
+		p = skipBlanks(p, end);
+
+		float value = 0.0f;
+		const char* next = scanFloat(p, end, value);
+		if (next == nullptr)
+			throw std::runtime_error("Invalid grid header value");
+
+		if (headerKeyEquals(key, keyLen, "ncols"))
+			data.ncols = static_cast<unsigned int>(value);
+		else if (headerKeyEquals(key, keyLen, "nrows"))
+			data.nrows = static_cast<unsigned int>(value);
+		else if (headerKeyEquals(key, keyLen, "xllcorner") || (xCenter = headerKeyEquals(key, keyLen, "xllcenter")))
+			data.xllcorner = value;
+		else if (headerKeyEquals(key, keyLen, "yllcorner") || (yCenter = headerKeyEquals(key, keyLen, "yllcenter")))
+			data.yllcorner = value;
+		else if (headerKeyEquals(key, keyLen, "cellsize"))
+			data.cellsize = value;
+		else if (headerKeyEquals(key, keyLen, "NODATA_value"))
+			data.NoDataValue = value;
+
+		p = skipLine(next, end);
+	}
+
+	if (xCenter)
+		data.xllcorner -= data.cellsize / 2;
+	if (yCenter)
+		data.yllcorner -= data.cellsize / 2;
+
+	if (data.ncols == 0 || data.nrows == 0)
+		throw std::runtime_error("Invalid grid header");
+
+	return p;
+}
+
+// Publishes the grid dimensions to the global simulation settings, as readFile does.
+// The loaders below leave the globals alone so that several grids can be loaded concurrently.
+static void publishGridHeader(const FileData& data)
+{
+	nrows = data.nrows;
+	ncols = data.ncols;
+	cellsize = data.cellsize;
+	NoDataValue = data.NoDataValue;
+}
+
+// Parses count values of one grid row starting at p into out; returns the first unparsed character
+static inline const char* parseGridRow(const char* p, const char* end, float* out, unsigned int count)
+{
+	for (unsigned int j = 0; j < count; j++)
+	{
+		p = skipBlanks(p, end);
+		p = scanFloat(p, end, out[j]);
+		if (p == nullptr)
+			throw std::runtime_error("Invalid or truncated grid body");
+	}
+	return p;
+}
+
+static FileData readFileMapped(const std::string& path)
+{
+	MappedFile file;
+	if (!file.Open(path))
+		throw std::runtime_error("Cannot open file: " + path);
+
+	const char* end = file.GetData() + file.GetSize();
+	FileData data;
+	const char* p = parseGridHeader(file.GetData(), end, data);
+
+	data.values.resize(size_t(data.nrows) * data.ncols);
+	for (unsigned int i = 0; i < data.nrows; i++)
+		p = parseGridRow(p, end, &data.values[size_t(data.nrows - 1 - i) * data.ncols], data.ncols);
+
+	return data;
+}
+
+// Number of grid rows (non-blank lines) in [p, end)
+static size_t countGridRows(const char* p, const char* end)
+{
+	size_t rows = 0;
+	while (p < end)
+	{
+		const char* next = skipLine(p, end);
+		while (p < next && isBlank(*p))
+			p++;
+		if (p < next)
+			rows++;
+		p = next;
+	}
+	return rows;
+}
+
+// Parses the rows of [p, end), the first of which is row firstRow of the file
+static void parseGridChunk(const char* p, const char* end, size_t firstRow, FileData& data)
+{
+	size_t row = firstRow;
+	while (p < end)
+	{
+		const char* next = skipLine(p, end);
+		p = skipBlanks(p, next);
+		if (p < next)
+		{
+			p = parseGridRow(p, next, &data.values[(data.nrows - 1 - row) * data.ncols], data.ncols);
+			if (skipBlanks(p, next) != next)
+				throw std::runtime_error("Grid row " + std::to_string(row) + " does not match ncols");
+			row++;
+		}
+		p = next;
+	}
+}
+
+static FileData readFileParallel(const std::string& path, unsigned int threads)
+{
+	MappedFile file;
+	if (!file.Open(path))
+		throw std::runtime_error("Cannot open file: " + path);
+
+	const char* end = file.GetData() + file.GetSize();
+	FileData data;
+	const char* body = parseGridHeader(file.GetData(), end, data);
+	data.values.resize(size_t(data.nrows) * data.ncols);
+
+	if (threads < 1)
+		threads = 1;
+
+	// line-aligned chunk boundaries
+	std::vector<const char*> bounds(threads + 1);
+	bounds[0] = body;
+	bounds[threads] = end;
+	for (unsigned int t = 1; t < threads; t++)
+	{
+		const char* guess = body + (end - body) * t / threads;
+		bounds[t] = guess > bounds[t - 1] ? skipLine(guess, end) : bounds[t - 1];
+	}
+
+	std::vector<size_t> firstRow(threads + 1, 0);
+	std::vector<std::exception_ptr> errors(threads);
+	std::vector<std::thread> workers;
+
+	for (unsigned int t = 0; t < threads; t++)
+		workers.emplace_back([&, t]() { firstRow[t + 1] = countGridRows(bounds[t], bounds[t + 1]); });
+	for (std::thread& w : workers)
+		w.join();
+	workers.clear();
+
+	for (unsigned int t = 0; t < threads; t++)
+		firstRow[t + 1] += firstRow[t];
+
+	if (firstRow[threads] != data.nrows)
+	{
+		// not one row per line: fall back to the serial scanner
+		const char* p = body;
+		for (unsigned int i = 0; i < data.nrows; i++)
+			p = parseGridRow(p, end, &data.values[size_t(data.nrows - 1 - i) * data.ncols], data.ncols);
+	}
+	else
+	{
+		for (unsigned int t = 0; t < threads; t++)
+			workers.emplace_back([&, t]()
+			{
+				try
+				{
+					parseGridChunk(bounds[t], bounds[t + 1], firstRow[t], data);
+				}
+				catch (...)
+				{
+					errors[t] = std::current_exception();
+				}
+			});
+		for (std::thread& w : workers)
+			w.join();
+
+		for (std::exception_ptr& e : errors)
+			if (e)
+				std::rethrow_exception(e);
+	}
+
+	return data;
+}
+
+// Loads a grid with the parallel scanner when more than one worker is configured
+static FileData loadGrid(const std::string& path)
+{
+	unsigned int threads = numThreads > 0 ? numThreads : std::thread::hardware_concurrency();
+	if (threads > 1)
+		return readFileParallel(path, threads);
+	return readFileMapped(path);
+}
+
+// Widens FileData::values into a substate layer, four values per SSE2 conversion
+static void widenFloats(const float* src, double* dst, size_t count)
+{
+	size_t k = 0;
+#if defined(GRID_SSE2)
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 f = _mm_loadu_ps(src + k);
+		_mm_storeu_pd(dst + k, _mm_cvtps_pd(f));
+		_mm_storeu_pd(dst + k + 2, _mm_cvtps_pd(_mm_movehl_ps(f, f)));
+	}
+#endif
+	for (; k < count; k++)
+		dst[k] = double(src[k]);
+}
+
+static void widenFloats(const std::vector<float>& src, std::vector<double>& dst)
+{
+	dst.resize(src.size());
+	widenFloats(src.data(), dst.data(), src.size());
+}
+
+// Clips the window to the grid, or resolves the world box against the header when given; throws when nothing is left
+static GridWindow resolveWindow(const FileData& header, GridWindow window, const WorldBox* box)
+{
+	if (box)
+	{
+		double top = header.yllcorner + double(header.nrows) * header.cellsize;
+		int col1 = int(ceil((box->xmax - header.xllcorner) / header.cellsize));
+		int row1 = int(ceil((top - box->ymin) / header.cellsize));
+		window.col = int(floor((box->xmin - header.xllcorner) / header.cellsize));
+		window.row = int(floor((top - box->ymax) / header.cellsize));
+		window.cols = col1 - window.col;
+		window.rows = row1 - window.row;
+	}
+	else if (window.rows <= 0 || window.cols <= 0)
+		return { 0, 0, int(header.nrows), int(header.ncols) };
+
+	// the cells cut off at the top or left are dropped from the extent as well
+	long long row1 = std::min<long long>((long long)window.row + window.rows, header.nrows);
+	long long col1 = std::min<long long>((long long)window.col + window.cols, header.ncols);
+	window.row = std::max(0, window.row);
+	window.col = std::max(0, window.col);
+	if (window.row >= row1 || window.col >= col1)
+		throw std::runtime_error("The window does not overlap the grid");
+	window.rows = int(row1 - window.row);
+	window.cols = int(col1 - window.col);
+	return window;
+}
+
+// Narrows the header of a full grid to the window
+static void applyWindow(FileData& data, const GridWindow& window)
+{
+	data.xllcorner += float(window.col * double(data.cellsize));
+	data.yllcorner += float((int(data.nrows) - window.row - window.rows) * double(data.cellsize));
+	data.nrows = window.rows;
+	data.ncols = window.cols;
+}
+
+static inline const char* skipToken(const char* p, const char* end)
+{
+	p = skipBlanks(p, end);
+	while (p < end && !isBlank(*p))
+		p++;
+	return p;
+}
+
+static FileData readFileWindow(const std::string& path, GridWindow window, const WorldBox* box)
+{
+	MappedFile file;
+	if (!file.Open(path))
+		throw std::runtime_error("Cannot open file: " + path);
+
+	const char* end = file.GetData() + file.GetSize();
+	FileData data;
+	const char* p = parseGridHeader(file.GetData(), end, data);
+	window = resolveWindow(data, window, box);
+	applyWindow(data, window);
+
+	// rows above the window
+	for (int i = 0; i < window.row && p < end; i++)
+	{
+		p = skipBlanks(p, end);
+		p = skipLine(p, end);
+	}
+
+	data.values.resize(size_t(data.nrows) * data.ncols);
+	for (unsigned int i = 0; i < data.nrows; i++)
+	{
+		p = skipBlanks(p, end);
+		const char* next = skipLine(p, end);
+		for (int j = 0; j < window.col; j++)
+			p = skipToken(p, next);
+		parseGridRow(p, next, &data.values[size_t(data.nrows - 1 - i) * data.ncols], data.ncols);
+		p = next;
+	}
+
+	return data;
+}
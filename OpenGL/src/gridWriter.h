@@ -0,0 +1,175 @@
+#pragma once
+
+#include "globals.h"
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <climits>
+#include <sys/uio.h>
+#endif
+
+/*
+Ascii Grid writer, the inverse of readFile: values are given in FileData::values order, so the
+row 0 is written last. Floats are formatted with std::to_chars, whose shortest representation
+reads back to the very same value.
+
+Formatting is what costs, so it runs in parallel: each thread formats a block of rows into its
+own buffer and the blocks of a round are written, in order, with a single vectored write
+(writev on POSIX; on Windows the buffers are large enough for plain sequential writes).
+*/
+
+template <typename T>
+static char* formatValue(char* p, char* end, T value)
+{
+	std::to_chars_result res = std::to_chars(p, end, value);
+	if (res.ec != std::errc())
+		throw std::runtime_error("Grid value does not fit the output buffer");
+	return res.ptr;
+}
+
+static std::string formatGridHeader(const FileData& data)
+{
+	char buffer[512];
+	char* end = buffer + sizeof(buffer);
+	char* p = buffer;
+
+	auto field = [&](const char* key, auto value)
+	{
+		int n = snprintf(p, end - p, "%-14s", key);
+		p += n;
+		p = formatValue(p, end, value);
+		*p++ = '\n';
+	};
+	field("ncols", data.ncols);
+	field("nrows", data.nrows);
+	field("xllcorner", data.xllcorner);
+	field("yllcorner", data.yllcorner);
+	field("cellsize", data.cellsize);
+	field("NODATA_value", data.NoDataValue);
+
+	return std::string(buffer, p);
+}
+
+// Writes the buffers one after the other
+static void writeBuffers(FILE* out, const std::vector<std::vector<char>>& buffers, const std::vector<size_t>& sizes)
+{
+#if defined(_WIN32)
+	for (size_t b = 0; b < buffers.size(); b++)
+		if (fwrite(buffers[b].data(), 1, sizes[b], out) != sizes[b])
+			throw std::runtime_error("Cannot write the grid values");
+#else
+	std::vector<iovec> parts;
+	for (size_t b = 0; b < buffers.size(); b++)
+		if (sizes[b] > 0)
+			parts.push_back({ const_cast<char*>(buffers[b].data()), sizes[b] });
+
+	fflush(out);
+	int fd = fileno(out);
+	size_t first = 0;
+	while (first < parts.size())
+	{
+		ssize_t written = writev(fd, &parts[first], int(std::min<size_t>(parts.size() - first, IOV_MAX)));
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("Cannot write the grid values");
+		}
+		// partial write: skip what went out and retry with the rest
+		size_t left = size_t(written);
+		while (first < parts.size() && left >= parts[first].iov_len)
+			left -= parts[first++].iov_len;
+		if (first < parts.size())
+		{
+			parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + left;
+			parts[first].iov_len -= left;
+		}
+	}
+#endif
+}
+
+// threads = 0 uses numThreads, or one thread per hardware thread
+template <typename T>
+static void writeFileAscii(const std::string& path, const FileData& data, const T* values, unsigned int threads = 0)
+{
+	if (threads == 0)
+		threads = numThreads > 0 ? numThreads : std::thread::hardware_concurrency();
+	if (threads < 1)
+		threads = 1;
+
+	FILE* out = fopen(path.c_str(), "wb");
+	if (out == NULL)
+		throw std::runtime_error("Cannot create file: " + path);
+
+	std::string header = formatGridHeader(data);
+	fwrite(header.data(), 1, header.size(), out);
+
+	// a value takes at most 24 characters plus its separator; blocks are at most ~8 MB
+	size_t nrows = data.nrows;
+	size_t lineSize = size_t(data.ncols) * 25 + 1;
+	size_t blockRows = std::max<size_t>(1, (size_t(8) << 20) / lineSize);
+
+	std::vector<std::vector<char>> buffers(threads);
+	std::vector<size_t> sizes(threads);
+	std::vector<std::exception_ptr> errors(threads);
+	try
+	{
+		for (size_t round = 0; round < nrows; round += blockRows * threads)
+		{
+			std::vector<std::thread> workers;
+			for (unsigned int t = 0; t < threads; t++)
+				workers.emplace_back([&, t]()
+				{
+					// output rows [first, last), the output row k being the row nrows - 1 - k of values
+					size_t first = std::min(nrows, round + t * blockRows);
+					size_t last = std::min(nrows, first + blockRows);
+					sizes[t] = 0;
+					if (first == last)
+						return;
+					try
+					{
+						buffers[t].resize((last - first) * lineSize);
+						char* p = buffers[t].data();
+						char* end = p + buffers[t].size();
+						for (size_t k = first; k < last; k++)
+						{
+							const T* row = values + (nrows - 1 - k) * data.ncols;
+							for (unsigned int j = 0; j < data.ncols; j++)
+							{
+								p = formatValue(p, end, row[j]);
+								*p++ = j + 1 < data.ncols ? ' ' : '\n';
+							}
+						}
+						sizes[t] = p - buffers[t].data();
+					}
+					catch (...)
+					{
+						errors[t] = std::current_exception();
+					}
+				});
+			for (std::thread& w : workers)
+				w.join();
+
+			for (std::exception_ptr& e : errors)
+				if (e)
+					std::rethrow_exception(e);
+			writeBuffers(out, buffers, sizes);
+		}
+	}
+	catch (...)
+	{
+		fclose(out);
+		throw;
+	}
+
+	bool failed = ferror(out) != 0;
+	if (fclose(out) != 0 || failed)
+		throw std::runtime_error("Cannot write file: " + path);
+}
@@ -4,6 +4,39 @@
 #include "globals.h"
 #include "VertexCreation.h"
 #include "openClTester.h"
+#include "gridParser.h"
+#include "gridBinary.h"
+#include "loadTester.h"
+#include "ThreadPool.h"
+#include "TaskGraph.h"
+#include "Texture.h"
+#include "checkpoint.h"
+#include "recording.h"
+#include "replay.h"
+#include "simulation.h"
+#include "threadedExecutor.h"
+#include "flowSimd.h"
+#include "flowSorted.h"
+#include "solverTester.h"
+#include "layoutTester.h"
+#include "blockingTester.h"
+#include "precisionTester.h"
+#include "sparseTester.h"
+#include "outOfCoreTester.h"
+
+TaskGraph startupGraph;
+std::unique_ptr<ThreadPool> startupPool;
+ImageData textureImage;
+std::string exportPath;
+
+int finishStartup();
+
+static cl::Program buildProgram(const std::string& path, const char* options)
+{
+	cl::Program program(context, util::loadProgram(path));
+	program.build(options);
+	return program;
+}
 
 void initSo(int r, int c, double* M[])
 {
@@ -20,63 +53,467 @@ void initSo(int r, int c, double* M[])
 	}
 }
 
+// Reports an option that does not apply to the run
+static void ignoreOption(const std::string& option, const std::string& reason)
+{
+	std::cout << option << " " << reason << ", ignored" << std::endl << std::endl;
+}
+
+// Reports an option that cannot run as given; returns the status that stops the program with a failure
+static int rejectOption(const std::string& option, const std::string& reason)
+{
+	std::cout << option << " " << reason << std::endl;
+	return -2;
+}
+
+// Returns the value of an optional "--name=value" argument following the positional ones, "" for a bare "--name", NULL if absent
+const char* getOption(int argc, char** argv, const char* name)
+{
+	size_t len = strlen(name);
+	for (int i = 6; i < argc; i++)
+		if (strncmp(argv[i], name, len) == 0)
+		{
+			if (argv[i][len] == '=')
+				return argv[i] + len + 1;
+			if (argv[i][len] == '\0')
+				return "";
+		}
+	return NULL;
+}
+
 int initProgram(int argc, char** argv)
 {
-	if (argc != 6)
+	if (argc >= 4 && strcmp(argv[1], "convert") == 0)
+	{
+		try
+		{
+			convertGrid(argv[2], argv[3], argc > 4 && strcmp(argv[4], "float64") == 0 ? GRID_FLOAT64 : GRID_FLOAT32);
+			std::cout << "Converted " << argv[2] << " into " << argv[3] << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Conversion failed: " << e.what() << std::endl;
+		}
+		return -1;
+	}
+
+	if (argc >= 6 && strcmp(argv[1], "outofcore") == 0)
 	{
-		std::cout << "\nThe application have to be executed as follows:\n./OpenGL {surfaceZ values path} {surface lava values path} {NumberOfSteps} {test|no} {parallel|no}\n";
+		try
+		{
+			runOutOfCore(argv[2], argv[3], atoi(argv[4]), argv[5], argc > 6 ? size_t(std::max(1, atoi(argv[6]))) : 1024, argc > 7 ? argv[7] : "");
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Out-of-core run failed: " << e.what() << std::endl;
+			return -2;
+		}
+		return -1;
+	}
+
+	if (argc < 6)
+	{
+		std::cout << "\nThe application have to be executed as follows:\n./OpenGL {surfaceZ values path} {surface lava values path} {NumberOfSteps} {test|no} {parallel|threads|no} [options]\n";
+		std::cout << "\nparallel runs the simulation with OpenCL, threads on all the CPU cores (see --threads), no on a single core.\n";
+		std::cout << "\nor, to convert an Ascii Grid into the binary grid format (and a binary grid back into an Ascii Grid):\n./OpenGL convert {input path} {output path} [float32|float64]\n";
+		std::cout << "\nor, to step grids larger than the memory from a tile file, without the window (the thickness is written as a float64 binary grid):\n./OpenGL outofcore {surfaceZ values path} {surface lava values path} {NumberOfSteps} {tile file path} [cache MB (default: 1024)] [thickness output path]\n";
+		std::cout << "\nGrids can be given as Ascii Grid, binary grid or Esri binary float (.flt/.hdr) files.\n";
+		std::cout << "\nOptions:";
+		std::cout << "\n\t--bench=load\t\tcompare the grid loaders on the input files and exit";
+		std::cout << "\n\t--bench=solver\t\tcompare the outflow solvers on random and input grids and exit";
+		std::cout << "\n\t--bench=layout\t\tcompare the substate layouts on random and input grids and exit";
+		std::cout << "\n\t--bench=blocking\tsteps per second of the temporal blocks of 1 to 8 steps against the grid size and exit";
+		std::cout << "\n\t--bench=precision\tcompare the speed and the volume error of the float and mixed precisions with double and exit";
+		std::cout << "\n\t--bench=outofcore\tsteps per second of a tile file streamed through a cache of a tenth of its size and exit";
+		std::cout << "\n\t--bench=sparse\t\tcompare the sparse blocks with the dense grid and run them on a 100000x100000 DEM and exit";
+		std::cout << "\n\t--threads=N\t\tnumber of CPU worker threads (default: one per hardware thread)";
+		std::cout << "\n\t--window=R,C,NR,NC\tload only NR rows and NC columns starting at row R, column C (counted from the top left)";
+		std::cout << "\n\t--bbox=X0,Y0,X1,Y1\tload only the cells inside the given world coordinates box";
+		std::cout << "\n\t--checkpoint-every=N\twrite a checkpoint every N steps (in the background)";
+		std::cout << "\n\t--checkpoint=PATH\tcheckpoint file (default: checkpoint.lcp)";
+		std::cout << "\n\t--restart=PATH\t\tresume the run saved in a checkpoint";
+		std::cout << "\n\t--record=PATH\t\trecord the lava thickness frames to a file";
+		std::cout << "\n\t--record-every=N\trecord a frame every N steps (default: 1)";
+		std::cout << "\n\t--record-keyframes=N\twrite a keyframe every N frames (default: 100)";
+		std::cout << "\n\t--replay=PATH\t\tplay back a recording instead of simulating";
+		std::cout << "\n\t--export=PATH\t\twrite the lava thickness as an Ascii Grid when the application closes";
+		std::cout << "\n\t--reach[=T]\t\tcrop the grid to the cells the lava can reach, climbing at most T above its sources (default: 1)";
+		std::cout << "\n\t--converge[=T]\t\tstop once no cell changes by more than T and the outflow per wet cell is within T (default: 1e-6)";
+		std::cout << "\n\t--converge-steps=N\tconsecutive steps within the tolerance that stop the run (default: 100)";
+		std::cout << "\n\t--full-sweep\t\tupdate every cell at each step instead of the cells near the lava only";
+		std::cout << "\n\t--layout=quads\t\tstore the four outflows of a cell next to each other on the OpenCL device (default: plane)";
+		std::cout << "\n\t--gather\t\tcompute the inflows of each cell again instead of storing the outflows (less memory, more arithmetic)";
+		std::cout << "\n\t--block-steps=K\t\tadvance cache-sized tiles of the grid K steps at a time on the CPU (temporal blocking)";
+		std::cout << "\n\t--tile=N\t\tside of the tiles of --block-steps, in cells (default: 128)";
+		std::cout << "\n\t--precision=P\t\tsubstates in double, float, or float with compensated mass balance: double, float or mixed (default: double)";
+		std::cout << "\n\t\t\t\tfloat and mixed also store the altitudes in float: on the input DEMs the thickness is off by up to about 2 m after 1000 steps";
+		std::cout << "\n\t--padded\t\trun the CPU step on grids with a halo ring and a no-data mask, without branches in the inner loops";
+		std::cout << "\n\t--compact\t\trun the CPU step on the cells with data only, stored contiguously with a neighbour table";
+		std::cout << "\n\t--sparse\t\trun the CPU step on 64x64 blocks allocated when the lava comes near them";
+		std::cout << "\n\t--simd=ISA\t\tvectorize the CPU outflow computation with avx512, avx2, sse2 or off (default: the widest available)";
+		std::cout << "\n\t--solver=NAME\t\tcompute the outflows with the elimination loop or with the sorted closed form, equal up to rounding: loop or sorted (default: loop)\n";
 		std::cout << "\nUse key 1 and 2 to change from/to polygon mode.";
-		std::cout << "\nUse key 3 and 4 to start/stop simulation.\n.";
+		std::cout << "\nUse key 3 and 4 to start/stop simulation (or playback).";
+		std::cout << "\nWhile replaying, use LEFT/RIGHT to step one frame, PAGE UP/PAGE DOWN to scrub and HOME to go back to the start.\n.";
 		return -1;
 	}
 
-	LData = readFile(argv[2]);
-	ZData = readFile(argv[1]);
+	const char* threads = getOption(argc, argv, "--threads");
+	if (threads)
+		numThreads = atoi(threads);
+	const char* tile = getOption(argc, argv, "--tile");
+	if (tile)
+		blockTile = std::max(1, atoi(tile));
 
-	try
+	const char* window = getOption(argc, argv, "--window");
+	if (window && sscanf(window, "%d,%d,%d,%d", &gridWindow.row, &gridWindow.col, &gridWindow.rows, &gridWindow.cols) != 4)
 	{
-		initSo(nrows, ncols, So);
+		std::cout << "Invalid window: " << window << std::endl;
+		return -1;
 	}
-	catch (const std::exception&)
+
+	const char* bbox = getOption(argc, argv, "--bbox");
+	if (bbox)
 	{
-		std::cout << "Wrong file" << std::endl;
-		exit(0);
+		useWorldBox = sscanf(bbox, "%lf,%lf,%lf,%lf", &worldBox.xmin, &worldBox.ymin, &worldBox.xmax, &worldBox.ymax) == 4;
+		if (!useWorldBox)
+		{
+			std::cout << "Invalid bounding box: " << bbox << std::endl;
+			return -1;
+		}
+	}
+
+	const char* bench = getOption(argc, argv, "--bench");
+	if (bench && strcmp(bench, "load") == 0)
+	{
+		testGridLoaders(argv[1], argv[2]);
+		return -1;
+	}
+	if (bench && strcmp(bench, "solver") == 0)
+	{
+		return testOutflowSolvers(argv[1], argv[2]) == 0 ? -1 : -2;
+	}
+	if (bench && strcmp(bench, "layout") == 0)
+	{
+		return testLayouts(argv[1], argv[2]) == 0 ? -1 : -2;
+	}
+	if (bench && strcmp(bench, "blocking") == 0)
+	{
+		return testBlocking(argv[1], argv[2]) == 0 ? -1 : -2;
+	}
+	if (bench && strcmp(bench, "precision") == 0)
+	{
+		return testPrecisions(argv[1], argv[2]) == 0 ? -1 : -2;
+	}
+	if (bench && strcmp(bench, "sparse") == 0)
+	{
+		return testSparse(argv[1], argv[2]) == 0 ? -1 : -2;
+	}
+	if (bench && strcmp(bench, "outofcore") == 0)
+	{
+		return testOutOfCore(argv[1], argv[2]) == 0 ? -1 : -2;
 	}
 
 	steps = atoi(argv[3]);
 
 	parallel = strcmp(argv[5], "parallel") == 0;
+	threaded = strcmp(argv[5], "threads") == 0;
 	if (parallel)
 		std::cout << "Running in parallel" << std::endl << std::endl;
+	else if (threaded)
+	{
+		initThreadedExecutor(numThreads);
+		std::cout << "Running on " << simulationPool->GetSize() + 1 << " CPU threads" << std::endl << std::endl;
+	}
 	else
 		std::cout << "Running in serial" << std::endl << std::endl;
 
-	std::vector<double> Z1(ZData.values.begin(), ZData.values.end());
-	std::vector<double> H1(LData.values.begin(), LData.values.end());
-
-	Z.assign(Z1.begin(), Z1.end());
-	H.assign(H1.begin(), H1.end());
-
-	// OpenCL
-	// 1 - Define the platform
-	context = cl::Context(DEVICE);
-	// 2 - Create and build the programs
-	outflow_computation = cl::Program(context, util::loadProgram("../../../OpenGL/resources/kernels/kernel1.cl"), true);
-	mass_balance = cl::Program(context, util::loadProgram("../../../OpenGL/resources/kernels/kernel2.cl"), true);
-	outflow_reset = cl::Program(context, util::loadProgram("../../../OpenGL/resources/kernels/kernel3.cl"), true);
-	// 3 - Setup memory objects
-	hB = cl::Buffer(context, H.begin(), H.end(), CL_MEM_READ_WRITE, true);
-	SoB = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(double) * SoSize);
-	zB = cl::Buffer(context, Z.begin(), Z.end(), CL_MEM_READ_ONLY, true);
-
-	queue = cl::CommandQueue(context);
-	// 5.1 - Submit commands
-	/*queue.enqueueWriteBuffer(zB, CL_TRUE, 0, sizeof(double) * Z.size(), &Z[0]);
-	queue.enqueueWriteBuffer(hB, CL_TRUE, 0, sizeof(double) * H.size(), &H[0]);*/
-
-	if (strcmp(argv[4], "test") == 0) {
+	bool testMode = strcmp(argv[4], "test") == 0;
+	std::string zPath = argv[1];
+	std::string lPath = argv[2];
+
+	/*	The other steps replace the one of flow.h: at most one of them, on the CPU in double, but
+		for the gather step which also runs on OpenCL. Options that cannot run together stop the
+		program; options that do not apply to the chosen step are ignored, and said so. The test
+		compares the serial, threaded and OpenCL steps with the double reference, so it ignores the
+		options of the other steps.
+		*/
+	const char* stepOptions[] = { "--gather", "--block-steps", "--padded", "--compact", "--sparse" };
+	const char* step = NULL;
+	for (const char* option : stepOptions)
+		if (getOption(argc, argv, option))
+		{
+			if (testMode)
+				ignoreOption(option, "is not compared by the test");
+			else if (step)
+				return rejectOption(option, std::string("cannot be combined with ") + step);
+			else
+				step = option;
+		}
+	auto selected = [step](const char* option) { return step && strcmp(step, option) == 0; };
+	if (step && !selected("--gather") && parallel)
+		return rejectOption(step, "runs on the CPU, not with parallel");
+
+	activeTracking = getOption(argc, argv, "--full-sweep") == NULL;
+	if (!activeTracking && selected("--sparse"))
+		ignoreOption("--full-sweep", "does not apply to --sparse, which only steps the blocks near the lava");
+	gather = selected("--gather");
+	const char* layout = getOption(argc, argv, "--layout");
+	outflowQuads = layout && strcmp(layout, "quads") == 0;
+	if (outflowQuads && (!parallel || gather))
+		ignoreOption("--layout=quads", "only applies to the outflows of the OpenCL step");
+	if (gather)
+		std::cout << "Outflow-free gather step, with the elimination loop" << std::endl << std::endl;
+
+	const char* precisionOption = getOption(argc, argv, "--precision");
+	if (precisionOption && strcmp(precisionOption, "float") == 0)
+		precision = PRECISION_FLOAT;
+	else if (precisionOption && strcmp(precisionOption, "mixed") == 0)
+		precision = PRECISION_MIXED;
+	else if (precisionOption && strcmp(precisionOption, "double") != 0)
+	{
+		std::cout << "Invalid precision: " << precisionOption << std::endl;
+		return -1;
+	}
+	// the test compares the backends with the double reference, the other steps have their own substates
+	if (precision != PRECISION_DOUBLE && testMode)
+	{
+		ignoreOption("--precision", "is not compared by the test");
+		precision = PRECISION_DOUBLE;
+	}
+	if (precision != PRECISION_DOUBLE && step)
+		return rejectOption(std::string("--precision=") + precisionOption, std::string("cannot be combined with ") + step);
+	if (precision != PRECISION_DOUBLE)
+		std::cout << "Substates in " << (precision == PRECISION_FLOAT ? "float" : "float, compensated mass balance") << std::endl << std::endl;
+
+	// the blocked, padded, compact and sparse steps compute the outflows themselves, on the CPU, in double
+	const char* blocking = getOption(argc, argv, "--block-steps");
+	blockSteps = selected("--block-steps") ? std::max(0, atoi(blocking)) : 0;
+	if (selected("--block-steps") && blockSteps == 0)
+		return rejectOption("--block-steps", "needs at least 1 step per block");
+	if (blockSteps > 0)
+		std::cout << "Temporal blocking, " << blockSteps << " steps per " << blockTile << "x" << blockTile << " tile" << std::endl << std::endl;
+	else if (tile)
+		ignoreOption("--tile", "only applies to --block-steps");
+	padded = selected("--padded");
+	if (padded)
+		std::cout << "Padded grids, branch-free sweeps" << std::endl << std::endl;
+	compact = selected("--compact");
+	if (compact)
+		std::cout << "Compact domain, cells with data only" << std::endl << std::endl;
+	sparse = selected("--sparse");
+	if (sparse)
+		std::cout << "Sparse blocks of " << SPARSE_BLOCK << "x" << SPARSE_BLOCK << " cells" << std::endl << std::endl;
+
+	// the monitor is fused in the mass balance of the serial, threaded and OpenCL steps
+	bool loopStep = step == NULL && (precision == PRECISION_DOUBLE || parallel);
+	const char* convergeOption = getOption(argc, argv, "--converge");
+	converge = convergeOption != NULL && loopStep;
+	if (convergeOption && *convergeOption)
+		convergeTolerance = atof(convergeOption);
+	const char* convergeStepsOption = getOption(argc, argv, "--converge-steps");
+	if (convergeStepsOption)
+		convergeSteps = std::max(1, atoi(convergeStepsOption));
+	if (converge)
+		std::cout << "Stopping when settled for " << convergeSteps << " steps, tolerance " << convergeTolerance << std::endl << std::endl;
+	else if (convergeOption)
+		ignoreOption("--converge", "needs the serial, threaded or OpenCL step");
+
+	// the outflow kernels of the serial, threaded and OpenCL steps
+	const char* simd = getOption(argc, argv, "--simd");
+	SimdLevel requested = SIMD_AVX512;
+	if (simd && strcmp(simd, "off") == 0)
+		requested = SIMD_OFF;
+	else if (simd && strcmp(simd, "sse2") == 0)
+		requested = SIMD_SSE2;
+	else if (simd && strcmp(simd, "avx2") == 0)
+		requested = SIMD_AVX2;
+	const char* solver = getOption(argc, argv, "--solver");
+	outflowSolver = solver && strcmp(solver, "sorted") == 0 && loopStep ? SOLVER_SORTED : SOLVER_LOOP;
+	if (solver && strcmp(solver, "sorted") == 0 && !loopStep)
+		ignoreOption("--solver=sorted", "needs the serial, threaded or OpenCL step");
+	if (simd && (!loopStep || parallel || outflowSolver == SOLVER_SORTED))
+		ignoreOption("--simd", "only applies to the loop solver of the serial and threaded steps");
+	if (outflowSolver == SOLVER_SORTED)
+	{
+		// scalar, the SIMD kernels implement the loop
+		outflowRowKernel = kernel1_outflow_row_sorted;
+		std::cout << "Outflow kernel: sorted" << std::endl << std::endl;
+	}
+	else if (loopStep && !parallel)
+		std::cout << "Outflow kernel: " << simdLevelName(initSimd(requested)) << std::endl << std::endl;
+
+	const char* reachOption = getOption(argc, argv, "--reach");
+	reach = reachOption != NULL;
+	if (reachOption && *reachOption)
+		reachTolerance = atof(reachOption);
+
+	const char* exportOption = getOption(argc, argv, "--export");
+	exportPath = exportOption ? exportOption : "";
+
+	const char* replay = getOption(argc, argv, "--replay");
+	std::string replayPath = replay ? replay : "";
+	replaying = !replayPath.empty() && !testMode;
+
+	const char* interval = getOption(argc, argv, "--checkpoint-every");
+	if (interval && !replaying)
+	{
+		checkpointInterval = atoi(interval);
+		const char* checkpointPath = getOption(argc, argv, "--checkpoint");
+		if (checkpointInterval > 0)
+			checkpointWriter.reset(new CheckpointWriter(checkpointPath && *checkpointPath ? checkpointPath : "checkpoint.lcp"));
+	}
+
+	const char* restart = getOption(argc, argv, "--restart");
+	std::string restartPath = restart ? restart : "";
+
+	const char* record = getOption(argc, argv, "--record");
+	const char* recordEvery = getOption(argc, argv, "--record-every");
+	const char* recordKeyframes = getOption(argc, argv, "--record-keyframes");
+	std::string recordPath = record ? record : "";
+	int recordInterval = recordEvery ? atoi(recordEvery) : 1;
+	int keyframeInterval = recordKeyframes ? atoi(recordKeyframes) : 100;
+
+	/*	The startup steps form a small task graph run by a worker pool, so that the grid loads,
+		the OpenCL builds, the mesh generation and the texture decoding overlap with each other
+		and with the window creation done by main in the meantime.
+		*/
+	TaskGraph::TaskId loadL = startupGraph.Add("load lava", [lPath]() { loadLayer(lPath, LData, H); });
+	TaskGraph::TaskId loadZ = startupGraph.Add("load altitudes", [zPath]() { loadLayer(zPath, ZData, Z); });
+
+	TaskGraph::TaskId substates = startupGraph.Add("substates", []()
+	{
+		if (ZData.nrows != LData.nrows || ZData.ncols != LData.ncols)
+			throw std::runtime_error("altitudes and lava grids have different sizes");
+		if (reach)
+			pruneUnreachable(reachTolerance);
+		publishGridHeader(ZData);
+		// the gather, padded, compact, sparse, blocked and CPU float steps do without the double outflow planes
+		if (!gather && !padded && !compact && !sparse && blockSteps == 0 && (precision == PRECISION_DOUBLE || parallel))
+			initSo(nrows, ncols, So);
+	}, { loadL, loadZ });
+
+	// the initial state: the input lava, a checkpoint or the first frame of a recording
+	TaskGraph::TaskId restore;
+	if (replaying)
+		restore = startupGraph.Add("open recording", [replayPath]() { openReplay(replayPath); }, { substates });
+	else
+		restore = startupGraph.Add("restart", [restartPath]()
+		{
+			if (checkpointWriter || !restartPath.empty())
+				zHash = hashLayer(Z.data(), Z.size());
+			if (!restartPath.empty())
+				restoreCheckpoint(restartPath);
+			initActiveRegion();
+		}, { substates });
+
+	if (!recordPath.empty() && !replaying)
+	{
+		startupGraph.Add("recorder", [recordPath, recordInterval, keyframeInterval]()
+		{
+			recordingWriter.reset(new RecordingWriter(recordPath, nrows, ncols, recordInterval, keyframeInterval));
+			recordingWriter->Push(currentStep, H.data());
+		}, { restore });
+	}
+
+	// a replay does not simulate
+	if (!replaying)
+	{
+		TaskGraph::TaskId programs = startupGraph.Add("OpenCL programs", []()
+		{
+			// OpenCL
+			// 1 - Define the platform
+			context = cl::Context(DEVICE);
+			// 2 - Create and build the programs
+			std::string options = outflowQuads ? "-DOUTFLOW_QUADS" : "";
+			if (precision != PRECISION_DOUBLE)
+				options += " -DREAL=float";
+			outflow_computation = buildProgram("../../../OpenGL/resources/kernels/kernel1.cl", options.c_str());
+			mass_balance = buildProgram("../../../OpenGL/resources/kernels/kernel2.cl", options.c_str());
+			outflow_reset = buildProgram("../../../OpenGL/resources/kernels/kernel3.cl", options.c_str());
+			if (gather)
+				gather_step = cl::Program(context, util::loadProgram("../../../OpenGL/resources/kernels/kernel1.cl") + util::loadProgram("../../../OpenGL/resources/kernels/kernel4.cl"), true);
+		});
+
+		startupGraph.Add("OpenCL buffers", []()
+		{
+			// 3 - Setup memory objects
+			if (precision == PRECISION_DOUBLE)
+				hB = cl::Buffer(context, H.begin(), H.end(), CL_MEM_READ_WRITE, true);
+			else
+				hB = deviceBuffer(H.data(), H.size(), CL_MEM_READ_WRITE);
+			if (gather)
+				hNextB = cl::Buffer(context, H.begin(), H.end(), CL_MEM_READ_WRITE, true);
+			else
+				SoB = cl::Buffer(context, CL_MEM_READ_WRITE, deviceRealSize() * SoSize);
+			if (precision == PRECISION_DOUBLE)
+				zB = cl::Buffer(context, Z.begin(), Z.end(), CL_MEM_READ_ONLY, true);
+			else
+				zB = deviceBuffer(Z.data(), Z.size(), CL_MEM_READ_ONLY);
+			// the compensation starts with the part of H lost in the conversion to float
+			if (precision == PRECISION_MIXED)
+			{
+				std::vector<double> lost(H.size());
+				for (size_t k = 0; k < H.size(); k++)
+					lost[k] = H[k] - double(float(H[k]));
+				hCompB = deviceBuffer(lost.data(), lost.size(), CL_MEM_READ_WRITE);
+			}
+			if (converge && !gather)
+				changeB = cl::Buffer(context, CL_MEM_READ_WRITE, deviceRealSize() * 3 * changeGroups(nrows, ncols));
+
+			queue = cl::CommandQueue(context);
+			// 5.1 - Submit commands
+			/*queue.enqueueWriteBuffer(zB, CL_TRUE, 0, sizeof(double) * Z.size(), &Z[0]);
+			queue.enqueueWriteBuffer(hB, CL_TRUE, 0, sizeof(double) * H.size(), &H[0]);*/
+			// the outflow planes start as the host ones, zero (see initActiveRegion)
+			if (!gather)
+				for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+					writeDevice(SoB, size_t(n) * nrows * ncols, size_t(nrows) * ncols, So[n]);
+		}, { programs, restore });
+	}
+
+	if (!testMode)
+	{
+		startupGraph.Add("mesh", []()
+		{
+			positions = calculateVertices(nrows, ncols, dimension, ZData.values, cellsize, LData.values);
+			indices = calculatePositions(nrows, ncols, ZData.values);
+			calculateNormal(positions, indices, 13, 10);
+			if (replaying)
+				resetLava(positions, nrows * ncols, 13, 3);
+			if (currentStep > 0 || replaying)
+				updateLava(positions, H, nrows * ncols, 13, 3);
+		}, { restore });
+
+		startupGraph.Add("texture decode", []()
+		{
+			textureImage = Texture::DecodeImage("../../../OpenGL/resources/textures/texture.png");
+		});
+	}
+
+	startupPool.reset(new ThreadPool(std::min(4u, std::max(1u, std::thread::hardware_concurrency()))));
+	startupGraph.Start(*startupPool);
+
+	if (testMode) {
+		if (finishStartup() == -1)
+			return -1;
 		std::cout << "Test with data:\n\tRows: " << nrows << "\n\tColumns: " << ncols << std::endl << std::endl;
-		test(Z.data(), H.data(), So, neighborhood);
+		return test(Z.data(), H.data(), So, neighborhood) == 0 ? -1 : -2;
+	}
+
+	return 0;
+}
+
+// Waits for the startup tasks launched by initProgram and completes the setup that depends on them
+int finishStartup()
+{
+	try
+	{
+		startupGraph.WaitAll();
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Startup failed: " << e.what() << std::endl;
 		return -1;
 	}
 
@@ -94,4 +531,4 @@ int initProgram(int argc, char** argv)
 	lightPos = glm::vec3(lightX, lightY, lightZ);
 
 	return 0;
-}
\ No newline at end of file
+}
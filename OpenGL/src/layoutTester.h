@@ -0,0 +1,72 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include "flowLayout.h"
+#include "threadedExecutor.h"
+#include "solverTester.h"
+#include "stepTester.h"
+
+#include "util.hpp"
+
+// Runs steps on a copy of the grid stored with the given layout; returns the seconds per step and the final thickness
+template <class Layout>
+double timeLayout(const std::vector<double>& z, const std::vector<double>& h, int r, int c, double nodata, int steps, ThreadPool* pool, std::vector<double>& result)
+{
+	Layout g;
+	g.Load(z.data(), h.data(), h.size());
+	Region grid = gridRegion(r, c);
+
+	util::Timer timer;
+	for (int s = 0; s < steps; s++)
+		if (pool)
+			layoutTransitionFunctionThreaded(*pool, g, dumping_factor, r, c, nodata, grid, grid);
+		else
+			layoutTransitionFunction(g, dumping_factor, r, c, nodata, grid, grid);
+	double seconds = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	result.resize(h.size());
+	g.StoreThickness(result.data());
+	return seconds / steps;
+}
+
+// Times the layouts, whose thickness must be the one of the reference run; returns the failed comparisons
+static int compareLayouts(const BenchGrid& grid, const ReferenceRun& reference)
+{
+	ThreadPool* pool = threaded ? &*simulationPool : NULL;
+	std::vector<double> results[3];
+	double times[3];
+	times[0] = timeLayout<PlaneGrid>(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, pool, results[0]);
+	times[1] = timeLayout<QuadLayout>(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, pool, results[1]);
+	times[2] = timeLayout<PackedLayout>(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, pool, results[2]);
+	const char* names[3] = { PlaneGrid::Name(), QuadLayout::Name(), PackedLayout::Name() };
+	int best = int(std::min_element(times, times + 3) - times);
+
+	int failures = 0;
+	for (int l = 0; l < 3; l++)
+	{
+		std::cout << names[l] << " " << times[l] << " s/step ";
+		failures += !compareWithReference(results[l], reference);
+		std::cout << ", ";
+	}
+	std::cout << "fastest " << names[best] << " (" << times[0] / times[best] << "x plane)";
+	return failures;
+}
+
+// Returns the failed comparisons
+int testLayouts(const char* zPath, const char* lPath)
+{
+	std::cout << "Substate layout benchmark" << std::endl;
+	const int sizes[3] = { 256, 1024, 2048 };
+	BenchGrids grids = [&sizes](int index, BenchGrid& grid)
+	{
+		if (index == 3)
+			return false;
+		grid.label = "random";
+		grid.r = grid.c = sizes[index];
+		grid.steps = std::max(2, (1 << 22) / (grid.r * grid.c));
+		randomLavaField(grid.r, grid.c, index + 1, 0.3, 0.0, grid.z, grid.h);
+		return true;
+	};
+	return reportFailures(benchStep(zPath, lPath, grids, 5, compareLayouts));
+}
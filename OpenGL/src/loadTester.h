@@ -0,0 +1,58 @@
+#pragma once
+
+#include "globals.h"
+#include "VertexCreation.h"
+#include "gridParser.h"
+
+#include "util.hpp"
+
+static bool sameGrid(const FileData& a, const FileData& b)
+{
+	return a.ncols == b.ncols && a.nrows == b.nrows && a.cellsize == b.cellsize &&
+		a.NoDataValue == b.NoDataValue && a.values == b.values;
+}
+
+// Compares the load time of readFile against the memory mapped loader on the given file
+void testGridLoader(const char* path, int repetitions)
+{
+	FileData reference, mapped;
+	double timeReadFile = 0, timeMapped = 0;
+
+	for (int r = 0; r < repetitions; r++)
+	{
+		util::Timer timer;
+		reference = readFile(path);
+		timeReadFile += static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+		timer.reset();
+		mapped = readFileMapped(path);
+		timeMapped += static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	}
+
+	std::cout << "\t" << path << " (" << reference.nrows << "x" << reference.ncols << ")" << std::endl;
+	std::cout << "\t\treadFile avg time: " << timeReadFile / repetitions << " seconds" << std::endl;
+	std::cout << "\t\treadFileMapped avg time: " << timeMapped / repetitions << " seconds" << std::endl;
+	std::cout << "\t\tSpeedup: " << timeReadFile / timeMapped << "x" << std::endl;
+	std::cout << "\t\tOutput " << (sameGrid(reference, mapped) ? "identical" : "DIFFERS") << std::endl;
+
+	unsigned int maxThreads = std::thread::hardware_concurrency();
+	for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		double timeParallel = 0;
+		for (int r = 0; r < repetitions; r++)
+		{
+			util::Timer timer;
+			mapped = readFileParallel(path, threads);
+			timeParallel += static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+		}
+		std::cout << "\t\treadFileParallel (" << threads << " threads) avg time: " << timeParallel / repetitions << " seconds, "
+			<< timeReadFile / timeParallel << "x, " << (sameGrid(reference, mapped) ? "identical" : "DIFFERS") << std::endl;
+	}
+}
+
+void testGridLoaders(const char* zPath, const char* lPath)
+{
+	std::cout << "Grid loader benchmark" << std::endl;
+	testGridLoader(zPath, 5);
+	testGridLoader(lPath, 5);
+}
@@ -19,23 +19,122 @@
 
 #include "err_code.h"
 #include "globals.h"
+#include "region.h"
 
+// Launch arguments covering a region of the grid through the global offset; the kernels check the grid bounds themselves
+static cl::EnqueueArgs regionArgs(const Region& r)
+{
+	return cl::EnqueueArgs(queue, cl::NDRange(r.row0, r.col0), cl::NDRange(r.row1 - r.row0, r.col1 - r.col0), cl::NullRange);
+}
+
+// Side of the work-groups of the kernels measuring the step, as CHANGE_GROUP in kernel2.cl
+const int changeGroup = 16;
+
+// Work-groups covering the whole grid, the most a monitored launch can have
+static size_t changeGroups(int nrows, int ncols)
+{
+	return size_t((nrows + changeGroup - 1) / changeGroup) * ((ncols + changeGroup - 1) / changeGroup);
+}
+
+// Launch arguments of the monitored kernels: the region rounded up to whole work-groups
+static cl::EnqueueArgs changeArgs(const Region& r)
+{
+	int rows = (r.row1 - r.row0 + changeGroup - 1) / changeGroup * changeGroup;
+	int cols = (r.col1 - r.col0 + changeGroup - 1) / changeGroup * changeGroup;
+	return cl::EnqueueArgs(queue, cl::NDRange(r.row0, r.col0), cl::NDRange(rows, cols), cl::NDRange(changeGroup, changeGroup));
+}
+
+/*	The device substates are double, or float with --precision=float or mixed (the kernels are
+	built with -DREAL=float, see flowPrecision.h); the host layers stay double and are converted
+	when copied.
+	*/
+static size_t deviceRealSize()
+{
+	return precision == PRECISION_DOUBLE ? sizeof(double) : sizeof(float);
+}
 
-void run(int nrows, int ncols, int nneighbors, float NDataValue)
+// A device buffer initialized with count values of a host layer
+static cl::Buffer deviceBuffer(const double* values, size_t count, cl_mem_flags flags)
+{
+	if (precision == PRECISION_DOUBLE)
+		return cl::Buffer(context, flags | CL_MEM_COPY_HOST_PTR, sizeof(double) * count, const_cast<double*>(values));
+	std::vector<float> converted(values, values + count);
+	return cl::Buffer(context, flags | CL_MEM_COPY_HOST_PTR, sizeof(float) * count, converted.data());
+}
+
+// Writes count values of a host layer into a device buffer, from the value at offset
+static void writeDevice(const cl::Buffer& buffer, size_t offset, size_t count, const double* values)
+{
+	if (precision == PRECISION_DOUBLE)
+	{
+		queue.enqueueWriteBuffer(buffer, CL_TRUE, sizeof(double) * offset, sizeof(double) * count, values);
+		return;
+	}
+	std::vector<float> converted(values, values + count);
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, sizeof(float) * offset, sizeof(float) * count, converted.data());
+}
+
+// Reads count values of a device buffer into a host layer, adding them to it when accumulate
+static void readDevice(const cl::Buffer& buffer, size_t count, double* values, bool accumulate = false)
+{
+	if (precision == PRECISION_DOUBLE && !accumulate)
+	{
+		queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(double) * count, values);
+		return;
+	}
+	std::vector<float> converted(count);
+	queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(float) * count, converted.data());
+	for (size_t k = 0; k < count; k++)
+		values[k] = accumulate ? values[k] + converted[k] : converted[k];
+}
+
+// Copies the device thickness into H, with its compensation in mixed precision
+static void readThickness()
+{
+	readDevice(hB, H.size(), H.data());
+	if (precision == PRECISION_MIXED)
+		readDevice(hCompB, H.size(), H.data(), true);
+}
+
+
+// Reduces the per work-group changes written by the monitored kernels over a region into change
+static void readChange(const Region& region, StepChange& change)
+{
+	size_t groups = size_t((region.row1 - region.row0 + changeGroup - 1) / changeGroup) * ((region.col1 - region.col0 + changeGroup - 1) / changeGroup);
+	std::vector<double> partial(3 * groups);
+	readDevice(changeB, partial.size(), partial.data());
+	for (size_t g = 0; g < groups; g++)
+	{
+		change.maxDelta = std::max(change.maxDelta, partial[3 * g]);
+		change.outflow += partial[3 * g + 1];
+		change.wetCells += size_t(partial[3 * g + 2]);
+	}
+}
+
+// With change, the mass balance also measures the step, reduced per work-group on the device
+void run(int nrows, int ncols, int nneighbors, float NDataValue, const Region& outflow, const Region& balance, StepChange* change = NULL)
 {
 	try
 	{
 		// 4 - Define the kernel
-		cl::make_kernel<int, int, float, int, float, cl::Buffer, cl::Buffer, cl::Buffer> kernel1(outflow_computation, "kernel1");
-		cl::make_kernel<int, int, float, int, cl::Buffer, cl::Buffer, cl::Buffer> kernel2(mass_balance, "kernel2");
-		cl::make_kernel<int, int, float, int, cl::Buffer, cl::Buffer> kernel3(outflow_reset, "kernel3");
+		cl::make_kernel<int, int, float, int, float, cl::Buffer, cl::Buffer, cl::Buffer> kernel1(outflow_computation, outflowSolver == SOLVER_SORTED ? "kernel1_sorted" : "kernel1");
+		cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer, cl::Buffer> kernel2(mass_balance, "kernel2");
+		cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> kernel2_compensated(mass_balance, "kernel2_compensated");
+		cl::make_kernel<int, int, int, float, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> kernel2_monitored(mass_balance, "kernel2_monitored");
+		cl::make_kernel<int, int, int, float, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> kernel2_compensated_monitored(mass_balance, "kernel2_compensated_monitored");
+
+		// the kernels check the same bounds themselves (0 < i < nrows - 1, 0 < j < ncols - 1)
+		Region k1 = intersect(outflow, interiorRegion(nrows, ncols));
+		Region k2 = intersect(balance, interiorRegion(nrows, ncols));
+		if (isEmpty(k1))
+			return;
 
 		// 5.2 - Execute Kernels
 		kernel1(
-			cl::EnqueueArgs(queue, cl::NDRange(nrows - 1, ncols - 1)),
+			regionArgs(k1),
 			nrows,
 			ncols,
-			0.75,
+			dumping_factor,
 			nneighbors,
 			NDataValue,
 			zB,
@@ -43,19 +142,92 @@ void run(int nrows, int ncols, int nneighbors, float NDataValue)
 			SoB
 		);
 
-		kernel2(
-			cl::EnqueueArgs(queue, cl::NDRange(nrows - 1, ncols - 1)),
-			nrows,
-			ncols,
-			nneighbors,
-			NDataValue,
-			zB,
-			hB,
-			SoB
-		);
+		// kernel1 writes every outflow slot, so no kernel3 reset is needed after the balance
+		if (change && precision == PRECISION_MIXED)
+			kernel2_compensated_monitored(
+				changeArgs(k2),
+				nrows,
+				ncols,
+				nneighbors,
+				NDataValue,
+				k2.row1,
+				k2.col1,
+				zB,
+				hB,
+				SoB,
+				hCompB,
+				changeB
+			);
+		else if (change)
+			kernel2_monitored(
+				changeArgs(k2),
+				nrows,
+				ncols,
+				nneighbors,
+				NDataValue,
+				k2.row1,
+				k2.col1,
+				zB,
+				hB,
+				SoB,
+				changeB
+			);
+		else if (precision == PRECISION_MIXED)
+			kernel2_compensated(
+				regionArgs(k2),
+				nrows,
+				ncols,
+				nneighbors,
+				NDataValue,
+				zB,
+				hB,
+				SoB,
+				hCompB
+			);
+		else
+			kernel2(
+				regionArgs(k2),
+				nrows,
+				ncols,
+				nneighbors,
+				NDataValue,
+				zB,
+				hB,
+				SoB
+			);
+
+		queue.finish();
+
+		readThickness();
+		if (change)
+			readChange(k2, *change);
+
+	}
+	catch (cl::Error err) {
+		std::cout << "Exception\n";
+		std::cerr
+			<< "ERROR: "
+			<< err.what()
+			<< "("
+			<< err_code(err.err())
+			<< ")"
+			<< std::endl;
+	}
+}
+
+// Zeroes the outflows of the cells of a region on the device, see clearOutflows in flow.h
+void clearOutflowsParallel(int nrows, int ncols, int nneighbors, float NDataValue, const Region& region)
+{
+	try
+	{
+		cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer> kernel3(outflow_reset, "kernel3");
+
+		Region cells = intersect(region, interiorRegion(nrows, ncols));
+		if (isEmpty(cells))
+			return;
 
 		kernel3(
-			cl::EnqueueArgs(queue, cl::NDRange(nrows - 1, ncols - 1)),
+			regionArgs(cells),
 			nrows,
 			ncols,
 			nneighbors,
@@ -63,11 +235,6 @@ void run(int nrows, int ncols, int nneighbors, float NDataValue)
 			zB,
 			SoB
 		);
-
-		queue.finish();
-
-		cl::copy(queue, hB, H.begin(), H.end());
-
 	}
 	catch (cl::Error err) {
 		std::cout << "Exception\n";
@@ -79,4 +246,4 @@ void run(int nrows, int ncols, int nneighbors, float NDataValue)
 			<< ")"
 			<< std::endl;
 	}
-}
\ No newline at end of file
+}
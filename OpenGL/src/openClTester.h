@@ -4,39 +4,60 @@
 #include "globals.h"
 #include "flow.h"
 #include "openClExecutor.h"
+#include "threadedExecutor.h"
+#include "flowSimd.h"
+#include "solverTester.h"
+#include "gatherExecutor.h"
+#include "paddedGrid.h"
+#include "compactDomain.h"
+#include "reachability.h"
+#include "convergence.h"
+#include "stepTester.h"
 
 #include "err_code.h"
 #include "util.hpp"
 
 
+// With --converge, stops once the flow has settled; the other backends then run the steps it ran
 void serialAlgorithm(double* z, double* sThickness, double* So[], Neighborhood& neighborhood)
 {
 	util::Timer timer;
 	double timeKernel1 = 0, timeKernel2 = 0, timeKernel3 = 0, sumOfCopiesTime = 0;
+	Region sweep = interiorRegion(nrows, ncols);
+	int executed = 0;
     for (int i = steps; i > 0; i--) {
 
 		util::Timer timerIter;
 
-        for (int i = 1; i < nrows - 2; i++)
-            for (int j = 1; j < nrows - 2; j++)
+        for (int i = sweep.row0; i < sweep.row1; i++)
+            for (int j = sweep.col0; j < sweep.col1; j++)
                 if (z[i * ncols + j] != NoDataValue)
                     kernel1_outflow_computation(ncols, i, j, z, sThickness, So, dumping_factor, neighborhood);
 		timeKernel1 += static_cast<double>(timerIter.getTimeMilliseconds()) / 1000.0;
 		timerIter.reset();
 
-        for (int i = 1; i < nrows - 2; i++)
-            for (int j = 1; j < nrows - 2; j++)
+		StepChange change;
+        for (int i = sweep.row0; i < sweep.row1; i++)
+            for (int j = sweep.col0; j < sweep.col1; j++)
                 if (z[i * ncols + j] != NoDataValue)
-                    kernel2_mass_balance(ncols, i, j, sThickness, So, neighborhood);
+                    kernel2_mass_balance(ncols, i, j, sThickness, So, neighborhood, converge ? &change : NULL);
 		timeKernel2 += static_cast<double>(timerIter.getTimeMilliseconds()) / 1000.0;
 		timerIter.reset();
 
-        for (int i = 1; i < nrows - 2; i++)
-            for (int j = 1; j < nrows - 2; j++)
+        for (int i = sweep.row0; i < sweep.row1; i++)
+            for (int j = sweep.col0; j < sweep.col1; j++)
                 if (z[i * ncols + j] != NoDataValue)
                     kernel3_outflow_reset(ncols, i, j, So, neighborhood);
 		timeKernel3 += static_cast<double>(timerIter.getTimeMilliseconds()) / 1000.0;
 		timerIter.reset();
+		executed++;
+		if (converge && stepSettled(change))
+		{
+			std::cout << "\tConverged at step " << executed << ": max |dh| " << change.maxDelta << ", outflow per wet cell " << change.MeanOutflow()
+				<< ", " << steps - executed << " steps saved" << std::endl;
+			steps = executed;
+			break;
+		}
     }
 	double rtime = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
     std::cout << "\tExecuted " << steps << " steps in " << rtime << " seconds" << std::endl;
@@ -51,8 +72,8 @@ void parallelAlgorithm()
 	{
 
 		cl::make_kernel<int, int, float, int, float, cl::Buffer, cl::Buffer, cl::Buffer> kernel1(outflow_computation, "kernel1");
-		cl::make_kernel<int, int, float, int, cl::Buffer, cl::Buffer, cl::Buffer> kernel2(mass_balance, "kernel2");
-		cl::make_kernel<int, int, float, int, cl::Buffer, cl::Buffer> kernel3(outflow_reset, "kernel3");
+		cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer, cl::Buffer> kernel2(mass_balance, "kernel2");
+		cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer> kernel3(outflow_reset, "kernel3");
 
 		util::Timer timer;
 		double timeKernel1 = 0, timeKernel2 = 0, timeKernel3 = 0, sumOfCopiesTime = 0;
@@ -126,11 +147,245 @@ void parallelAlgorithm()
 		
 }
 
-void test(double* z, double* sThickness, double* So[], Neighborhood& neighborhood)
+// Steps with the threaded sweep, which must give the thickness of the fused sweep
+bool threadedAlgorithm(double* z, double* sThickness, const ReferenceRun& reference)
+{
+	if (!simulationPool)
+		initThreadedExecutor(numThreads);
+	threadedPassTime[0] = threadedPassTime[1] = 0;
+
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> threadedH(sThickness, sThickness + size);
+	std::vector<double> threadedSo(size * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+	double* threadedPlanes[VON_NEUMANN_NEIGHBORS] = { NULL };		// So[0] is not used
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		threadedPlanes[n] = threadedSo.data() + (n - 1) * size;
+
+	util::Timer timer;
+	for (int n = steps; n > 0; n--)
+		runThreaded(z, threadedH.data(), threadedPlanes, dumping_factor, nrows, ncols, NoDataValue, gridRegion(nrows, ncols), gridRegion(nrows, ncols));
+	double rtime = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
+	std::cout << "\tExecuted " << steps << " steps on " << simulationPool->GetSize() + 1 << " threads in " << rtime << " seconds" << std::endl;
+	std::cout << "\t\tKernel 1 avg time: " << threadedPassTime[0] / steps << " seconds" << std::endl;
+	std::cout << "\t\tKernel 2 avg time: " << threadedPassTime[1] / steps << " seconds" << std::endl;
+	std::cout << "\tThickness ";
+	bool identical = compareWithReference(threadedH, reference);
+	std::cout << std::endl;
+	return identical;
+}
+
+// Steps with the three passes of globalTransitionFunction, which must give the thickness of the fused sweep
+bool fusedAlgorithm(double* z, double* sThickness, Neighborhood& neighborhood, const ReferenceRun& reference)
+{
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> passesH(sThickness, sThickness + size);
+	std::vector<double> passesSo(size * VON_NEUMANN_NEIGHBORS, 0.0);
+	double* passesPlanes[VON_NEUMANN_NEIGHBORS];
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+		passesPlanes[n] = passesSo.data() + n * size;
+
+	util::Timer timer;
+	for (int n = steps; n > 0; n--)
+		globalTransitionFunction(z, passesH.data(), passesPlanes, dumping_factor, nrows, ncols, neighborhood, NoDataValue);
+	double timePasses = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	std::cout << "\tExecuted " << steps << " steps in " << reference.seconds << " seconds, three passes: " << timePasses
+		<< " seconds (" << timePasses / reference.seconds << "x)" << std::endl;
+	std::cout << "\tThickness ";
+	bool identical = compareWithReference(passesH, reference);
+	std::cout << std::endl;
+	return identical;
+}
+
+// Steps with the outflow-free gather step, which must give the thickness of the fused sweep
+bool gatherAlgorithm(double* z, double* sThickness, const ReferenceRun& reference)
+{
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> gatherH(sThickness, sThickness + size), gatherNext(gatherH);
+
+	bool wasThreaded = threaded;
+	threaded = false;
+	lastGatherRegion = { 0, 0, 0, 0 };
+	util::Timer timer;
+	for (int n = steps; n > 0; n--)
+		runGather(z, gatherH, gatherNext, dumping_factor, nrows, ncols, NoDataValue, gridRegion(nrows, ncols));
+	double timeGather = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	threaded = wasThreaded;
+	lastGatherRegion = { 0, 0, 0, 0 };
+
+	std::cout << "\tExecuted " << steps << " steps in " << timeGather << " seconds, fused sweep: " << reference.seconds
+		<< " seconds (" << reference.seconds / timeGather << "x), " << 3 * sizeof(double) << " bytes per cell instead of "
+		<< (2 + VON_NEUMANN_NEIGHBORS) * sizeof(double) << std::endl;
+	std::cout << "\tThickness ";
+	bool identical = compareWithReference(gatherH, reference);
+	std::cout << std::endl;
+	return identical;
+}
+
+// Steps with the branch-free sweep on the padded grid, which must give the thickness of the fused sweep
+bool paddedAlgorithm(double* z, double* sThickness, const ReferenceRun& reference)
+{
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> paddedH(sThickness, sThickness + size);
+
+	PaddedGrid grid;
+	loadPadded(grid, z, paddedH.data(), nrows, ncols, NoDataValue);
+	util::Timer timer;
+	for (int n = steps; n > 0; n--)
+		paddedTransitionFunction(grid, dumping_factor, gridRegion(nrows, ncols), gridRegion(nrows, ncols));
+	double timePadded = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	storePaddedThickness(grid, paddedH.data(), gridRegion(nrows, ncols));
+
+	std::cout << "\tExecuted " << steps << " steps in " << timePadded << " seconds, scalar fused sweep: " << reference.seconds
+		<< " seconds (" << reference.seconds / timePadded << "x)" << std::endl;
+	std::cout << "\tThickness ";
+	bool identical = compareWithReference(paddedH, reference);
+	std::cout << std::endl;
+	return identical;
+}
+
+// Steps on the compact domain, which must give the thickness of the fused sweep
+bool compactAlgorithm(double* z, double* sThickness, const ReferenceRun& reference)
+{
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> compactH(sThickness, sThickness + size);
+
+	CompactDomain domain;
+	buildCompactDomain(domain, z, compactH.data(), nrows, ncols, NoDataValue);
+	util::Timer timer;
+	for (int n = steps; n > 0; n--)
+		compactTransitionFunction(domain, dumping_factor, NULL, gridRegion(nrows, ncols), gridRegion(nrows, ncols));
+	double timeCompact = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	storeCompactThickness(domain, compactH.data(), gridRegion(nrows, ncols));
+
+	std::cout << "\t" << domain.cells << " cells with data (" << 100.0 * domain.cells / size << "% of the grid), " << domain.ghosts << " ghost cells, "
+		<< domain.Bytes() / 1048576.0 << " MB instead of " << (2 + VON_NEUMANN_NEIGHBORS) * sizeof(double) * size / 1048576.0 << " MB" << std::endl;
+	std::cout << "\tExecuted " << steps << " steps in " << timeCompact << " seconds, scalar fused sweep: " << reference.seconds
+		<< " seconds (" << reference.seconds / timeCompact << "x)" << std::endl;
+	std::cout << "\tThickness ";
+	bool identical = compareWithReference(compactH, reference);
+	std::cout << std::endl;
+	return identical;
+}
+
+// The lava of the fused sweep must stay within the cells of the reachability pre-pass, and the walls that replace the other cells must not change it
+bool reachAlgorithm(double* z, double* sThickness, const ReferenceRun& reference)
+{
+	size_t size = size_t(nrows) * ncols;
+	ThreadPool pool(numThreads);
+	std::vector<unsigned char> mask;
+	ReachStats stats = computeReachable(z, sThickness, nrows, ncols, NoDataValue, reachTolerance, pool, mask);
+
+	size_t outside = 0;
+	Region interior = interiorRegion(nrows, ncols);
+	for (int i = interior.row0; i < interior.row1; i++)
+		for (int j = interior.col0; j < interior.col1; j++)
+			if (reference.h[size_t(i) * ncols + j] != 0.0 && !mask[size_t(i) * ncols + j] && z[size_t(i) * ncols + j] != NoDataValue)
+				outside++;
+
+	std::cout << "\t" << stats.reachableCells << " of " << stats.dataCells << " cells reachable with a tolerance of " << reachTolerance << " ("
+		<< 100.0 * (stats.dataCells - stats.reachableCells) / std::max<size_t>(stats.dataCells, 1) << "% pruned), " << stats.rounds << " rounds, "
+		<< stats.seconds << " seconds" << std::endl;
+	if (outside == 0)
+		std::cout << "\tNo lava outside the reachable cells after " << steps << " steps" << std::endl;
+	else
+		std::cout << "\tLava OUTSIDE the reachable cells after " << steps << " steps, in " << outside << " cells: the tolerance is too low" << std::endl;
+
+	std::vector<double> walledZ(z, z + size), walledH(sThickness, sThickness + size);
+	std::vector<double> walledSo(size * VON_NEUMANN_NEIGHBORS, 0.0);
+	double* walledPlanes[VON_NEUMANN_NEIGHBORS];
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+		walledPlanes[n] = walledSo.data() + n * size;
+	std::vector<ReachWall> walls;
+	raiseReachWalls(walledZ.data(), mask.data(), nrows, ncols, NoDataValue, interiorRegion(nrows, ncols), walls);
+	Neighborhood V;
+	bool spilled = false;
+	for (int n = steps; n > 0; n--)
+	{
+		globalTransitionFunction(walledZ.data(), walledH.data(), walledPlanes, dumping_factor, nrows, ncols, V, NoDataValue, gridRegion(nrows, ncols), gridRegion(nrows, ncols));
+		spilled = spilled || reachWallsSpilled(walledZ.data(), walledH.data(), mask.data(), nrows, ncols, walls);
+	}
+	std::cout << "\tThickness with the unreachable cells as walls ";
+	bool identical = compareWithReference(walledH, reference);
+	std::cout << (spilled ? ", lava held back by a wall" : ", no lava held back") << std::endl;
+	return outside == 0 && identical;
+}
+
+// One outflow pass with the scalar kernel1 and one with the vectorized kernel, which must give the same outflows
+bool simdAlgorithm(double* z, double* sThickness, Neighborhood& neighborhood)
 {
+	OutflowRowKernel kernel = outflowRowKernel;
+	if (!kernel || simdLevel == SIMD_OFF)
+	{
+		std::cout << "\tNo SIMD kernel selected" << std::endl;
+		return true;
+	}
+
+	size_t size = size_t(nrows) * ncols;
+	std::vector<double> scalarSo(size * VON_NEUMANN_NEIGHBORS, 0.0), simdSo(size * VON_NEUMANN_NEIGHBORS, 0.0);
+	double* scalarPlanes[VON_NEUMANN_NEIGHBORS];
+	double* simdPlanes[VON_NEUMANN_NEIGHBORS];
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+	{
+		scalarPlanes[n] = scalarSo.data() + n * size;
+		simdPlanes[n] = simdSo.data() + n * size;
+	}
+	Region sweep = interiorRegion(nrows, ncols);
+
+	util::Timer timer;
+	for (int i = sweep.row0; i < sweep.row1; i++)
+		for (int j = sweep.col0; j < sweep.col1; j++)
+			if (z[i * ncols + j] != NoDataValue)
+				kernel1_outflow_computation(ncols, i, j, z, sThickness, scalarPlanes, dumping_factor, neighborhood);
+	double timeScalar = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	timer.reset();
+	for (int i = sweep.row0; i < sweep.row1; i++)
+		kernel(ncols, i, sweep.col0, sweep.col1, z, sThickness, simdPlanes, dumping_factor, NoDataValue, neighborhood);
+	double timeSimd = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	std::cout << "\t" << simdLevelName(simdLevel) << " kernel 1 time: " << timeSimd << " seconds, scalar: " << timeScalar
+		<< " seconds (" << timeScalar / timeSimd << "x)" << std::endl;
+	bool identical = memcmp(scalarSo.data(), simdSo.data(), scalarSo.size() * sizeof(double)) == 0;
+	std::cout << "\tOutflows " << (identical ? "identical" : "DIFFER") << std::endl;
+	return identical;
+}
+
+// Runs the tests on the loaded grids; returns the failed comparisons
+int test(double* z, double* sThickness, double* So[], Neighborhood& neighborhood)
+{
+	int failures = 0;
+	std::cout << "SIMD outflow kernel" << std::endl;
+	failures += !simdAlgorithm(z, sThickness, neighborhood);
+
+	std::cout << "Sorted outflow solver" << std::endl;
+	failures += !compareOutflowSolvers("input grids", z, sThickness, nrows, ncols, NoDataValue);
+
+	// the fused sweep is the reference of the steps below; the serial run may stop them early with --converge
 	std::cout << "Serial execution algorithm" << std::endl;
+	std::vector<double> initialH(sThickness, sThickness + size_t(nrows) * ncols);
 	serialAlgorithm(z, sThickness, So, neighborhood);
+	ReferenceRun reference = referenceRun(z, initialH.data(), nrows, ncols, NoDataValue, steps);
+
+	std::cout << "Fused serial step" << std::endl;
+	failures += !fusedAlgorithm(z, initialH.data(), neighborhood, reference);
+
+	std::cout << "Outflow-free gather step" << std::endl;
+	failures += !gatherAlgorithm(z, initialH.data(), reference);
+
+	std::cout << "Padded branch-free step" << std::endl;
+	failures += !paddedAlgorithm(z, initialH.data(), reference);
+
+	std::cout << "Compact NoData-free step" << std::endl;
+	failures += !compactAlgorithm(z, initialH.data(), reference);
+
+	std::cout << "Reachability pre-pass" << std::endl;
+	failures += !reachAlgorithm(z, initialH.data(), reference);
+
+	std::cout << "Threaded execution algorithm" << std::endl;
+	failures += !threadedAlgorithm(z, initialH.data(), reference);
 
 	std::cout << "Parallel execution algorithm" << std::endl;
 	parallelAlgorithm();
-}
\ No newline at end of file
+	return reportFailures(failures);
+}
@@ -0,0 +1,622 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "gridBinary.h"
+#include "sparseGrid.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Out-of-core simulation. The grid lives in a tile file: a 64-byte header followed by one record
+per SPARSE_BLOCK x SPARSE_BLOCK tile, row major, holding the Z, H and the four outflow planes of
+the tile and the altitudes of its halo (the layout of the first arrays of SparseBlock, so a record
+is read into a block as is, and H and the outflows are written from it). Cells outside the grid
+are no-data.
+
+A TileCache keeps at most a budget of tiles in memory and evicts the least recently used one
+that is not in use. All the file accesses go through one I/O thread, in order: a dirty tile is
+evicted by queueing its write, so the step goes on while it is written, and a read queued later
+for the same tile sees the written data. Tiles are prefetched by queueing their reads ahead of
+use, and acquiring a tile waits only for the reads that are not done yet.
+
+The step is the one of the sparse grid (sparseGrid.h): the tiles with lava and the ones within
+two cells of it are updated and the others are neither read nor written, with the kernels of
+sparseGrid.h. The wet state of every tile (lava anywhere, and in the two cell bands along its
+sides and corners) is kept in memory, two bytes per tile, so the active tiles are known without
+reading the file. The outflows are swept in row-major order and the balances in the reverse
+order, so each pass starts on the tiles the previous one used last and still has in cache. While
+a pass runs, the tiles it reaches next are prefetched; after a step, the tiles beyond the sides
+where the box of the wet tiles has grown, the ones the front is moving into, are prefetched too.
+The results are the ones of the sparse grid, and of the dense one.
+
+runOutOfCore is the headless run of the application (./OpenGL outofcore ...): it converts the
+altitudes and lava grid files into a tile file and steps it through a TileCache. The rows of a
+binary grid are streamed from its mapped payload, so that grid is never held in memory whole;
+the other formats are parsed into memory first, as the loaders of the application do.
+*/
+
+const char TILE_FILE_MAGIC[8] = { 'L', 'A', 'V', 'A', 'T', 'I', 'L', '\0' };
+const uint32_t TILE_FILE_VERSION = 2;
+const uint64_t TILE_FILE_ALIGNMENT = 64;
+const size_t TILE_WRITE_DOUBLES = size_t(VON_NEUMANN_NEIGHBORS) * SPARSE_BLOCK_CELLS;	// H and the outflows
+const size_t TILE_RECORD_DOUBLES = SPARSE_BLOCK_CELLS + TILE_WRITE_DOUBLES + VON_NEUMANN_NEIGHBORS * SPARSE_BLOCK;	// Z, H, the outflows and the halo
+
+struct TileFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t tileSize;		// SPARSE_BLOCK
+	uint32_t nrows;
+	uint32_t ncols;
+	double NoDataValue;
+	uint64_t payloadOffset;
+	uint64_t reserved[3];
+};
+
+static_assert(sizeof(TileFileHeader) == 64, "TileFileHeader must stay 64 bytes");
+static_assert(offsetof(SparseBlock, so) == 2 * SPARSE_BLOCK_CELLS * sizeof(double), "a tile record is the first arrays of SparseBlock");
+static_assert(offsetof(SparseBlock, halo) == offsetof(SparseBlock, z) + (TILE_RECORD_DOUBLES - VON_NEUMANN_NEIGHBORS * SPARSE_BLOCK) * sizeof(double), "a tile record is the first arrays of SparseBlock");
+
+static bool seekTileFile(FILE* file, uint64_t offset)
+{
+#if defined(_WIN32)
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static inline uint64_t tileOffset(const TileFileHeader& header, int tile)
+{
+	return header.payloadOffset + uint64_t(tile) * TILE_RECORD_DOUBLES * sizeof(double);
+}
+
+// Wet state of a tile, see sparseWet
+enum TileWetFlags
+{
+	TILE_WET = 1,
+	TILE_BAND_TOP = 2,
+	TILE_BAND_LEFT = 4,
+	TILE_BAND_RIGHT = 8,
+	TILE_BAND_BOTTOM = 16,
+	TILE_CORNER_TOP_LEFT = 32,
+	TILE_CORNER_TOP_RIGHT = 64,
+	TILE_CORNER_BOTTOM_LEFT = 128,
+	TILE_CORNER_BOTTOM_RIGHT = 256
+};
+
+static int tileWetFlags(const SparseBlock* b)
+{
+	const int band = 2, last = SPARSE_BLOCK - band;
+	int flags = 0;
+	if (sparseWet(b, 0, SPARSE_BLOCK, 0, SPARSE_BLOCK))
+		flags |= TILE_WET;
+	else
+		return 0;
+	flags |= sparseWet(b, 0, band, 0, SPARSE_BLOCK) ? TILE_BAND_TOP : 0;
+	flags |= sparseWet(b, 0, SPARSE_BLOCK, 0, band) ? TILE_BAND_LEFT : 0;
+	flags |= sparseWet(b, 0, SPARSE_BLOCK, last, SPARSE_BLOCK) ? TILE_BAND_RIGHT : 0;
+	flags |= sparseWet(b, last, SPARSE_BLOCK, 0, SPARSE_BLOCK) ? TILE_BAND_BOTTOM : 0;
+	flags |= sparseWet(b, 0, band, 0, band) ? TILE_CORNER_TOP_LEFT : 0;
+	flags |= sparseWet(b, 0, band, last, SPARSE_BLOCK) ? TILE_CORNER_TOP_RIGHT : 0;
+	flags |= sparseWet(b, last, SPARSE_BLOCK, 0, band) ? TILE_CORNER_BOTTOM_LEFT : 0;
+	flags |= sparseWet(b, last, SPARSE_BLOCK, last, SPARSE_BLOCK) ? TILE_CORNER_BOTTOM_RIGHT : 0;
+	return flags;
+}
+
+// Writes a tile file for an r x c grid from its altitudes and thickness; returns the wet flags of the tiles
+static std::vector<unsigned short> createTileFile(const std::string& path, int r, int c, double nodata, const AltitudeSource& altitudes, const AltitudeSource& thickness)
+{
+	FILE* out = fopen(path.c_str(), "wb");
+	if (out == NULL)
+		throw std::runtime_error("Cannot create file: " + path);
+
+	TileFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+	header.version = TILE_FILE_VERSION;
+	header.tileSize = SPARSE_BLOCK;
+	header.nrows = r;
+	header.ncols = c;
+	header.NoDataValue = nodata;
+	header.payloadOffset = TILE_FILE_ALIGNMENT;
+	fwrite(&header, sizeof(header), 1, out);
+
+	int blockRows = (r + SPARSE_BLOCK - 1) / SPARSE_BLOCK, blockCols = (c + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+	std::vector<unsigned short> flags(size_t(blockRows) * blockCols);
+	std::unique_ptr<SparseBlock> b(new SparseBlock());
+	for (int bi = 0; bi < blockRows; bi++)
+		for (int bj = 0; bj < blockCols; bj++)
+		{
+			std::fill(b->z, b->z + SPARSE_BLOCK_CELLS, nodata);
+			std::fill(b->h, b->h + SPARSE_BLOCK_CELLS, 0.0);
+			memset(b->so, 0, sizeof(b->so));
+			b->row0 = bi * SPARSE_BLOCK;
+			b->col0 = bj * SPARSE_BLOCK;
+			int rows = std::min(SPARSE_BLOCK, r - b->row0), cols = std::min(SPARSE_BLOCK, c - b->col0);
+			for (int i = 0; i < rows; i++)
+			{
+				altitudes(b->row0 + i, b->col0, cols, b->z + i * SPARSE_BLOCK);
+				thickness(b->row0 + i, b->col0, cols, b->h + i * SPARSE_BLOCK);
+			}
+			readSparseHalo(&*b, r, c, nodata, altitudes);
+			flags[size_t(bi) * blockCols + bj] = (unsigned short)tileWetFlags(&*b);
+			fwrite(b->z, sizeof(double), TILE_RECORD_DOUBLES, out);
+		}
+
+	bool failed = ferror(out) != 0;
+	if (fclose(out) != 0 || failed)
+		throw std::runtime_error("Cannot write file: " + path);
+	return flags;
+}
+
+class TileCache
+{
+	private:
+		struct Entry
+		{
+			std::unique_ptr<SparseBlock> tile;
+			std::list<int>::iterator use;
+			bool dirty = false;
+			bool loading = false;		// read queued and not done yet
+			int pins = 0;
+		};
+
+		FILE* m_File;
+		TileFileHeader m_Header;
+		int m_BlockCols;
+		size_t m_Capacity;
+		std::unordered_map<int, Entry> m_Entries;
+		std::list<int> m_Lru;		// most recently used first
+		std::vector<std::unique_ptr<SparseBlock>> m_Free;
+		size_t m_Writing;			// tiles handed to the I/O thread for writing
+		size_t m_Peak;
+		bool m_Failed;
+		std::mutex m_Mutex;
+		std::condition_variable m_Done;
+		ThreadPool m_Io;
+
+		std::unique_ptr<SparseBlock> Allocate()
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			std::unique_ptr<SparseBlock> b;
+			if (!m_Free.empty())
+			{
+				b = std::move(m_Free.back());
+				m_Free.pop_back();
+			}
+			else
+				b.reset(new SparseBlock());
+			return b;
+		}
+
+		// Evicts least recently used tiles that are not in use until there is room for one more
+		void MakeRoom()
+		{
+			for (auto it = m_Lru.rbegin(); m_Entries.size() >= m_Capacity && it != m_Lru.rend();)
+			{
+				int tile = *it;
+				Entry& entry = m_Entries[tile];
+				if (entry.pins > 0 || Loading(entry))
+				{
+					++it;
+					continue;
+				}
+				it = std::list<int>::reverse_iterator(m_Lru.erase(std::next(it).base()));
+				if (entry.dirty)
+				{
+					Write(tile, entry.tile.release(), true);
+					writes++;
+				}
+				else
+				{
+					std::lock_guard<std::mutex> lock(m_Mutex);
+					m_Free.push_back(std::move(entry.tile));
+				}
+				m_Entries.erase(tile);
+			}
+		}
+
+		bool Loading(const Entry& entry)
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			return entry.loading;
+		}
+
+		// Queues the write of H and the outflows of a tile; an evicted buffer is recycled once written
+		void Write(int tile, SparseBlock* data, bool evicted)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Writing++;
+			}
+			uint64_t offset = tileOffset(m_Header, tile) + SPARSE_BLOCK_CELLS * sizeof(double);
+			m_Io.Submit([this, data, offset, evicted]()
+			{
+				bool ok = seekTileFile(m_File, offset) && fwrite(data->h, sizeof(double), TILE_WRITE_DOUBLES, m_File) == TILE_WRITE_DOUBLES;
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Failed = m_Failed || !ok;
+				if (evicted)
+					m_Free.push_back(std::unique_ptr<SparseBlock>(data));
+				m_Writing--;
+				m_Done.notify_all();
+			});
+		}
+
+		// Adds an entry for a tile that is not cached and queues its read
+		Entry& Load(int tile)
+		{
+			MakeRoom();
+			Entry& entry = m_Entries[tile];
+			entry.tile = Allocate();
+			entry.loading = true;
+			m_Lru.push_front(tile);
+			entry.use = m_Lru.begin();
+			m_Peak = std::max(m_Peak, m_Entries.size() + m_Writing);
+
+			SparseBlock* b = &*entry.tile;
+			b->row0 = tile / m_BlockCols * SPARSE_BLOCK;
+			b->col0 = tile % m_BlockCols * SPARSE_BLOCK;
+			uint64_t offset = tileOffset(m_Header, tile);
+			Region interior = interiorRegion(m_Header.nrows, m_Header.ncols);
+			double nodata = m_Header.NoDataValue;
+			m_Io.Submit([this, b, &entry, offset, interior, nodata]()
+			{
+				bool ok = seekTileFile(m_File, offset) && fread(b->z, sizeof(double), TILE_RECORD_DOUBLES, m_File) == TILE_RECORD_DOUBLES;
+				for (int i = 0; i < SPARSE_BLOCK; i++)
+					for (int j = 0; j < SPARSE_BLOCK; j++)
+						b->active[i * SPARSE_BLOCK + j] = inside(interior, b->row0 + i, b->col0 + j) && b->z[i * SPARSE_BLOCK + j] != nodata;
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Failed = m_Failed || !ok;
+				entry.loading = false;
+				m_Done.notify_all();
+			});
+			return entry;
+		}
+
+	public:
+		// Counters since the cache was opened
+		size_t reads = 0;		// tiles read from the file
+		size_t waits = 0;		// acquisitions that had to wait for a read (a miss, or a prefetch too late)
+		size_t writes = 0;		// dirty tiles written back
+
+		// Opens a tile file for reading and writing, with room for capacity tiles (at least 8)
+		TileCache(const std::string& path, size_t capacity): m_Writing(0), m_Peak(0), m_Failed(false), m_Io(1)
+		{
+			m_File = fopen(path.c_str(), "r+b");
+			if (m_File == NULL)
+				throw std::runtime_error("Cannot open file: " + path);
+			if (fread(&m_Header, sizeof(m_Header), 1, m_File) != 1 || memcmp(m_Header.magic, TILE_FILE_MAGIC, sizeof(TILE_FILE_MAGIC)) != 0
+				|| m_Header.version != TILE_FILE_VERSION || m_Header.tileSize != SPARSE_BLOCK)
+			{
+				fclose(m_File);
+				throw std::runtime_error("Not a tile file: " + path);
+			}
+			m_BlockCols = (m_Header.ncols + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+			m_Capacity = std::max<size_t>(capacity, 8);
+		}
+
+		// Writes the dirty tiles back before closing the file
+		~TileCache()
+		{
+			Flush();
+			fclose(m_File);
+		}
+
+		TileCache(const TileCache&) = delete;
+		TileCache& operator=(const TileCache&) = delete;
+
+		const TileFileHeader& Header() const { return m_Header; }
+		size_t Capacity() const { return m_Capacity; }
+		size_t PeakTiles() const { return m_Peak; }
+
+		// Queues the read of a tile that is not cached
+		void Prefetch(int tile)
+		{
+			if (m_Entries.count(tile) == 0)
+			{
+				Load(tile);
+				reads++;
+			}
+		}
+
+		// The tile, read first if needed, kept in memory until Release
+		SparseBlock* Acquire(int tile)
+		{
+			auto found = m_Entries.find(tile);
+			Entry* entry;
+			if (found == m_Entries.end())
+			{
+				entry = &Load(tile);
+				reads++;
+			}
+			else
+			{
+				entry = &found->second;
+				m_Lru.splice(m_Lru.begin(), m_Lru, entry->use);
+			}
+			entry->pins++;
+
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			if (entry->loading)
+			{
+				waits++;
+				m_Done.wait(lock, [entry]() { return !entry->loading; });
+			}
+			if (m_Failed)
+				throw std::runtime_error("Tile file I/O failed");
+			return &*entry->tile;
+		}
+
+		void Release(int tile, bool modified)
+		{
+			Entry& entry = m_Entries[tile];
+			entry.pins--;
+			entry.dirty = entry.dirty || modified;
+		}
+
+		// Writes the dirty tiles back and waits for all the I/O
+		void Flush()
+		{
+			for (auto& e : m_Entries)
+				if (e.second.dirty)
+				{
+					Write(e.first, &*e.second.tile, false);
+					e.second.dirty = false;
+					writes++;
+				}
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Done.wait(lock, [this]() { return m_Writing == 0; });
+			fflush(m_File);
+		}
+};
+
+// The grid of a tile file with the wet flags of its tiles, stepped through a TileCache
+struct OutOfCoreGrid
+{
+	int rows = 0;
+	int cols = 0;
+	int blockRows = 0;
+	int blockCols = 0;
+	double nodata = 0;
+	std::vector<unsigned short> flags;		// TileWetFlags of every tile
+	std::vector<unsigned char> active;		// tiles of the current step
+	std::vector<int> tiles;					// the active tiles, row major
+	Region wetBox = { 0, 0, 0, 0 };			// tiles with lava after the last step
+	int prefetchDistance = 16;				// tiles read ahead of the sweeps
+	std::unique_ptr<TileCache> cache;
+
+	int Tile(int bi, int bj) const { return bi * blockCols + bj; }
+	bool Inside(int bi, int bj) const { return bi >= 0 && bi < blockRows && bj >= 0 && bj < blockCols; }
+};
+
+// Opens a tile file written by createTileFile with its wet flags, with a cache of capacity tiles
+void openOutOfCore(OutOfCoreGrid& g, const std::string& path, const std::vector<unsigned short>& flags, size_t capacity)
+{
+	g.cache.reset(new TileCache(path, capacity));
+	const TileFileHeader& header = g.cache->Header();
+	g.rows = header.nrows;
+	g.cols = header.ncols;
+	g.blockRows = (g.rows + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+	g.blockCols = (g.cols + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+	g.nodata = header.NoDataValue;
+	g.flags = flags;
+	g.active.assign(flags.size(), 0);
+	g.tiles.clear();
+	g.wetBox = { 0, 0, 0, 0 };
+	g.prefetchDistance = int(std::min<size_t>(16, g.cache->Capacity() / 4));
+}
+
+// The tiles with lava and the ones within two cells of it, as expandSparse
+static void selectOutOfCoreTiles(OutOfCoreGrid& g)
+{
+	for (int tile : g.tiles)
+		g.active[tile] = 0;
+	g.tiles.clear();
+
+	auto add = [&g](int bi, int bj)
+	{
+		if (g.Inside(bi, bj) && !g.active[g.Tile(bi, bj)])
+		{
+			g.active[g.Tile(bi, bj)] = 1;
+			g.tiles.push_back(g.Tile(bi, bj));
+		}
+	};
+	Region box = { g.blockRows, 0, g.blockCols, 0 };
+	for (int bi = 0; bi < g.blockRows; bi++)
+		for (int bj = 0; bj < g.blockCols; bj++)
+		{
+			int f = g.flags[g.Tile(bi, bj)];
+			if (!(f & TILE_WET))
+				continue;
+			box = { std::min(box.row0, bi), std::max(box.row1, bi + 1), std::min(box.col0, bj), std::max(box.col1, bj + 1) };
+			add(bi, bj);
+			if (f & TILE_BAND_TOP) add(bi - 1, bj);
+			if (f & TILE_BAND_LEFT) add(bi, bj - 1);
+			if (f & TILE_BAND_RIGHT) add(bi, bj + 1);
+			if (f & TILE_BAND_BOTTOM) add(bi + 1, bj);
+			if (f & TILE_CORNER_TOP_LEFT) add(bi - 1, bj - 1);
+			if (f & TILE_CORNER_TOP_RIGHT) add(bi - 1, bj + 1);
+			if (f & TILE_CORNER_BOTTOM_LEFT) add(bi + 1, bj - 1);
+			if (f & TILE_CORNER_BOTTOM_RIGHT) add(bi + 1, bj + 1);
+		}
+	std::sort(g.tiles.begin(), g.tiles.end());
+
+	// the front: the tiles beyond the sides of the wet box that moved out since the last step
+	Region last = g.wetBox;
+	g.wetBox = isEmpty(box) ? Region{ 0, 0, 0, 0 } : box;
+	if (isEmpty(last) || isEmpty(box))
+		return;
+	for (int bj = box.col0; bj < box.col1; bj++)
+	{
+		if (box.row0 < last.row0 && g.Inside(box.row0 - 1, bj))
+			g.cache->Prefetch(g.Tile(box.row0 - 1, bj));
+		if (box.row1 > last.row1 && g.Inside(box.row1, bj))
+			g.cache->Prefetch(g.Tile(box.row1, bj));
+	}
+	for (int bi = box.row0; bi < box.row1; bi++)
+	{
+		if (box.col0 < last.col0 && g.Inside(bi, box.col0 - 1))
+			g.cache->Prefetch(g.Tile(bi, box.col0 - 1));
+		if (box.col1 > last.col1 && g.Inside(bi, box.col1))
+			g.cache->Prefetch(g.Tile(bi, box.col1));
+	}
+}
+
+// Runs a kernel on the active tile k of the sweep, with its active neighbours in memory
+template <typename Kernel>
+static void outOfCoreTile(OutOfCoreGrid& g, int k, int direction, bool balance, Kernel kernel)
+{
+	int count = int(g.tiles.size());
+	int ahead = k + direction * g.prefetchDistance;
+	if (ahead >= 0 && ahead < count)
+		g.cache->Prefetch(g.tiles[ahead]);
+
+	int tile = g.tiles[k];
+	int bi = tile / g.blockCols, bj = tile % g.blockCols;
+	const int di[VON_NEUMANN_NEIGHBORS] = { 0, -1, 0, 0, 1 };
+	const int dj[VON_NEUMANN_NEIGHBORS] = { 0, 0, -1, 1, 0 };
+	int neighbors[VON_NEUMANN_NEIGHBORS];
+	SparseBlock* b = g.cache->Acquire(tile);
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+	{
+		// a tile that is not active is dry, with no outflows: it reads as a missing block
+		bool present = g.Inside(bi + di[n], bj + dj[n]) && g.active[g.Tile(bi + di[n], bj + dj[n])];
+		neighbors[n] = present ? g.Tile(bi + di[n], bj + dj[n]) : -1;
+		b->neighbors[n] = present ? g.cache->Acquire(neighbors[n]) : NULL;
+	}
+
+	kernel(b);
+	if (balance)
+		g.flags[tile] = (unsigned short)tileWetFlags(b);
+
+	g.cache->Release(tile, true);
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		if (neighbors[n] >= 0)
+			g.cache->Release(neighbors[n], false);
+}
+
+// One step on the tiles with lava and around it
+void outOfCoreTransitionFunction(OutOfCoreGrid& g, double dumping_factor)
+{
+	selectOutOfCoreTiles(g);
+	int count = int(g.tiles.size());
+	for (int k = 0; k < count; k++)
+		outOfCoreTile(g, k, 1, false, [dumping_factor](SparseBlock* b) { sparseOutflows(b, dumping_factor); });
+	for (int k = count - 1; k >= 0; k--)
+		outOfCoreTile(g, k, -1, true, [](SparseBlock* b) { sparseBalance(b); });
+}
+
+// Calls band(row0, rows, h) for every row of tiles of g, from the first one, h holding the thickness of its rows
+static void forEachOutOfCoreBand(OutOfCoreGrid& g, const std::function<void(int row0, int rows, const double* h)>& band)
+{
+	std::vector<double> h(size_t(SPARSE_BLOCK) * g.cols);
+	for (int bi = 0; bi < g.blockRows; bi++)
+	{
+		int row0 = bi * SPARSE_BLOCK, rows = std::min(SPARSE_BLOCK, g.rows - row0);
+		for (int bj = 0; bj < g.blockCols; bj++)
+		{
+			const SparseBlock* b = g.cache->Acquire(g.Tile(bi, bj));
+			int cols = std::min(SPARSE_BLOCK, g.cols - b->col0);
+			for (int i = 0; i < rows; i++)
+				std::copy(b->h + i * SPARSE_BLOCK, b->h + i * SPARSE_BLOCK + cols, h.begin() + size_t(i) * g.cols + b->col0);
+			g.cache->Release(g.Tile(bi, bj), false);
+		}
+		band(row0, rows, h.data());
+	}
+}
+
+// The rows of a grid file, as an AltitudeSource; view or layer hold the values while it is used
+static AltitudeSource gridRows(const std::string& path, FileData& header, GridBinaryView& view, std::vector<double>& layer)
+{
+	if (isGridBinaryFile(path))
+	{
+		openGridBinary(path, view);
+		headerFromBinary(*view.header, header);
+		size_t cols = header.ncols;
+		if (view.header->dtype == GRID_FLOAT64)
+		{
+			const double* values = static_cast<const double*>(view.payload);
+			return [values, cols](int row, int col, int count, double* z) { std::copy(values + row * cols + col, values + row * cols + col + count, z); };
+		}
+		const float* values = static_cast<const float*>(view.payload);
+		return [values, cols](int row, int col, int count, double* z) { std::copy(values + row * cols + col, values + row * cols + col + count, z); };
+	}
+
+	loadLayer(path, header, layer);
+	std::vector<float>().swap(header.values);
+	const double* values = layer.data();
+	size_t cols = header.ncols;
+	return [values, cols](int row, int col, int count, double* z) { std::copy(values + row * cols + col, values + row * cols + col + count, z); };
+}
+
+// Writes a tile file from an altitudes and a lava grid file; returns the wet flags of its tiles, and the header of the altitudes
+static std::vector<unsigned short> convertToTileFile(const std::string& zPath, const std::string& lPath, const std::string& path, FileData& header)
+{
+	FileData lavaHeader;
+	GridBinaryView zView, lView;
+	std::vector<double> zLayer, lLayer;
+	AltitudeSource altitudes = gridRows(zPath, header, zView, zLayer);
+	AltitudeSource thickness = gridRows(lPath, lavaHeader, lView, lLayer);
+	if (header.nrows != lavaHeader.nrows || header.ncols != lavaHeader.ncols)
+		throw std::runtime_error("altitudes and lava grids have different sizes");
+	return createTileFile(path, header.nrows, header.ncols, header.NoDataValue, altitudes, thickness);
+}
+
+// Runs steps on the grids of zPath and lPath through the tile file path, with a cache of cacheMegabytes; writes the final thickness to exportPath as a binary grid when given
+void runOutOfCore(const std::string& zPath, const std::string& lPath, int steps, const std::string& path, size_t cacheMegabytes, const std::string& exportPath)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	FileData header;
+	std::vector<unsigned short> flags = convertToTileFile(zPath, lPath, path, header);
+	std::chrono::duration<double> converted = std::chrono::steady_clock::now() - start;
+	std::cout << "Tile file " << path << ": " << header.nrows << "x" << header.ncols << ", " << flags.size() << " tiles of " << SPARSE_BLOCK << "x" << SPARSE_BLOCK << ", "
+		<< flags.size() * TILE_RECORD_DOUBLES * sizeof(double) / 1048576.0 << " MB, written in " << converted.count() << " seconds" << std::endl;
+
+	OutOfCoreGrid g;
+	openOutOfCore(g, path, flags, cacheMegabytes * 1048576 / sizeof(SparseBlock));
+	start = std::chrono::steady_clock::now();
+	for (int s = 0; s < steps; s++)
+		outOfCoreTransitionFunction(g, dumping_factor);
+	g.cache->Flush();
+	std::chrono::duration<double> stepped = std::chrono::steady_clock::now() - start;
+	std::cout << "Executed " << steps << " steps in " << stepped.count() << " seconds with a cache of " << g.cache->Capacity() << " tiles, "
+		<< g.tiles.size() << " active tiles, " << g.cache->reads << " reads, " << g.cache->waits << " waited, " << g.cache->writes << " writes" << std::endl;
+
+	std::ofstream out;
+	if (!exportPath.empty())
+		createGridBinary(out, exportPath, header, GRID_FLOAT64);
+	double volume = 0;
+	forEachOutOfCoreBand(g, [&](int, int rows, const double* h)
+	{
+		for (size_t k = 0; k < size_t(rows) * g.cols; k++)
+			volume += h[k];
+		if (out.is_open())
+			out.write(reinterpret_cast<const char*>(h), std::streamsize(size_t(rows) * g.cols * sizeof(double)));
+	});
+	std::cout << "Lava volume " << volume << std::endl;
+	if (out.is_open())
+	{
+		out.close();
+		if (!out)
+			throw std::runtime_error("Cannot write file: " + exportPath);
+		std::cout << "Lava thickness at step " << steps << " written to " << exportPath << std::endl;
+	}
+}
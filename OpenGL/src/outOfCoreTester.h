@@ -0,0 +1,125 @@
+#pragma once
+
+#include "globals.h"
+#include "sparseGrid.h"
+#include "outOfCore.h"
+#include "stepTester.h"
+
+#include "util.hpp"
+
+// A slope of r x c cells with a lava band across its upper part, flowing down
+static void lavaSlope(int r, int c, AltitudeSource& altitudes, AltitudeSource& thickness)
+{
+	altitudes = [r](int row, int col, int count, double* z)
+	{
+		for (int j = 0; j < count; j++)
+		{
+			uint32_t hash = uint32_t(row) * 73856093u ^ uint32_t(col + j) * 19349663u;
+			z[j] = 0.2 * (r - row) + (hash % 1000) * 0.0001;
+		}
+	};
+	thickness = [c](int row, int col, int count, double* h)
+	{
+		for (int j = 0; j < count; j++)
+			h[j] = row >= 64 && row < 96 && col + j >= c / 8 && col + j < c - c / 8 ? 4.0 : 0.0;
+	};
+}
+
+// Steps on the tile file with a cache of capacity tiles, which must give the thickness of the reference run; returns the steps per second
+static double timeOutOfCore(const std::string& path, const std::vector<unsigned short>& flags, size_t capacity, int steps, const ReferenceRun& reference, bool& identical)
+{
+	OutOfCoreGrid g;
+	openOutOfCore(g, path, flags, capacity);
+	util::Timer timer;
+	for (int s = 0; s < steps; s++)
+		outOfCoreTransitionFunction(g, dumping_factor);
+	g.cache->Flush();
+	double rate = steps / (static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0);
+
+	std::cout << "\n\t\t\t" << g.cache->Capacity() << " tiles (" << g.cache->Capacity() * sizeof(SparseBlock) / 1048576.0 << " MB): " << rate << " steps/s, "
+		<< g.tiles.size() << " active tiles, " << g.cache->reads << " reads, " << g.cache->waits << " waited, " << g.cache->writes << " writes, peak "
+		<< g.cache->PeakTiles() << " tiles, ";
+
+	std::vector<double> result(size_t(g.rows) * g.cols);
+	forEachOutOfCoreBand(g, [&](int row0, int rows, const double* h) { std::copy(h, h + size_t(rows) * g.cols, result.begin() + size_t(row0) * g.cols); });
+	identical = compareWithReference(result, reference);
+	return rate;
+}
+
+// Reads the rows of a layer of c columns held in memory
+static AltitudeSource layerRows(const std::vector<double>& layer, int c)
+{
+	return [&layer, c](int row, int col, int count, double* v)
+	{
+		const double* src = layer.data() + size_t(row) * c + col;
+		std::copy(src, src + count, v);
+	};
+}
+
+/*	Steps on the sparse blocks in memory, then on the tile file of the grid with a cache of a tenth
+	of its tiles and with all of them; the tile file of the input grids is converted from their
+	files, as by the headless run. Returns the failed comparisons.
+	*/
+static int compareOutOfCore(const BenchGrid& grid, const ReferenceRun& reference, const char* zPath, const char* lPath, const std::string& path)
+{
+	std::function<std::vector<unsigned short>()> createTiles = [&]()
+	{
+		if (grid.index >= 0)
+			return createTileFile(path, grid.r, grid.c, grid.nodata, layerRows(grid.z, grid.c), layerRows(grid.h, grid.c));
+		FileData header;
+		return convertToTileFile(zPath, lPath, path, header);
+	};
+
+	SparseGrid sparse;
+	loadSparse(sparse, grid.z.data(), grid.h.data(), grid.r, grid.c, grid.nodata);
+	util::Timer timer;
+	for (int s = 0; s < grid.steps; s++)
+		sparseTransitionFunction(sparse, dumping_factor, NULL);
+	double inMemory = grid.steps / (static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0);
+	std::vector<double> sparseH(grid.h.size(), 0.0);
+	storeSparseThickness(sparse, sparseH.data());
+
+	std::vector<unsigned short> flags = createTiles();
+	size_t tiles = flags.size();
+	std::cout << tiles << " tiles, " << tiles * TILE_RECORD_DOUBLES * sizeof(double) / 1048576.0 << " MB on disk, in memory: " << inMemory << " steps/s, ";
+	int failures = !compareWithReference(sparseH, reference);
+
+	bool identical;
+	double tenth = timeOutOfCore(path, flags, tiles / 10, grid.steps, reference, identical);
+	failures += !identical;
+	createTiles();
+	double whole = timeOutOfCore(path, flags, tiles, grid.steps, reference, identical);
+	failures += !identical;
+	remove(path.c_str());
+	std::cout << "\n\t\t\tcache of a tenth of the dataset: " << tenth / whole << "x the steps/s of the whole dataset cached, " << tenth / inMemory << "x in memory";
+	return failures;
+}
+
+// Returns the failed comparisons
+int testOutOfCore(const char* zPath, const char* lPath)
+{
+	const int size = 2048, steps = 300;
+	const std::string path = "outofcore.lvt";
+	std::cout << "Out-of-core benchmark, " << SPARSE_BLOCK << "x" << SPARSE_BLOCK << " tiles" << std::endl;
+
+	BenchGrids grids = [](int index, BenchGrid& grid)
+	{
+		if (index == 1)
+			return false;
+		AltitudeSource altitudes, thickness;
+		lavaSlope(size, size, altitudes, thickness);
+		grid.label = "slope";
+		grid.r = grid.c = size;
+		grid.steps = steps;
+		grid.z.resize(size_t(size) * size);
+		grid.h.resize(size_t(size) * size);
+		for (int i = 0; i < size; i++)
+		{
+			altitudes(i, 0, size, grid.z.data() + size_t(i) * size);
+			thickness(i, 0, size, grid.h.data() + size_t(i) * size);
+		}
+		return true;
+	};
+	BenchStep step = [&](const BenchGrid& grid, const ReferenceRun& reference) { return compareOutOfCore(grid, reference, zPath, lPath, path); };
+	return reportFailures(benchStep(zPath, lPath, grids, steps, step, true));
+}
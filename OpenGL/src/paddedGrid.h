@@ -0,0 +1,186 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include <vector>
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Ghost-cell padded grid (--padded). Z, H and the outflow planes are copied into arrays with a one
+cell halo ring around the grid, and a mask marks the cells the transition function updates: the
+interior cells (interiorRegion) with data. The sweeps then run over every cell of the grid with
+no bounds and no no-data test: each neighbour exists, the halo holding z = nodata and h = 0, and
+a masked cell goes through the same arithmetic as the others, its results being discarded by
+selects (zero outflows, thickness unchanged), so the mass balance is branch free and can be
+vectorized by the compiler, and the outflow sweep only branches in the minimization itself.
+
+The mask keeps the altitudes as they are instead of giving the masked cells an infinite head:
+a no-data or border cell is a sink for its neighbours (they see its low z + h and the lava that
+flows into it is lost), and an infinite head would turn it into a wall and change the results.
+The minimization is the one of kernel1 (outflows in flow.h), so the thickness is identical to
+the one of the So based step. H is updated from the padded thickness over the balance region
+after every step.
+*/
+
+struct PaddedGrid
+{
+	int rows = 0;		// of the simulation grid
+	int cols = 0;
+	int stride = 0;		// cols + 2
+	size_t size = 0;	// (rows + 2) * stride
+	std::vector<double> z, h, so;		// so: the plane of neighbour n starts at (n - 1) * size
+	std::vector<unsigned char> active;
+
+	// Index of the grid cell (i, j)
+	size_t Index(int i, int j) const { return size_t(i + 1) * stride + j + 1; }
+	double* Outflows(int n) { return so.data() + (n - 1) * size; }
+};
+
+PaddedGrid paddedGrid;
+
+// Copies a region of the r x c grid into g, whose cell (0, 0) is then (region.row0, region.col0), with the outflows zero
+void loadPaddedRegion(PaddedGrid& g, const double* Sz, const double* Sh, int r, int c, double nodata, const Region& region)
+{
+	g.rows = region.row1 - region.row0;
+	g.cols = region.col1 - region.col0;
+	g.stride = g.cols + 2;
+	g.size = size_t(g.rows + 2) * g.stride;
+	g.z.assign(g.size, nodata);
+	g.h.assign(g.size, 0.0);
+	g.so.assign(g.size * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+	g.active.assign(g.size, 0);
+
+	Region interior = interiorRegion(r, c);
+	for (int i = region.row0; i < region.row1; i++)
+		for (int j = region.col0; j < region.col1; j++)
+		{
+			size_t k = g.Index(i - region.row0, j - region.col0);
+			g.z[k] = Sz[size_t(i) * c + j];
+			g.h[k] = Sh[size_t(i) * c + j];
+			g.active[k] = inside(interior, i, j) && g.z[k] != nodata;
+		}
+}
+
+// Copies the grid into g, with the outflows zero
+void loadPadded(PaddedGrid& g, const double* Sz, const double* Sh, int r, int c, double nodata)
+{
+	loadPaddedRegion(g, Sz, Sh, r, c, nodata, gridRegion(r, c));
+}
+
+// Copies the padded thickness of a region of the grid into Sh
+void storePaddedThickness(const PaddedGrid& g, double* Sh, const Region& region)
+{
+	Region cells = intersect(region, gridRegion(g.rows, g.cols));
+	for (int i = cells.row0; i < cells.row1; i++)
+		std::copy(g.h.begin() + g.Index(i, cells.col0), g.h.begin() + g.Index(i, cells.col1), Sh + size_t(i) * g.cols + cells.col0);
+}
+
+// Zeroes the outflows of the cells of a region, as clearOutflows (flow.h)
+void clearPaddedOutflows(PaddedGrid& g, const Region& region)
+{
+	Region cells = intersect(region, gridRegion(g.rows, g.cols));
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		for (int i = cells.row0; i < cells.row1; i++)
+			std::fill(g.Outflows(n) + g.Index(i, cells.col0), g.Outflows(n) + g.Index(i, cells.col1), 0.0);
+}
+
+// kernel1 over the cells j0 <= j < j1 of row i
+static void paddedOutflowRow(PaddedGrid& g, int i, int j0, int j1, double dumping_factor)
+{
+	size_t row = g.Index(i, 0);
+	const double* z = g.z.data() + row;
+	const double* h = g.h.data() + row;
+	const unsigned char* active = g.active.data() + row;
+	double* so[VON_NEUMANN_NEIGHBORS];
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		so[n] = g.Outflows(n) + row;
+	const ptrdiff_t offsets[VON_NEUMANN_NEIGHBORS] = { 0, -g.stride, -1, 1, g.stride };
+
+	for (int j = j0; j < j1; j++)
+	{
+		double H[VON_NEUMANN_NEIGHBORS];
+		H[0] = z[j];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			H[n] = z[j + offsets[n]] + h[j + offsets[n]];
+
+		double flows[VON_NEUMANN_NEIGHBORS];
+		outflows(h[j], H, dumping_factor, flows);
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			so[n][j] = active[j] ? flows[n] : 0.0;
+	}
+}
+
+// kernel2 over the cells j0 <= j < j1 of row i
+static void paddedBalanceRow(PaddedGrid& g, int i, int j0, int j1)
+{
+	size_t row = g.Index(i, 0);
+	double* h = g.h.data() + row;
+	const unsigned char* active = g.active.data() + row;
+	const double* so[VON_NEUMANN_NEIGHBORS];
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		so[n] = g.Outflows(n) + row;
+	const ptrdiff_t offsets[VON_NEUMANN_NEIGHBORS] = { 0, -g.stride, -1, 1, g.stride };
+
+	for (int j = j0; j < j1; j++)
+	{
+		double balance = h[j];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			balance += so[VON_NEUMANN_NEIGHBORS - n][j + offsets[n]];
+			balance -= so[n][j];
+		}
+		h[j] = active[j] ? balance : h[j];
+	}
+}
+
+// The fused sweep of the region overload of globalTransitionFunction (flow.h)
+void paddedTransitionFunction(PaddedGrid& g, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	Region sweep = gridRegion(g.rows, g.cols);
+	Region k1 = intersect(outflow, sweep);
+	Region k2 = intersect(balance, sweep);
+	int row0 = std::min(k1.row0, k2.row0);
+	int row1 = std::max(k1.row1, k2.row1);
+
+	for (int i = row0; i <= row1; i++)
+	{
+		if (i >= k1.row0 && i < k1.row1)
+			paddedOutflowRow(g, i, k1.col0, k1.col1, dumping_factor);
+		if (i - 1 >= k2.row0 && i - 1 < k2.row1)
+			paddedBalanceRow(g, i - 1, k2.col0, k2.col1);
+	}
+}
+
+// The two passes of runThreaded (threadedExecutor.h)
+void paddedTransitionFunctionThreaded(ThreadPool& pool, PaddedGrid& g, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	Region sweep = gridRegion(g.rows, g.cols);
+	Region k1 = intersect(outflow, sweep);
+	Region k2 = intersect(balance, sweep);
+	if (isEmpty(k1))
+		return;
+
+	pool.ParallelFor(k1.row0, k1.row1, [&](int row0, int row1)
+	{
+		for (int i = row0; i < row1; i++)
+			paddedOutflowRow(g, i, k1.col0, k1.col1, dumping_factor);
+	});
+	pool.ParallelFor(k2.row0, k2.row1, [&](int row0, int row1)
+	{
+		for (int i = row0; i < row1; i++)
+			paddedBalanceRow(g, i, k2.col0, k2.col1);
+	});
+}
+
+// One step on paddedGrid (on the simulation pool when threaded), then H updated over balance
+void runPadded(double* Sh, double dumping_factor, const Region& outflow, const Region& balance)
+{
+	if (threaded)
+		paddedTransitionFunctionThreaded(*simulationPool, paddedGrid, dumping_factor, outflow, balance);
+	else
+		paddedTransitionFunction(paddedGrid, dumping_factor, outflow, balance);
+	storePaddedThickness(paddedGrid, Sh, balance);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include "flowPrecision.h"
+#include "threadedExecutor.h"
+#include "solverTester.h"
+#include "stepTester.h"
+#include <numeric>
+
+#include "util.hpp"
+
+// Runs steps on a copy of the grid in the precision of a policy, on the simulation pool when threaded; returns the seconds per step, the final thickness and the volumes before and after
+template <class Precision>
+double timePrecision(const std::vector<double>& z, const std::vector<double>& h, int r, int c, double nodata, int steps, std::vector<double>& result, double& volume0, double& volume1)
+{
+	PrecisionGrid<Precision> g;
+	g.Load(z.data(), h.data(), r, c, nodata);
+	Region grid = gridRegion(r, c);
+	volume0 = g.Volume();
+
+	util::Timer timer;
+	for (int s = 0; s < steps; s++)
+		if (threaded)
+			layoutTransitionFunctionThreaded(*simulationPool, g, dumping_factor, r, c, nodata, grid, grid);
+		else
+			layoutTransitionFunction(g, dumping_factor, r, c, nodata, grid, grid);
+	double seconds = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	volume1 = g.Volume();
+	result.resize(h.size());
+	g.StoreThickness(result.data(), grid);
+	return seconds / steps;
+}
+
+// Reports the errors of a policy against the double reference run; returns its relative volume drift
+template <class Precision>
+static double reportPrecision(const BenchGrid& grid, const ReferenceRun& reference, double referenceVolume)
+{
+	std::vector<double> result;
+	double volume0, volume1;
+	double seconds = timePrecision<Precision>(grid.z, grid.h, grid.r, grid.c, grid.nodata, grid.steps, result, volume0, volume1);
+	double maxError = 0;
+	for (size_t k = 0; k < result.size(); k++)
+		maxError = std::max(maxError, std::fabs(result[k] - reference.h[k]));
+
+	double referenceSeconds = reference.seconds / grid.steps;
+	std::cout << "\n\t\t\t" << Precision::Name() << ": " << seconds << " s/step (" << referenceSeconds / seconds << "x serial double), volume drift "
+		<< (volume1 - volume0) / volume0 << ", volume error " << (volume1 - referenceVolume) / referenceVolume
+		<< ", max thickness error " << maxError;
+	return (volume1 - volume0) / volume0;
+}
+
+/*	Compares the policies with the double reference run. The lava of the bowl, the first grid, stays
+	away from the no-data and border cells, so that the volume must not change: the drift of the
+	compensated policy must then stay within its bound. Returns the failed comparisons.
+	*/
+static int comparePrecisions(const BenchGrid& grid, const ReferenceRun& reference)
+{
+	double volume0 = std::accumulate(grid.h.begin(), grid.h.end(), 0.0);
+	double volume1 = std::accumulate(reference.h.begin(), reference.h.end(), 0.0);
+	std::cout << "double reference " << reference.seconds / grid.steps << " s/step, volume drift " << (volume1 - volume0) / volume0;
+
+	reportPrecision<FloatPrecision>(grid, reference, volume1);
+	double compensatedDrift = reportPrecision<MixedPrecision>(grid, reference, volume1);
+	if (grid.index != 0)
+		return 0;
+	double u = std::ldexp(1.0, -24);
+	double bound = 20.0 * grid.steps * u * u;
+	bool within = std::fabs(compensatedDrift) <= bound;
+	std::cout << "\n\t\t\tcompensated drift bound 20 N u^2: " << bound << (within ? ", within" : ", EXCEEDED");
+	return within ? 0 : 1;
+}
+
+// A bowl with lava in the middle, which stays inside: the volume only changes by rounding
+static void lavaBowl(int n, unsigned int seed, std::vector<double>& z, std::vector<double>& h)
+{
+	randomLavaField(n, n, seed, 0.0, 0.0, z, h);
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 3.0);
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+		{
+			double di = i - n / 2, dj = j - n / 2;
+			z[i * n + j] += 0.05 * (di * di + dj * dj) / n;
+			h[i * n + j] = di * di + dj * dj < n * n / 16 ? uniform(generator) : 0.0;
+		}
+}
+
+// Returns the failed comparisons
+int testPrecisions(const char* zPath, const char* lPath)
+{
+	std::cout << "Precision benchmark" << std::endl;
+	BenchGrids grids = [](int index, BenchGrid& grid)
+	{
+		if (index == 2)
+			return false;
+		if (index == 0)
+		{
+			grid.label = "bowl, no lava lost";
+			grid.r = grid.c = 256;
+			grid.steps = 2000;
+			lavaBowl(256, 1, grid.z, grid.h);
+		}
+		else
+		{
+			grid.label = "random, 30% wet";
+			grid.r = grid.c = 1024;
+			grid.steps = 20;
+			randomLavaField(1024, 1024, 2, 0.3, 0.0, grid.z, grid.h);
+		}
+		return true;
+	};
+	return reportFailures(benchStep(zPath, lPath, grids, 1000, comparePrecisions));
+}
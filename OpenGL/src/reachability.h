@@ -0,0 +1,298 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "gridParser.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <vector>
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Reachability pre-pass (--reach[=TOLERANCE]). Before the simulation starts, the cells the lava can
+reach are bounded with a priority flood over Z: every updated cell with lava is a source with the
+level z + h + TOLERANCE, and a level spreads to the updated neighbours lower than it, the highest
+levels first, so a cell gets the highest level of the sources it can be reached from without
+climbing above it. The lava flows towards lower heads only, so it stays within the cells with a
+level; the tolerance covers what the damping lets it climb, as the inflows of several neighbours
+can lift a head above the ones they came from.
+
+The grid is then cropped to the box of the reachable cells plus the ring of their neighbours, as
+a --window would, before the substates are allocated: every backend allocates and sweeps only that
+box, the cells outside it being dry for the whole run. The compact domain (--compact) also leaves
+out the unreachable cells inside the box.
+
+The unreachable cells of the box, the ring included, are raised to REACH_WALL: a wall is above any
+head, so no lava flows into it and none is lost on the border of the cropped grid (the border of
+the whole grid is left as it is, a sink as without --reach). While no lava would flow into the
+cells they replace the walls change nothing, as the minimization eliminates both. The altitudes
+of the walls next to a reachable cell are kept, and every step checks them (checkReachWalls):
+when a cell would send lava into one at its altitude, the flow would have left the reachable
+cells and the walls hold it back, so the run reports that the tolerance is too low.
+
+The flood runs on horizontal bands in parallel: each band floods from its sources, then from the
+levels that its neighbour bands have put on the rows around it, in rounds until no band changes.
+The levels only grow and a round ends on a barrier, so the result is the one of the serial flood.
+*/
+
+std::vector<unsigned char> reachable;		// per cell, after --reach; empty otherwise
+
+const double REACH_WALL = 1e30;		// altitude of the unreachable cells, above any head
+
+// An unreachable cell next to a reachable one, with its altitude
+struct ReachWall
+{
+	size_t cell;
+	double altitude;
+};
+
+std::vector<ReachWall> reachWalls;
+bool reachSpilled = false;		// once lava has risen above a wall
+
+struct ReachStats
+{
+	size_t dataCells = 0;		// updated cells
+	size_t reachableCells = 0;
+	Region box = { 0, 0, 0, 0 };	// of the reachable cells
+	int rounds = 0;
+	double seconds = 0;
+};
+
+// Floods the rows [row0, row1) from the seeds, with the levels in level
+static void floodReachBand(const double* Sz, int r, int c, double nodata, std::vector<double>& level, int row0, int row1, std::vector<size_t>& seeds)
+{
+	Region interior = intersect(interiorRegion(r, c), { row0, row1, 0, c });
+	std::priority_queue<std::pair<double, size_t> > front;
+	for (size_t k : seeds)
+		front.push(std::make_pair(level[k], k));
+
+	const int di[VON_NEUMANN_NEIGHBORS - 1] = { -1, 0, 0, 1 };
+	const int dj[VON_NEUMANN_NEIGHBORS - 1] = { 0, -1, 1, 0 };
+	while (!front.empty())
+	{
+		double l = front.top().first;
+		size_t k = front.top().second;
+		front.pop();
+		if (l < level[k])
+			continue;
+		int i = int(k / c), j = int(k % c);
+		for (int n = 0; n < VON_NEUMANN_NEIGHBORS - 1; n++)
+		{
+			int ni = i + di[n], nj = j + dj[n];
+			size_t q = size_t(ni) * c + nj;
+			if (inside(interior, ni, nj) && Sz[q] != nodata && Sz[q] < l && level[q] < l)
+			{
+				level[q] = l;
+				front.push(std::make_pair(l, q));
+			}
+		}
+	}
+}
+
+// The reachable cells of an r x c grid, flooded in bands on pool
+ReachStats computeReachable(const double* Sz, const double* Sh, int r, int c, double nodata, double tolerance, ThreadPool& pool, std::vector<unsigned char>& mask)
+{
+	ReachStats stats;
+	util::Timer timer;
+	const double unreached = -std::numeric_limits<double>::infinity();
+	std::vector<double> level(size_t(r) * c, unreached);
+	Region interior = interiorRegion(r, c);
+
+	int bands = std::max(1, std::min(r / 16, 4 * int(pool.GetSize() + 1)));
+	std::vector<int> bounds(bands + 1);
+	for (int b = 0; b <= bands; b++)
+		bounds[b] = int((long long)r * b / bands);
+
+	// the rows just above and below every band, as they were when the round started
+	std::vector<double> above(size_t(bands) * c, unreached), below(size_t(bands) * c, unreached);
+	std::vector<unsigned char> changed(bands, 0);
+	bool again = true;
+	for (stats.rounds = 0; again; stats.rounds++)
+	{
+		for (int b = 0; b < bands; b++)
+		{
+			if (bounds[b] > 0)
+				std::copy(level.begin() + size_t(bounds[b] - 1) * c, level.begin() + size_t(bounds[b]) * c, above.begin() + size_t(b) * c);
+			if (bounds[b + 1] < r)
+				std::copy(level.begin() + size_t(bounds[b + 1]) * c, level.begin() + size_t(bounds[b + 1] + 1) * c, below.begin() + size_t(b) * c);
+		}
+
+		int round = stats.rounds;
+		pool.ParallelFor(0, bands, [&](int b0, int b1)
+		{
+			for (int b = b0; b < b1; b++)
+			{
+				int row0 = bounds[b], row1 = bounds[b + 1];
+				std::vector<size_t> seeds;
+				auto seed = [&](int i, int j, double l)
+				{
+					size_t k = size_t(i) * c + j;
+					if (inside(interior, i, j) && Sz[k] != nodata && Sz[k] < l && level[k] < l)
+					{
+						level[k] = l;
+						seeds.push_back(k);
+					}
+				};
+				if (round == 0)
+				{
+					for (int i = std::max(row0, interior.row0); i < std::min(row1, interior.row1); i++)
+						for (int j = interior.col0; j < interior.col1; j++)
+						{
+							size_t k = size_t(i) * c + j;
+							if (Sz[k] != nodata && Sh[k] > 0 && level[k] < Sz[k] + Sh[k] + tolerance)
+							{
+								level[k] = Sz[k] + Sh[k] + tolerance;
+								seeds.push_back(k);
+							}
+						}
+				}
+				else
+					for (int j = 0; j < c; j++)
+					{
+						seed(row0, j, above[size_t(b) * c + j]);
+						seed(row1 - 1, j, below[size_t(b) * c + j]);
+					}
+				changed[b] = !seeds.empty();
+				floodReachBand(Sz, r, c, nodata, level, row0, row1, seeds);
+			}
+		});
+		again = std::find(changed.begin(), changed.end(), 1) != changed.end();
+	}
+
+	mask.assign(level.size(), 0);
+	stats.box = { r, 0, c, 0 };
+	for (int i = interior.row0; i < interior.row1; i++)
+		for (int j = interior.col0; j < interior.col1; j++)
+		{
+			size_t k = size_t(i) * c + j;
+			if (Sz[k] == nodata)
+				continue;
+			stats.dataCells++;
+			if (level[k] == unreached)
+				continue;
+			mask[k] = 1;
+			stats.reachableCells++;
+			stats.box = { std::min(stats.box.row0, i), std::max(stats.box.row1, i + 1), std::min(stats.box.col0, j), std::max(stats.box.col1, j + 1) };
+		}
+	if (stats.reachableCells == 0)
+		stats.box = { 0, 0, 0, 0 };
+	stats.seconds = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	return stats;
+}
+
+// Keeps the cells of a region of a layer of c columns
+template <typename T>
+static void cropLayer(std::vector<T>& layer, int c, const Region& region)
+{
+	std::vector<T> cropped;
+	cropped.reserve(size_t(region.row1 - region.row0) * (region.col1 - region.col0));
+	for (int i = region.row0; i < region.row1; i++)
+		cropped.insert(cropped.end(), layer.begin() + size_t(i) * c + region.col0, layer.begin() + size_t(i) * c + region.col1);
+	layer.swap(cropped);
+}
+
+// Raises the unreachable cells with data of a region of an r x c grid to REACH_WALL, keeping the altitudes of the ones next to a reachable cell
+void raiseReachWalls(double* Sz, const unsigned char* mask, int r, int c, double nodata, const Region& region, std::vector<ReachWall>& walls)
+{
+	const int di[VON_NEUMANN_NEIGHBORS] = { 0, -1, 0, 0, 1 };
+	const int dj[VON_NEUMANN_NEIGHBORS] = { 0, 0, -1, 1, 0 };
+	Region grid = gridRegion(r, c);
+	Region cells = intersect(region, grid);
+	walls.clear();
+	for (int i = cells.row0; i < cells.row1; i++)
+		for (int j = cells.col0; j < cells.col1; j++)
+		{
+			size_t k = size_t(i) * c + j;
+			if (Sz[k] == nodata || mask[k])
+				continue;
+			for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+				if (inside(grid, i + di[n], j + dj[n]) && mask[size_t(i + di[n]) * c + j + dj[n]])
+				{
+					walls.push_back({ k, Sz[k] });
+					break;
+				}
+			Sz[k] = REACH_WALL;
+		}
+}
+
+// Whether a reachable cell of an r x c grid would send lava into a wall next to it, were the wall at its altitude
+bool reachWallsSpilled(const double* Sz, const double* Sh, const unsigned char* mask, int r, int c, const std::vector<ReachWall>& walls)
+{
+	const int di[VON_NEUMANN_NEIGHBORS] = { 0, -1, 0, 0, 1 };
+	const int dj[VON_NEUMANN_NEIGHBORS] = { 0, 0, -1, 1, 0 };
+	Region grid = gridRegion(r, c);
+	for (const ReachWall& w : walls)
+	{
+		int i = int(w.cell / c), j = int(w.cell % c);
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			int qi = i + di[n], qj = j + dj[n];
+			size_t q = size_t(qi) * c + qj;
+			if (!inside(grid, qi, qj) || !mask[q] || Sh[q] == 0.0)
+				continue;
+
+			// a reachable cell is updated, so its neighbours are in the grid; the wall is its neighbour VON_NEUMANN_NEIGHBORS - n
+			double heads[VON_NEUMANN_NEIGHBORS];
+			heads[0] = Sz[q];
+			for (int m = 1; m < VON_NEUMANN_NEIGHBORS; m++)
+			{
+				size_t p = size_t(qi + di[m]) * c + qj + dj[m];
+				heads[m] = p == w.cell ? w.altitude : Sz[p] + Sh[p];
+			}
+			double flows[VON_NEUMANN_NEIGHBORS];
+			outflows(Sh[q], heads, dumping_factor, flows);
+			if (flows[VON_NEUMANN_NEIGHBORS - n] > 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Reports, once, lava held back by a wall after a step of a run with --reach
+void checkReachWalls()
+{
+	if (!reach || reachSpilled || reachable.empty() || !reachWallsSpilled(Z.data(), H.data(), reachable.data(), nrows, ncols, reachWalls))
+		return;
+	reachSpilled = true;
+	std::cout << "Warning: at step " << currentStep << " the lava reached a cell the reachability pre-pass left out, where a wall holds it back:"
+		<< " the tolerance " << reachTolerance << " is too low for this flow" << std::endl;
+}
+
+// The reachability pre-pass on the loaded grids, which are cropped to the reachable cells and their neighbours
+void pruneUnreachable(double tolerance)
+{
+	int r = ZData.nrows, c = ZData.ncols;
+	ThreadPool pool(numThreads);
+	ReachStats stats = computeReachable(Z.data(), H.data(), r, c, ZData.NoDataValue, tolerance, pool, reachable);
+
+	Region box = intersect(dilate(stats.box, 1), gridRegion(r, c));
+	std::cout << "Reachability pre-pass: " << stats.reachableCells << " of " << stats.dataCells << " cells reachable ("
+		<< (stats.dataCells ? 100.0 * (stats.dataCells - stats.reachableCells) / stats.dataCells : 0.0) << "% pruned), "
+		<< stats.rounds << " rounds, " << stats.seconds << " seconds" << std::endl;
+	if (isEmpty(box))
+	{
+		std::cout << "No lava to flow, the grid is not cropped" << std::endl << std::endl;
+		return;
+	}
+
+	// a window counts its rows from the top of the grid
+	GridWindow window = { r - box.row1, box.col0, box.row1 - box.row0, box.col1 - box.col0 };
+	applyWindow(ZData, window);
+	applyWindow(LData, window);
+	cropLayer(ZData.values, c, box);
+	cropLayer(LData.values, c, box);
+	cropLayer(Z, c, box);
+	cropLayer(H, c, box);
+	cropLayer(reachable, c, box);
+
+	// the border of the whole grid stays as it is, lava flowing into it being lost as without --reach
+	Region interior = interiorRegion(r, c);
+	Region walled = { interior.row0 - box.row0, interior.row1 - box.row0, interior.col0 - box.col0, interior.col1 - box.col0 };
+	raiseReachWalls(Z.data(), reachable.data(), ZData.nrows, ZData.ncols, ZData.NoDataValue, walled, reachWalls);
+	std::cout << "Grid cropped to " << ZData.nrows << "x" << ZData.ncols << " (" << 100.0 * ZData.nrows * ZData.ncols / (double(r) * c)
+		<< "% of the cells)" << std::endl << std::endl;
+}
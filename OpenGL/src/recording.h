@@ -0,0 +1,549 @@
+#pragma once
+
+#include "globals.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+Time series of the lava thickness H, one frame every N steps, appended to a single file.
+
+A frame only stores the cells whose value changed since the previous frame: the bounding box
+of those cells, a bitmap of the changed cells inside the box and, for each changed cell, the
+XOR of its bits with the previous value, encoded as in Gorilla (Facebook's time series
+database): a control bit tells whether the meaningful bits of the XOR fit in the window of
+leading/trailing zeros of the previous one, otherwise the new window is stored (6 bits of
+leading zeros, 6 bits of length) followed by the meaningful bits. Neighbouring cells of a lava
+front evolve similarly, so most XORs reuse the window.
+
+Every keyframeInterval frames a keyframe is encoded against an all-zero grid, so a reader can
+start decoding from it without the frames before. An index at the end of the file lists the
+offset of every frame and of the keyframe it depends on, which makes seeking O(1) plus at most
+keyframeInterval frames to apply.
+
+	header | frame | frame | ... | index entries | trailer
+
+The simulation thread only copies H into a free buffer of a bounded queue; encoding and
+writing happen on the recorder thread. When the queue is full the frame is dropped rather than
+stalling the simulation (the recording just skips that step).
+*/
+
+const char RECORDING_MAGIC[8] = { 'L', 'A', 'V', 'A', 'R', 'E', 'C', '\0' };
+const char RECORDING_INDEX_MAGIC[8] = { 'L', 'A', 'V', 'A', 'I', 'D', 'X', '\0' };
+const uint32_t RECORDING_VERSION = 1;
+const uint32_t RECORDING_KEYFRAME = 1;
+
+struct RecordingHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nrows;
+	uint32_t ncols;
+	uint32_t interval;			// steps between frames
+	uint32_t keyframeInterval;	// frames between keyframes
+	uint32_t reserved;
+	double NoDataValue;
+	double cellsize;
+	char padding[16];
+};
+
+// Followed by the bitmap of the box, (rows * cols + 7) / 8 bytes, and by the XOR stream
+struct RecordingFrame
+{
+	uint32_t step;
+	uint32_t flags;				// RECORDING_KEYFRAME
+	uint32_t row;				// box of the changed cells
+	uint32_t col;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t changed;			// number of changed cells
+	uint32_t reserved;
+	uint64_t streamBytes;		// padded so that the next frame starts 8 bytes aligned
+};
+
+struct RecordingIndexEntry
+{
+	uint64_t offset;
+	uint32_t step;
+	uint32_t keyframe;			// index of the keyframe to start decoding from
+};
+
+struct RecordingTrailer
+{
+	uint64_t indexOffset;
+	uint64_t frameCount;
+	char magic[8];
+};
+
+static inline int leadingZeros64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - (int)index;
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+static inline int trailingZeros64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline uint64_t lowBits(int bits)
+{
+	return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+static inline uint64_t doubleBits(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+static inline double bitsDouble(uint64_t bits)
+{
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Most significant bit first
+class BitWriter
+{
+	private:
+		std::vector<unsigned char>& m_Out;
+		uint64_t m_Acc;
+		int m_Used;
+
+		void Flush(int bytes)
+		{
+			for (int b = 0; b < bytes; b++)
+				m_Out.push_back((unsigned char)(m_Acc >> (56 - 8 * b)));
+		}
+
+	public:
+		BitWriter(std::vector<unsigned char>& out): m_Out(out), m_Acc(0), m_Used(0) {}
+
+		// bits = 1..64
+		void Write(uint64_t value, int bits)
+		{
+			while (bits > 0)
+			{
+				int space = 64 - m_Used;
+				int take = std::min(space, bits);
+				m_Acc |= ((value >> (bits - take)) & lowBits(take)) << (space - take);
+				m_Used += take;
+				bits -= take;
+				if (m_Used == 64)
+				{
+					Flush(8);
+					m_Acc = 0;
+					m_Used = 0;
+				}
+			}
+		}
+
+		void Finish()
+		{
+			Flush((m_Used + 7) / 8);
+			m_Acc = 0;
+			m_Used = 0;
+		}
+};
+
+class BitReader
+{
+	private:
+		const unsigned char* m_Data;
+		uint64_t m_Acc;
+		int m_Left;
+
+	public:
+		BitReader(const unsigned char* data): m_Data(data), m_Acc(0), m_Left(0) {}
+
+		uint64_t Read(int bits)
+		{
+			uint64_t value = 0;
+			while (bits > 0)
+			{
+				if (m_Left == 0)
+				{
+					m_Acc = *m_Data++;
+					m_Left = 8;
+				}
+				int take = std::min(bits, m_Left);
+				value = (value << take) | ((m_Acc >> (m_Left - take)) & lowBits(take));
+				m_Left -= take;
+				bits -= take;
+			}
+			return value;
+		}
+};
+
+// XOR stream of the changed values, see the description above
+class XorEncoder
+{
+	private:
+		BitWriter m_Bits;
+		int m_Lead;
+		int m_Trail;
+
+	public:
+		XorEncoder(std::vector<unsigned char>& out): m_Bits(out), m_Lead(-1), m_Trail(0) {}
+
+		// x != 0, since only changed cells are encoded
+		void Write(uint64_t x)
+		{
+			int lead = leadingZeros64(x);
+			int trail = trailingZeros64(x);
+			if (m_Lead >= 0 && lead >= m_Lead && trail >= m_Trail)
+			{
+				m_Bits.Write(0, 1);
+				m_Bits.Write(x >> m_Trail, 64 - m_Lead - m_Trail);
+				return;
+			}
+			int length = 64 - lead - trail;
+			m_Bits.Write(1, 1);
+			m_Bits.Write(lead, 6);
+			m_Bits.Write(length - 1, 6);
+			m_Bits.Write(x >> trail, length);
+			m_Lead = lead;
+			m_Trail = trail;
+		}
+
+		void Finish() { m_Bits.Finish(); }
+};
+
+class XorDecoder
+{
+	private:
+		BitReader m_Bits;
+		int m_Lead;
+		int m_Trail;
+
+	public:
+		XorDecoder(const unsigned char* data): m_Bits(data), m_Lead(0), m_Trail(0) {}
+
+		uint64_t Read()
+		{
+			if (m_Bits.Read(1) == 1)
+			{
+				m_Lead = (int)m_Bits.Read(6);
+				m_Trail = 64 - m_Lead - ((int)m_Bits.Read(6) + 1);
+			}
+			return m_Bits.Read(64 - m_Lead - m_Trail) << m_Trail;
+		}
+};
+
+// Applies an encoded frame to h, which holds the previous frame (ignored for keyframes)
+static void decodeRecordingFrame(const char* data, double* h, int nrows, int ncols)
+{
+	RecordingFrame frame;
+	memcpy(&frame, data, sizeof(frame));
+	if (frame.flags & RECORDING_KEYFRAME)
+		std::fill(h, h + size_t(nrows) * ncols, 0.0);
+	if (frame.changed == 0)
+		return;
+
+	const unsigned char* bitmap = reinterpret_cast<const unsigned char*>(data) + sizeof(frame);
+	XorDecoder values(bitmap + (size_t(frame.rows) * frame.cols + 7) / 8);
+	size_t bit = 0;
+	for (uint32_t i = 0; i < frame.rows; i++)
+	{
+		double* row = h + size_t(frame.row + i) * ncols + frame.col;
+		for (uint32_t j = 0; j < frame.cols; j++, bit++)
+			if (bitmap[bit >> 3] & (1 << (bit & 7)))
+				row[j] = bitsDouble(doubleBits(row[j]) ^ values.Read());
+	}
+}
+
+// Random access to the frames of a recording through a memory mapping
+class RecordingReader
+{
+	private:
+		MappedFile m_File;
+		RecordingHeader m_Header;
+		const RecordingIndexEntry* m_Index;
+		size_t m_FrameCount;
+		size_t m_Current;		// frame held by the caller's buffer, m_FrameCount if none
+
+	public:
+		RecordingReader(): m_Index(nullptr), m_FrameCount(0), m_Current(0) {}
+
+		void Open(const std::string& path)
+		{
+			if (!m_File.Open(path))
+				throw std::runtime_error("Cannot open recording: " + path);
+			const char* data = m_File.GetData();
+			size_t size = m_File.GetSize();
+			if (size < sizeof(RecordingHeader) + sizeof(RecordingTrailer) || memcmp(data, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) != 0)
+				throw std::runtime_error("Not a recording: " + path);
+			memcpy(&m_Header, data, sizeof(m_Header));
+			if (m_Header.version != RECORDING_VERSION)
+				throw std::runtime_error("Unsupported recording version: " + path);
+
+			RecordingTrailer trailer;
+			memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+			if (memcmp(trailer.magic, RECORDING_INDEX_MAGIC, sizeof(trailer.magic)) != 0 || trailer.frameCount == 0
+				|| trailer.indexOffset + trailer.frameCount * sizeof(RecordingIndexEntry) + sizeof(trailer) != size)
+				throw std::runtime_error("Recording has no frame index (was the run interrupted?): " + path);
+
+			m_Index = reinterpret_cast<const RecordingIndexEntry*>(data + trailer.indexOffset);
+			m_FrameCount = (size_t)trailer.frameCount;
+			m_Current = m_FrameCount;
+		}
+
+		// Decodes a frame into h (nrows * ncols values). Moving forward within the same keyframe
+		// interval only applies the frames in between, anything else restarts from the keyframe.
+		void Decode(size_t frame, double* h)
+		{
+			size_t first = m_Index[frame].keyframe;
+			if (m_Current < m_FrameCount && m_Current < frame && m_Current >= first)
+				first = m_Current + 1;
+			for (size_t k = first; k <= frame; k++)
+				decodeRecordingFrame(m_File.GetData() + m_Index[k].offset, h, m_Header.nrows, m_Header.ncols);
+			m_Current = frame;
+		}
+
+		inline size_t GetFrameCount() const { return m_FrameCount; }
+		inline int GetStep(size_t frame) const { return (int)m_Index[frame].step; }
+		inline int GetRows() const { return (int)m_Header.nrows; }
+		inline int GetCols() const { return (int)m_Header.ncols; }
+};
+
+class RecordingWriter
+{
+	private:
+		struct Frame
+		{
+			int step;
+			std::vector<double> h;
+		};
+
+		FILE* m_File;
+		std::string m_Path;
+		RecordingHeader m_Header;
+		uint64_t m_Offset;
+		std::vector<RecordingIndexEntry> m_Index;
+		uint32_t m_Keyframe;
+		std::vector<double> m_Previous;
+		std::vector<unsigned char> m_Bitmap;
+		std::vector<unsigned char> m_Stream;
+
+		std::deque<Frame> m_Queue;
+		std::vector<std::vector<double>> m_Free;
+		size_t m_Capacity;
+		uint64_t m_Dropped;
+		bool m_Stopping;
+		std::mutex m_Mutex;
+		std::condition_variable m_Wake;
+		std::thread m_Thread;
+
+		void WriteBytes(const void* data, size_t size)
+		{
+			fwrite(data, 1, size, m_File);
+			m_Offset += size;
+		}
+
+		void Encode(const Frame& frame)
+		{
+			size_t cols = m_Header.ncols;
+			size_t rows = m_Header.nrows;
+			bool keyframe = m_Index.empty() || m_Index.size() - m_Keyframe >= m_Header.keyframeInterval;
+			if (keyframe)
+			{
+				m_Keyframe = (uint32_t)m_Index.size();
+				std::fill(m_Previous.begin(), m_Previous.end(), 0.0);
+			}
+
+			// box of the changed cells
+			size_t row0 = rows, row1 = 0, col0 = cols, col1 = 0;
+			for (size_t i = 0; i < rows; i++)
+			{
+				const double* current = frame.h.data() + i * cols;
+				const double* previous = m_Previous.data() + i * cols;
+				if (memcmp(current, previous, cols * sizeof(double)) == 0)
+					continue;
+				size_t first = 0, last = cols - 1;
+				while (doubleBits(current[first]) == doubleBits(previous[first]))
+					first++;
+				while (doubleBits(current[last]) == doubleBits(previous[last]))
+					last--;
+				row0 = std::min(row0, i);
+				row1 = i + 1;
+				col0 = std::min(col0, first);
+				col1 = std::max(col1, last + 1);
+			}
+
+			RecordingFrame header;
+			memset(&header, 0, sizeof(header));
+			header.step = frame.step;
+			header.flags = keyframe ? RECORDING_KEYFRAME : 0;
+			m_Bitmap.clear();
+			m_Stream.clear();
+			if (row1 > row0)
+			{
+				header.row = (uint32_t)row0;
+				header.col = (uint32_t)col0;
+				header.rows = (uint32_t)(row1 - row0);
+				header.cols = (uint32_t)(col1 - col0);
+				m_Bitmap.assign((size_t(header.rows) * header.cols + 7) / 8, 0);
+
+				XorEncoder values(m_Stream);
+				size_t bit = 0;
+				for (size_t i = row0; i < row1; i++)
+				{
+					const double* current = frame.h.data() + i * cols;
+					double* previous = m_Previous.data() + i * cols;
+					for (size_t j = col0; j < col1; j++, bit++)
+					{
+						uint64_t x = doubleBits(current[j]) ^ doubleBits(previous[j]);
+						if (x == 0)
+							continue;
+						m_Bitmap[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+						values.Write(x);
+						previous[j] = current[j];
+						header.changed++;
+					}
+				}
+				values.Finish();
+			}
+			size_t used = m_Bitmap.size() + m_Stream.size();
+			m_Stream.resize(m_Stream.size() + (8 - used % 8) % 8, 0);
+			header.streamBytes = m_Stream.size();
+
+			m_Index.push_back({ m_Offset, header.step, m_Keyframe });
+			WriteBytes(&header, sizeof(header));
+			WriteBytes(m_Bitmap.data(), m_Bitmap.size());
+			WriteBytes(m_Stream.data(), m_Stream.size());
+		}
+
+		void Loop()
+		{
+			while (true)
+			{
+				Frame frame;
+				{
+					std::unique_lock<std::mutex> lock(m_Mutex);
+					m_Wake.wait(lock, [this]() { return m_Stopping || !m_Queue.empty(); });
+					if (m_Queue.empty())
+						return;
+					frame = std::move(m_Queue.front());
+					m_Queue.pop_front();
+				}
+				Encode(frame);
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Free.push_back(std::move(frame.h));
+			}
+		}
+
+	public:
+		RecordingWriter(const std::string& path, int nrows, int ncols, int interval, int keyframeInterval, size_t capacity = 8)
+			: m_Path(path), m_Offset(0), m_Keyframe(0), m_Capacity(capacity), m_Dropped(0), m_Stopping(false)
+		{
+			m_File = fopen(path.c_str(), "wb");
+			if (m_File == NULL)
+				throw std::runtime_error("Cannot create recording: " + path);
+
+			memset(&m_Header, 0, sizeof(m_Header));
+			memcpy(m_Header.magic, RECORDING_MAGIC, sizeof(m_Header.magic));
+			m_Header.version = RECORDING_VERSION;
+			m_Header.nrows = nrows;
+			m_Header.ncols = ncols;
+			m_Header.interval = std::max(1, interval);
+			m_Header.keyframeInterval = std::max(1, keyframeInterval);
+			m_Header.NoDataValue = NoDataValue;
+			m_Header.cellsize = cellsize;
+			WriteBytes(&m_Header, sizeof(m_Header));
+
+			m_Previous.assign(size_t(nrows) * ncols, 0.0);
+			m_Thread = std::thread(&RecordingWriter::Loop, this);
+		}
+
+		// Encodes the queued frames, then writes the index that completes the file
+		~RecordingWriter()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Stopping = true;
+			}
+			m_Wake.notify_one();
+			m_Thread.join();
+
+			RecordingTrailer trailer;
+			trailer.indexOffset = m_Offset;
+			trailer.frameCount = m_Index.size();
+			memcpy(trailer.magic, RECORDING_INDEX_MAGIC, sizeof(trailer.magic));
+			WriteBytes(m_Index.data(), m_Index.size() * sizeof(RecordingIndexEntry));
+			WriteBytes(&trailer, sizeof(trailer));
+			bool failed = ferror(m_File) != 0;
+			if (fclose(m_File) != 0 || failed)
+				std::cout << "Cannot write recording " << m_Path << std::endl;
+			else
+				std::cout << "Recorded " << m_Index.size() << " frames (" << m_Dropped << " dropped) in " << m_Path
+					<< ", " << m_Offset / (1024.0 * 1024.0) << " MB" << std::endl;
+		}
+
+		RecordingWriter(const RecordingWriter&) = delete;
+		RecordingWriter& operator=(const RecordingWriter&) = delete;
+
+		// Queues a copy of h (nrows * ncols values); returns false if the queue is full and the frame is dropped
+		bool Push(int step, const double* h)
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			if (m_Queue.size() >= m_Capacity)
+			{
+				m_Dropped++;
+				return false;
+			}
+			Frame frame;
+			frame.step = step;
+			if (!m_Free.empty())
+			{
+				frame.h = std::move(m_Free.back());
+				m_Free.pop_back();
+			}
+			lock.unlock();
+
+			frame.h.assign(h, h + size_t(m_Header.nrows) * m_Header.ncols);
+
+			lock.lock();
+			m_Queue.push_back(std::move(frame));
+			lock.unlock();
+			m_Wake.notify_one();
+			return true;
+		}
+
+		inline int GetInterval() const { return (int)m_Header.interval; }
+};
+
+std::unique_ptr<RecordingWriter> recordingWriter;
+
+static void recordIfDue()
+{
+	if (recordingWriter && currentStep % recordingWriter->GetInterval() == 0)
+		recordingWriter->Push(currentStep, H.data());
+}
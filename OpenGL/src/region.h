@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+
+// Rows [row0, row1) and columns [col0, col1) of the grid
+struct Region
+{
+	int row0;
+	int row1;
+	int col0;
+	int col1;
+};
+
+static inline bool isEmpty(const Region& r)
+{
+	return r.row0 >= r.row1 || r.col0 >= r.col1;
+}
+
+static inline Region intersect(const Region& a, const Region& b)
+{
+	return { std::max(a.row0, b.row0), std::min(a.row1, b.row1), std::max(a.col0, b.col0), std::min(a.col1, b.col1) };
+}
+
+// Grows a non-empty region by k cells on every side; an empty region stays empty
+static inline Region dilate(const Region& r, int k)
+{
+	if (isEmpty(r))
+		return r;
+	return { r.row0 - k, r.row1 + k, r.col0 - k, r.col1 + k };
+}
+
+// Whether b lies inside a; an empty b lies inside any region
+static inline bool contains(const Region& a, const Region& b)
+{
+	return isEmpty(b) || (a.row0 <= b.row0 && b.row1 <= a.row1 && a.col0 <= b.col0 && b.col1 <= a.col1);
+}
+
+/* The cells updated by the transition function: all but the border of the grid, whose cells
+   only serve as neighbours (the lava flowing into them is lost). Every backend uses it. */
+static inline Region interiorRegion(int r, int c)
+{
+	return { 1, r - 1, 1, c - 1 };
+}
+
+// Smallest region containing both; an empty region is ignored
+static inline Region enclose(const Region& a, const Region& b)
+{
+	if (isEmpty(a))
+		return b;
+	if (isEmpty(b))
+		return a;
+	return { std::min(a.row0, b.row0), std::max(a.row1, b.row1), std::min(a.col0, b.col0), std::max(a.col1, b.col1) };
+}
+
+static inline bool inside(const Region& r, int i, int j)
+{
+	return i >= r.row0 && i < r.row1 && j >= r.col0 && j < r.col1;
+}
+
+static inline Region gridRegion(int r, int c)
+{
+	return { 0, r, 0, c };
+}
+
+// Bounding box of the cells with h != 0 inside the given region of a grid with c columns
+static Region lavaRegion(const double* h, int c, const Region& within)
+{
+	Region box = { within.row1, within.row0, within.col1, within.col0 };
+	for (int i = within.row0; i < within.row1; i++)
+	{
+		const double* row = h + size_t(i) * c;
+		int first = within.col0;
+		while (first < within.col1 && row[first] == 0.0)
+			first++;
+		if (first == within.col1)
+			continue;
+		int last = within.col1 - 1;
+		while (row[last] == 0.0)
+			last--;
+		box.row0 = std::min(box.row0, i);
+		box.row1 = i + 1;
+		box.col0 = std::min(box.col0, first);
+		box.col1 = std::max(box.col1, last + 1);
+	}
+	return isEmpty(box) ? Region{ 0, 0, 0, 0 } : box;
+}
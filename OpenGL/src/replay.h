@@ -0,0 +1,51 @@
+#pragma once
+
+#include "globals.h"
+#include "recording.h"
+#include "VertexCreation.h"
+
+/*
+Replay of a recorded run: frames are decoded from the memory-mapped recording straight into H
+and shown through updateLava, so nothing is simulated and memory use does not depend on the
+length of the recording.
+*/
+
+RecordingReader replayReader;
+bool replaying = false;
+size_t replayFrame = 0;
+
+static void resetLava(std::vector<float>& vertices, unsigned int n, unsigned int vSize, unsigned int offset)
+{
+	for (unsigned int i = 0; i < n; i++)
+		vertices[i * vSize + offset] = 0.0f;
+}
+
+// Opens the recording and decodes its first frame; the altitudes grid must be loaded already
+static void openReplay(const std::string& path)
+{
+	replayReader.Open(path);
+	if (replayReader.GetRows() != nrows || replayReader.GetCols() != ncols)
+		throw std::runtime_error("Recording grid size does not match the input grids");
+	replayFrame = 0;
+	replayReader.Decode(0, H.data());
+	currentStep = replayReader.GetStep(0);
+	std::cout << "Replaying " << path << ": " << replayReader.GetFrameCount() << " frames, steps "
+		<< currentStep << " to " << replayReader.GetStep(replayReader.GetFrameCount() - 1) << std::endl;
+}
+
+// Shows a frame of the recording, clamped to the recorded ones
+static void replaySeek(long long frame)
+{
+	long long last = (long long)replayReader.GetFrameCount() - 1;
+	frame = std::max(0ll, std::min(frame, last));
+	if ((size_t)frame == replayFrame)
+		return;
+
+	// updateLava only writes the cells covered by lava, so going back clears the old front first
+	if ((size_t)frame < replayFrame)
+		resetLava(positions, nrows * ncols, 13, 3);
+	replayReader.Decode((size_t)frame, H.data());
+	updateLava(positions, H, nrows * ncols, 13, 3);
+	replayFrame = (size_t)frame;
+	currentStep = replayReader.GetStep(replayFrame);
+}
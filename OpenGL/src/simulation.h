@@ -0,0 +1,255 @@
+#pragma once
+
+#include "globals.h"
+#include "checkpoint.h"
+#include "recording.h"
+#include "gridWriter.h"
+#include <chrono>
+#include "flow.h"
+#include "openClExecutor.h"
+#include "threadedExecutor.h"
+#include "gatherExecutor.h"
+#include "paddedGrid.h"
+#include "blockedExecutor.h"
+#include "flowPrecision.h"
+#include "compactDomain.h"
+#include "sparseGrid.h"
+#include "reachability.h"
+#include "convergence.h"
+#include "region.h"
+
+/*
+Active region tracking: only the cells near the lava are updated, so the cost of a step follows
+the extent of the flow rather than the size of the DEM.
+
+activeRegion is the bounding box of the cells with h != 0. A cell with h = 0 computes no outflow
+(outflows in flow.h returns zeros when m = 0), so outflows are computed on the box plus a one
+cell halo, which only writes zeros, and the mass balance one cell further, on the cells that can
+receive them. After the step the box is recomputed by scanning that larger region only. The
+cells left out would compute zero outflows and keep their thickness, so the result is identical
+to the full sweep, bit for bit.
+
+The steps do not reset the outflows (kernel1 writes all of them), so So must be zero outside the
+outflow region of a step: when the region does not cover the one of the previous step, the
+outflows of that one are cleared first. That only happens when the lava box shrinks.
+*/
+Region activeRegion = { 0, 0, 0, 0 };
+Region lastOutflowRegion = { 0, 0, 0, 0 };
+bool activeTracking = true;
+
+/*
+The step of the selected backend is chosen once, by initActiveRegion, rather than at every step:
+stepFunction advances the simulation and returns the steps it did. The steps of flow.h and the ones
+that replace it on the whole grid (OpenCL, padded, compact, float) share the active region
+tracking above, through a sweep over the outflow and balance regions and a clear of the outflows
+of a region.
+*/
+typedef int (*StepFunction)(StepChange* change);
+typedef void (*SweepFunction)(const Region& outflow, const Region& balance, StepChange* change);
+typedef void (*ClearFunction)(const Region& region);
+StepFunction stepFunction = NULL;
+SweepFunction sweepFunction = NULL;
+ClearFunction clearFunction = NULL;
+
+static void sweepParallel(const Region& outflow, const Region& balance, StepChange* change)
+{
+	run(nrows, ncols, VON_NEUMANN_NEIGHBORS, NoDataValue, outflow, balance, change);
+}
+
+static void sweepPadded(const Region& outflow, const Region& balance, StepChange* change)
+{
+	runPadded(H.data(), dumping_factor, outflow, balance);
+}
+
+static void sweepCompact(const Region& outflow, const Region& balance, StepChange* change)
+{
+	runCompact(H.data(), dumping_factor, outflow, balance);
+}
+
+static void sweepPrecision(const Region& outflow, const Region& balance, StepChange* change)
+{
+	runPrecision(H.data(), dumping_factor, outflow, balance);
+}
+
+static void sweepThreaded(const Region& outflow, const Region& balance, StepChange* change)
+{
+	runThreaded(Z.data(), H.data(), So, dumping_factor, nrows, ncols, NoDataValue, outflow, balance, change);
+}
+
+static void sweepSerial(const Region& outflow, const Region& balance, StepChange* change)
+{
+	globalTransitionFunction(Z.data(), H.data(), So, dumping_factor, nrows, ncols, neighborhood, NoDataValue, outflow, balance, change);
+}
+
+static void clearParallel(const Region& region)
+{
+	clearOutflowsParallel(nrows, ncols, VON_NEUMANN_NEIGHBORS, NoDataValue, region);
+}
+
+static void clearPadded(const Region& region)
+{
+	clearPaddedOutflows(paddedGrid, region);
+}
+
+static void clearCompact(const Region& region)
+{
+	clearCompactOutflows(compactDomain, region);
+}
+
+static void clearPlanes(const Region& region)
+{
+	clearOutflows(So, nrows, ncols, region);
+}
+
+// Steps of the next temporal block: at most blockSteps, ending on the next checkpoint or recorded frame
+static int nextBlockDepth()
+{
+	int depth = std::min(blockSteps, steps);
+	if (checkpointWriter && checkpointInterval > 0)
+		depth = std::min(depth, checkpointInterval - currentStep % checkpointInterval);
+	if (recordingWriter)
+		depth = std::min(depth, recordingWriter->GetInterval() - currentStep % recordingWriter->GetInterval());
+	return std::max(depth, 1);
+}
+
+static int blockedStep(StepChange* change)
+{
+	int advanced = nextBlockDepth();
+	Region region = activeTracking ? dilate(activeRegion, 2 * advanced) : gridRegion(nrows, ncols);
+	runBlocked(Z.data(), H, HBlocked, dumping_factor, nrows, ncols, NoDataValue, region, advanced, blockTile);
+	if (activeTracking)
+		activeRegion = lavaRegion(H.data(), ncols, intersect(region, gridRegion(nrows, ncols)));
+	return advanced;
+}
+
+static int sparseStep(StepChange* change)
+{
+	runSparse(H.data(), dumping_factor);
+	return 1;
+}
+
+static int gatherStep(StepChange* change)
+{
+	Region balance = activeTracking ? dilate(activeRegion, 2) : gridRegion(nrows, ncols);
+	if (parallel)
+		runGatherParallel(nrows, ncols, VON_NEUMANN_NEIGHBORS, NoDataValue, balance);
+	else
+		runGather(Z.data(), H, HNext, dumping_factor, nrows, ncols, NoDataValue, balance);
+	if (activeTracking)
+		activeRegion = lavaRegion(H.data(), ncols, intersect(balance, gridRegion(nrows, ncols)));
+	return 1;
+}
+
+static int trackedStep(StepChange* change)
+{
+	Region outflow = dilate(activeRegion, 1);
+	Region balance = dilate(activeRegion, 2);
+	if (!contains(outflow, lastOutflowRegion))
+		clearFunction(lastOutflowRegion);
+	lastOutflowRegion = outflow;
+
+	sweepFunction(outflow, balance, change);
+	activeRegion = lavaRegion(H.data(), ncols, intersect(balance, gridRegion(nrows, ncols)));
+	return 1;
+}
+
+static int fullStep(StepChange* change)
+{
+	sweepFunction(gridRegion(nrows, ncols), gridRegion(nrows, ncols), change);
+	return 1;
+}
+
+// Sets up the substates of the selected backend and chooses its step
+void initActiveRegion()
+{
+	activeRegion = lavaRegion(H.data(), ncols, gridRegion(nrows, ncols));
+
+	// the outflows of a step do not carry over to the next one, even from a checkpoint
+	stepFunction = activeTracking ? trackedStep : fullStep;
+	if (gather)
+	{
+		initGather();
+		stepFunction = gatherStep;
+	}
+	else if (blockSteps > 0)
+	{
+		initBlocked();
+		stepFunction = blockedStep;
+	}
+	else if (sparse)
+	{
+		loadSparse(sparseGrid, Z.data(), H.data(), nrows, ncols, NoDataValue);
+		stepFunction = sparseStep;
+	}
+	else if (compact)
+	{
+		buildCompactDomain(compactDomain, Z.data(), H.data(), nrows, ncols, NoDataValue, reachable.empty() ? NULL : reachable.data());
+		sweepFunction = sweepCompact;
+		clearFunction = clearCompact;
+	}
+	else if (padded)
+	{
+		loadPadded(paddedGrid, Z.data(), H.data(), nrows, ncols, NoDataValue);
+		sweepFunction = sweepPadded;
+		clearFunction = clearPadded;
+	}
+	else if (precision != PRECISION_DOUBLE && !parallel)
+	{
+		initPrecision();
+		sweepFunction = sweepPrecision;
+		clearFunction = clearPrecisionOutflows;
+	}
+	else
+	{
+		clearOutflows(So, nrows, ncols, gridRegion(nrows, ncols));
+		if (parallel)
+		{
+			sweepFunction = sweepParallel;
+			clearFunction = clearParallel;
+		}
+		else
+		{
+			sweepFunction = threaded ? sweepThreaded : sweepSerial;
+			clearFunction = clearPlanes;
+		}
+	}
+	lastOutflowRegion = { 0, 0, 0, 0 };
+}
+
+// Advances the simulation by one step with the selected backend (or by one temporal block of steps)
+void simulationStep()
+{
+	StepChange* change = beginStepChange();
+	int advanced = stepFunction(change);
+
+	currentStep += advanced;
+	steps -= advanced;
+	checkReachWalls();
+	stopIfConverged();
+	checkpointIfDue();
+	recordIfDue();
+}
+
+// Writes H as an Ascii Grid with the header of the altitudes grid
+void exportLava(const std::string& path)
+{
+	FileData header;
+	header.nrows = ZData.nrows;
+	header.ncols = ZData.ncols;
+	header.xllcorner = ZData.xllcorner;
+	header.yllcorner = ZData.yllcorner;
+	header.cellsize = ZData.cellsize;
+	header.NoDataValue = ZData.NoDataValue;
+
+	try
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		writeFileAscii(path, header, H.data());
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "Lava thickness at step " << currentStep << " exported to " << path << " in " << elapsed.count() << " seconds" << std::endl;
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Export failed: " << e.what() << std::endl;
+	}
+}
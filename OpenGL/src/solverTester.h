@@ -0,0 +1,124 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include <limits>
+#include <random>
+
+#include "util.hpp"
+#include "flow.h"
+#include "flowSorted.h"
+#include "stepTester.h"
+
+// Outflows of the two solvers differing by more than this many ulps of the highest head of the grid fail the comparison
+const double SORTED_TOLERANCE = 8;
+
+// Runs kernel 1 with the elimination loop and with the sorted solver on the inner cells of a grid, comparing times and outflows; returns false when they differ beyond SORTED_TOLERANCE
+bool compareOutflowSolvers(const char* label, double* z, double* h, int r, int c, double nodata)
+{
+	size_t size = size_t(r) * c;
+	std::vector<double> loopSo(size * VON_NEUMANN_NEIGHBORS, 0.0), sortedSo(size * VON_NEUMANN_NEIGHBORS, 0.0);
+	double* loopPlanes[VON_NEUMANN_NEIGHBORS];
+	double* sortedPlanes[VON_NEUMANN_NEIGHBORS];
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+	{
+		loopPlanes[n] = loopSo.data() + n * size;
+		sortedPlanes[n] = sortedSo.data() + n * size;
+	}
+	Neighborhood V;
+
+	util::Timer timer;
+	for (int i = 1; i < r - 1; i++)
+		for (int j = 1; j < c - 1; j++)
+			if (z[i * c + j] != nodata)
+				kernel1_outflow_computation(c, i, j, z, h, loopPlanes, dumping_factor, V);
+	double timeLoop = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	timer.reset();
+	for (int i = 1; i < r - 1; i++)
+		for (int j = 1; j < c - 1; j++)
+			if (z[i * c + j] != nodata)
+				kernel1_outflow_sorted(c, i, j, z, h, sortedPlanes, dumping_factor);
+	double timeSorted = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+
+	double maxHead = 0;
+	for (size_t k = 0; k < size; k++)
+		if (z[k] != nodata)
+			maxHead = std::max(maxHead, std::fabs(z[k] + h[k]));
+	double tolerance = SORTED_TOLERANCE * std::numeric_limits<double>::epsilon() * maxHead;
+
+	size_t differing = 0;
+	double maxDifference = 0;
+	for (size_t k = 0; k < loopSo.size(); k++)
+		if (loopSo[k] != sortedSo[k])
+		{
+			differing++;
+			maxDifference = std::max(maxDifference, std::fabs(loopSo[k] - sortedSo[k]));
+		}
+
+	double cells = double(r - 2) * (c - 2);
+	std::cout << "\t" << label << " (" << r << "x" << c << ")" << std::endl;
+	std::cout << "\t\tloop: " << timeLoop << " seconds (" << timeLoop / cells * 1e9 << " ns/cell), sorted: " << timeSorted
+		<< " seconds (" << timeSorted / cells * 1e9 << " ns/cell), " << timeLoop / timeSorted << "x" << std::endl;
+	bool equal = maxDifference <= tolerance;
+	if (differing == 0)
+		std::cout << "\t\tOutflows identical" << std::endl;
+	else
+		std::cout << "\t\tOutflows " << (equal ? "equal up to rounding" : "DIFFER") << ": " << differing << " of " << loopSo.size() << " values differ, max difference "
+			<< maxDifference << " (tolerance " << tolerance << ")" << std::endl;
+	return equal;
+}
+
+// Synthetic neighborhoods: a rough slope, with a share of the cells on whole values so that heads tie, and dry cells
+static void randomLavaField(int r, int c, unsigned int seed, double wet, double ties, std::vector<double>& z, std::vector<double>& h)
+{
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	z.resize(size_t(r) * c);
+	h.resize(size_t(r) * c);
+	for (int i = 0; i < r; i++)
+		for (int j = 0; j < c; j++)
+		{
+			bool tie = uniform(generator) < ties;
+			double altitude = 1000.0 + 0.01 * (i + j) + 5.0 * uniform(generator);
+			double thickness = uniform(generator) < wet ? 3.0 * uniform(generator) : 0.0;
+			z[i * c + j] = tie ? std::floor(altitude) : altitude;
+			h[i * c + j] = tie ? std::floor(thickness) : thickness;
+		}
+}
+
+// Returns the number of comparisons failing the tolerance
+int testOutflowSolvers(const char* zPath, const char* lPath)
+{
+	std::cout << "Outflow solver benchmark" << std::endl;
+	std::vector<double> z, h;
+	int failures = 0;
+
+	randomLavaField(1024, 1024, 1, 1.0, 0.0, z, h);
+	failures += !compareOutflowSolvers("random, all wet", z.data(), h.data(), 1024, 1024, -9999.0);
+	randomLavaField(1024, 1024, 2, 0.3, 0.0, z, h);
+	failures += !compareOutflowSolvers("random, 30% wet", z.data(), h.data(), 1024, 1024, -9999.0);
+	randomLavaField(1024, 1024, 3, 0.5, 0.5, z, h);
+	failures += !compareOutflowSolvers("random, 50% ties", z.data(), h.data(), 1024, 1024, -9999.0);
+
+	// after some steps the heads get close to the averages, where the two can round differently
+	randomLavaField(512, 512, 4, 0.3, 0.2, z, h);
+	std::vector<double> planes(size_t(512) * 512 * VON_NEUMANN_NEIGHBORS, 0.0);
+	double* S[VON_NEUMANN_NEIGHBORS];
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+		S[n] = planes.data() + n * size_t(512) * 512;
+	Neighborhood V;
+	OutflowRowKernel kernel = outflowRowKernel;
+	outflowRowKernel = NULL;
+	for (int s = 0; s < 100; s++)
+		globalTransitionFunction(z.data(), h.data(), S, dumping_factor, 512, 512, V, -9999.0, gridRegion(512, 512), gridRegion(512, 512));
+	outflowRowKernel = kernel;
+	failures += !compareOutflowSolvers("random, after 100 steps", z.data(), h.data(), 512, 512, -9999.0);
+
+	FileData zData, lData;
+	loadLayer(zPath, zData, z);
+	loadLayer(lPath, lData, h);
+	if (zData.nrows == lData.nrows && zData.ncols == lData.ncols)
+		failures += !compareOutflowSolvers("input grids", z.data(), h.data(), zData.nrows, zData.ncols, zData.NoDataValue);
+	return reportFailures(failures);
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "globals.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Sparse block grid (--sparse). The substates are stored in blocks of SPARSE_BLOCK x SPARSE_BLOCK
+cells that are only allocated when the lava comes near them, so the memory follows the area the
+flow reaches instead of the DEM rectangle: a resident block holds its Z, H, the four outflows
+the altitudes around it and the update mask (about 200 KB), a block that is not resident costs a null pointer.
+
+A block that is not resident is dry, and its cells keep h = 0 and zero outflows as long as no
+lava is within two cells of it (the outflow and balance reach of a step, as for the active
+region). Before every step the resident blocks with lava in a two cell band along a side (or in
+a 2 x 2 corner) allocate the block on that side (or corner), so the cells a step can change are
+always resident. The kernels are the ones of flow.h per cell, with the neighbours across a block
+edge looked up in the adjacent block; a neighbour in a missing block is dry, so its head is its
+altitude, kept in the halo of the block, and it has no outflows. The results are the ones of the
+dense grid. The no-data and border cells are not updated, as in flow.h.
+
+The altitudes of a block and of its halo are read when it is allocated, through an
+AltitudeSource: the dense Z of the application, or any function of the position (a mapped binary
+grid, a procedural DEM), so with a source that is not dense the whole simulation runs within the
+resident blocks. The application still holds the dense Z and H: Z is its altitude source and H
+is what the viewer draws.
+*/
+
+const int SPARSE_BLOCK = 64;
+const int SPARSE_BLOCK_CELLS = SPARSE_BLOCK * SPARSE_BLOCK;
+
+// Fills z[0, count) with the altitudes of the cells (row, col) to (row, col + count - 1)
+typedef std::function<void(int row, int col, int count, double* z)> AltitudeSource;
+
+struct SparseBlock
+{
+	double z[SPARSE_BLOCK_CELLS];
+	double h[SPARSE_BLOCK_CELLS];
+	double so[VON_NEUMANN_NEIGHBORS - 1][SPARSE_BLOCK_CELLS];		// outflow n at so[n - 1]
+	double halo[VON_NEUMANN_NEIGHBORS][SPARSE_BLOCK];		// altitudes of the row above, the columns left and right and the row below at 1..4 (0 unused)
+	unsigned char active[SPARSE_BLOCK_CELLS];
+	SparseBlock* neighbors[VON_NEUMANN_NEIGHBORS];		// the blocks above, left, right and below at 1..4, NULL when not resident
+	int row0, col0;		// of the cell 0 in the grid
+};
+
+struct SparseGrid
+{
+	int rows = 0;
+	int cols = 0;
+	int blockRows = 0;
+	int blockCols = 0;
+	double nodata = 0;
+	AltitudeSource altitudes;
+	std::vector<std::unique_ptr<SparseBlock> > blocks;		// blockRows x blockCols, NULL when not resident
+	std::vector<SparseBlock*> resident;
+
+	SparseBlock* Block(int bi, int bj) const
+	{
+		return bi >= 0 && bi < blockRows && bj >= 0 && bj < blockCols && blocks[size_t(bi) * blockCols + bj] ? &*blocks[size_t(bi) * blockCols + bj] : NULL;
+	}
+
+	size_t Bytes() const
+	{
+		return blocks.size() * sizeof(blocks[0]) + resident.size() * (sizeof(SparseBlock) + sizeof(SparseBlock*));
+	}
+};
+
+SparseGrid sparseGrid;
+
+// Empties g for an r x c grid
+void initSparse(SparseGrid& g, int r, int c, double nodata, const AltitudeSource& altitudes)
+{
+	g.rows = r;
+	g.cols = c;
+	g.blockRows = (r + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+	g.blockCols = (c + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+	g.nodata = nodata;
+	g.altitudes = altitudes;
+	g.blocks.clear();
+	g.blocks.resize(size_t(g.blockRows) * g.blockCols);
+	g.resident.clear();
+}
+
+// Reads the halo of b, in an r x c grid, from its altitudes; no-data outside the grid
+void readSparseHalo(SparseBlock* b, int r, int c, double nodata, const AltitudeSource& altitudes)
+{
+	int rows = std::min(SPARSE_BLOCK, r - b->row0);
+	int cols = std::min(SPARSE_BLOCK, c - b->col0);
+	for (int n = 0; n < VON_NEUMANN_NEIGHBORS; n++)
+		std::fill(b->halo[n], b->halo[n] + SPARSE_BLOCK, nodata);
+	if (b->row0 > 0)
+		altitudes(b->row0 - 1, b->col0, cols, b->halo[1]);
+	if (b->row0 + SPARSE_BLOCK < r)
+		altitudes(b->row0 + SPARSE_BLOCK, b->col0, cols, b->halo[4]);
+	for (int i = 0; i < rows; i++)
+	{
+		if (b->col0 > 0)
+			altitudes(b->row0 + i, b->col0 - 1, 1, b->halo[2] + i);
+		if (b->col0 + SPARSE_BLOCK < c)
+			altitudes(b->row0 + i, b->col0 + SPARSE_BLOCK, 1, b->halo[3] + i);
+	}
+}
+
+// The block (bi, bj), allocated dry when it is not resident
+SparseBlock* touchSparseBlock(SparseGrid& g, int bi, int bj)
+{
+	std::unique_ptr<SparseBlock>& slot = g.blocks[size_t(bi) * g.blockCols + bj];
+	if (slot)
+		return &*slot;
+
+	slot.reset(new SparseBlock());
+	SparseBlock* b = &*slot;
+	b->row0 = bi * SPARSE_BLOCK;
+	b->col0 = bj * SPARSE_BLOCK;
+	std::fill(b->z, b->z + SPARSE_BLOCK_CELLS, g.nodata);
+	int rows = std::min(SPARSE_BLOCK, g.rows - b->row0);
+	int cols = std::min(SPARSE_BLOCK, g.cols - b->col0);
+	for (int i = 0; i < rows; i++)
+		g.altitudes(b->row0 + i, b->col0, cols, b->z + i * SPARSE_BLOCK);
+	readSparseHalo(b, g.rows, g.cols, g.nodata, g.altitudes);
+
+	Region interior = interiorRegion(g.rows, g.cols);
+	for (int i = 0; i < SPARSE_BLOCK; i++)
+		for (int j = 0; j < SPARSE_BLOCK; j++)
+			b->active[i * SPARSE_BLOCK + j] = inside(interior, b->row0 + i, b->col0 + j) && b->z[i * SPARSE_BLOCK + j] != g.nodata;
+
+	const int di[VON_NEUMANN_NEIGHBORS] = { 0, -1, 0, 0, 1 };
+	const int dj[VON_NEUMANN_NEIGHBORS] = { 0, 0, -1, 1, 0 };
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+	{
+		b->neighbors[n] = g.Block(bi + di[n], bj + dj[n]);
+		if (b->neighbors[n])
+			b->neighbors[n]->neighbors[VON_NEUMANN_NEIGHBORS - n] = b;
+	}
+	g.resident.push_back(b);
+	return b;
+}
+
+// Loads the dense grid: Z as the altitude source, and the blocks with lava in Sh
+void loadSparse(SparseGrid& g, const double* Sz, const double* Sh, int r, int c, double nodata)
+{
+	initSparse(g, r, c, nodata, [Sz, c](int row, int col, int count, double* z)
+	{
+		std::copy(Sz + size_t(row) * c + col, Sz + size_t(row) * c + col + count, z);
+	});
+
+	for (int i = 0; i < r; i++)
+		for (int j = 0; j < c; j++)
+			if (Sh[size_t(i) * c + j] != 0.0)
+			{
+				SparseBlock* b = touchSparseBlock(g, i / SPARSE_BLOCK, j / SPARSE_BLOCK);
+				b->h[(i - b->row0) * SPARSE_BLOCK + j - b->col0] = Sh[size_t(i) * c + j];
+			}
+}
+
+// The thickness of the resident blocks into the dense Sh
+void storeSparseThickness(const SparseGrid& g, double* Sh)
+{
+	for (const SparseBlock* b : g.resident)
+	{
+		int rows = std::min(SPARSE_BLOCK, g.rows - b->row0);
+		int cols = std::min(SPARSE_BLOCK, g.cols - b->col0);
+		for (int i = 0; i < rows; i++)
+			std::copy(b->h + i * SPARSE_BLOCK, b->h + i * SPARSE_BLOCK + cols, Sh + size_t(b->row0 + i) * g.cols + b->col0);
+	}
+}
+
+// Whether a cell of the rows [i0, i1) and columns [j0, j1) of b has lava
+static bool sparseWet(const SparseBlock* b, int i0, int i1, int j0, int j1)
+{
+	for (int i = i0; i < i1; i++)
+		for (int j = j0; j < j1; j++)
+			if (b->h[i * SPARSE_BLOCK + j] != 0.0)
+				return true;
+	return false;
+}
+
+// Allocates the blocks within two cells of the lava of the resident blocks
+void expandSparse(SparseGrid& g)
+{
+	const int band = 2, last = SPARSE_BLOCK - band;
+	size_t count = g.resident.size();		// the blocks allocated here are dry
+	for (size_t k = 0; k < count; k++)
+	{
+		SparseBlock* b = g.resident[k];
+		int bi = b->row0 / SPARSE_BLOCK, bj = b->col0 / SPARSE_BLOCK;
+		if (bi > 0 && !b->neighbors[1] && sparseWet(b, 0, band, 0, SPARSE_BLOCK))
+			touchSparseBlock(g, bi - 1, bj);
+		if (bj > 0 && !b->neighbors[2] && sparseWet(b, 0, SPARSE_BLOCK, 0, band))
+			touchSparseBlock(g, bi, bj - 1);
+		if (bj < g.blockCols - 1 && !b->neighbors[3] && sparseWet(b, 0, SPARSE_BLOCK, last, SPARSE_BLOCK))
+			touchSparseBlock(g, bi, bj + 1);
+		if (bi < g.blockRows - 1 && !b->neighbors[4] && sparseWet(b, last, SPARSE_BLOCK, 0, SPARSE_BLOCK))
+			touchSparseBlock(g, bi + 1, bj);
+
+		for (int di = -1; di <= 1; di += 2)
+			for (int dj = -1; dj <= 1; dj += 2)
+			{
+				int ci = bi + di, cj = bj + dj;
+				if (ci < 0 || ci >= g.blockRows || cj < 0 || cj >= g.blockCols || g.Block(ci, cj))
+					continue;
+				int i0 = di < 0 ? 0 : last, j0 = dj < 0 ? 0 : last;
+				if (sparseWet(b, i0, i0 + band, j0, j0 + band))
+					touchSparseBlock(g, ci, cj);
+			}
+	}
+}
+
+// The block and the cell of the neighbour n of the cell k of b; NULL when that block is not resident
+static inline const SparseBlock* sparseNeighbor(const SparseBlock* b, int k, int n, int& cell)
+{
+	int i = k / SPARSE_BLOCK, j = k % SPARSE_BLOCK;
+	switch (n)
+	{
+	case 1:
+		cell = i > 0 ? k - SPARSE_BLOCK : k + SPARSE_BLOCK_CELLS - SPARSE_BLOCK;
+		return i > 0 ? b : b->neighbors[1];
+	case 2:
+		cell = j > 0 ? k - 1 : k + SPARSE_BLOCK - 1;
+		return j > 0 ? b : b->neighbors[2];
+	case 3:
+		cell = j < SPARSE_BLOCK - 1 ? k + 1 : k - SPARSE_BLOCK + 1;
+		return j < SPARSE_BLOCK - 1 ? b : b->neighbors[3];
+	default:
+		cell = i < SPARSE_BLOCK - 1 ? k + SPARSE_BLOCK : k - SPARSE_BLOCK_CELLS + SPARSE_BLOCK;
+		return i < SPARSE_BLOCK - 1 ? b : b->neighbors[4];
+	}
+}
+
+// kernel1_outflow_computation of flow.h for the cells of a block
+static void sparseOutflows(SparseBlock* b, double dumping_factor)
+{
+	for (int k = 0; k < SPARSE_BLOCK_CELLS; k++)
+	{
+		if (!b->active[k])
+			continue;
+		double H[VON_NEUMANN_NEIGHBORS];
+		H[0] = b->z[k];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			int cell;
+			const SparseBlock* nb = sparseNeighbor(b, k, n, cell);
+			if (nb)
+				H[n] = nb->z[cell] + nb->h[cell];
+			else
+				H[n] = b->halo[n][n == 1 || n == 4 ? k % SPARSE_BLOCK : k / SPARSE_BLOCK];
+		}
+
+		double flows[VON_NEUMANN_NEIGHBORS];
+		outflows(b->h[k], H, dumping_factor, flows);
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+			b->so[n - 1][k] = flows[n];
+	}
+}
+
+// kernel2_mass_balance of flow.h for the cells of a block
+static void sparseBalance(SparseBlock* b)
+{
+	for (int k = 0; k < SPARSE_BLOCK_CELLS; k++)
+	{
+		if (!b->active[k])
+			continue;
+		double h = b->h[k];
+		for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		{
+			int cell;
+			const SparseBlock* nb = sparseNeighbor(b, k, n, cell);
+			h += nb ? nb->so[VON_NEUMANN_NEIGHBORS - n - 1][cell] : 0.0;
+			h -= b->so[n - 1][k];
+		}
+		b->h[k] = h;
+	}
+}
+
+// One step on the resident blocks, after allocating the ones the lava can reach (on the pool when given)
+void sparseTransitionFunction(SparseGrid& g, double dumping_factor, ThreadPool* pool)
+{
+	expandSparse(g);
+	int count = int(g.resident.size());
+	if (pool)
+	{
+		pool->ParallelFor(0, count, [&](int k0, int k1) { for (int k = k0; k < k1; k++) sparseOutflows(g.resident[k], dumping_factor); });
+		pool->ParallelFor(0, count, [&](int k0, int k1) { for (int k = k0; k < k1; k++) sparseBalance(g.resident[k]); });
+	}
+	else
+	{
+		for (int k = 0; k < count; k++)
+			sparseOutflows(g.resident[k], dumping_factor);
+		for (int k = 0; k < count; k++)
+			sparseBalance(g.resident[k]);
+	}
+}
+
+// One step on sparseGrid (on the simulation pool when threaded), then H updated over the resident blocks
+void runSparse(double* Sh, double dumping_factor)
+{
+	sparseTransitionFunction(sparseGrid, dumping_factor, threaded ? &*simulationPool : NULL);
+	storeSparseThickness(sparseGrid, Sh);
+}
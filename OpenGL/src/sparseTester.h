@@ -0,0 +1,85 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include "sparseGrid.h"
+#include "threadedExecutor.h"
+#include "solverTester.h"
+#include "stepTester.h"
+
+#include "util.hpp"
+
+// Steps on the sparse blocks, which must give the thickness of the reference run on the dense grid; returns the failed comparisons
+static int compareSparse(const BenchGrid& grid, const ReferenceRun& reference)
+{
+	SparseGrid g;
+	std::vector<double> result(grid.h.size(), 0.0);
+	loadSparse(g, grid.z.data(), grid.h.data(), grid.r, grid.c, grid.nodata);
+	util::Timer timer;
+	for (int s = 0; s < grid.steps; s++)
+		sparseTransitionFunction(g, dumping_factor, threaded ? &*simulationPool : NULL);
+	double timeSparse = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	storeSparseThickness(g, result.data());
+
+	std::cout << g.resident.size() << " of " << g.blocks.size() << " blocks resident, " << g.Bytes() / 1048576.0 << " MB instead of "
+		<< double(grid.r) * grid.c * (2 + VON_NEUMANN_NEIGHBORS) * sizeof(double) / 1048576.0 << " MB, "
+		<< timeSparse / grid.steps << " s/step (fused dense " << reference.seconds / grid.steps << "), ";
+	return !compareWithReference(result, reference);
+}
+
+// A volcano of size x size cells with a rough slope, never stored: the blocks read their altitudes as they are allocated
+static void sparseVolcano(int size, int steps)
+{
+	double center = size / 2;
+	AltitudeSource cone = [center](int row, int col, int count, double* z)
+	{
+		for (int j = 0; j < count; j++)
+		{
+			double di = row - center, dj = col + j - center;
+			uint32_t hash = uint32_t(row) * 73856093u ^ uint32_t(col + j) * 19349663u;
+			z[j] = 3000.0 - 0.05 * std::sqrt(di * di + dj * dj) + (hash % 1000) * 0.00002;
+		}
+	};
+
+	SparseGrid g;
+	initSparse(g, size, size, -9999.0, cone);
+	int vent = size / 2;
+	for (int i = vent - 8; i < vent + 8; i++)
+		for (int j = vent - 8; j < vent + 8; j++)
+		{
+			SparseBlock* b = touchSparseBlock(g, i / SPARSE_BLOCK, j / SPARSE_BLOCK);
+			b->h[(i - b->row0) * SPARSE_BLOCK + j - b->col0] = 20.0;
+		}
+
+	std::cout << "\tvolcano (" << size << "x" << size << ", " << double(size) * size * (2 + VON_NEUMANN_NEIGHBORS) * sizeof(double) / (1 << 30)
+		<< " GB of dense substates, " << steps << " steps)" << std::endl;
+	util::Timer timer;
+	for (int s = 0; s < steps; s++)
+		sparseTransitionFunction(g, dumping_factor, threaded ? &*simulationPool : NULL);
+	double seconds = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	std::cout << "\t\t" << g.resident.size() << " of " << g.blocks.size() << " blocks resident, " << g.Bytes() / 1048576.0 << " MB, "
+		<< seconds / steps << " s/step" << std::endl;
+}
+
+// Returns the failed comparisons
+int testSparse(const char* zPath, const char* lPath)
+{
+	std::cout << "Sparse block grid benchmark, " << SPARSE_BLOCK << "x" << SPARSE_BLOCK << " blocks" << std::endl;
+	BenchGrids grids = [](int index, BenchGrid& grid)
+	{
+		if (index == 1)
+			return false;
+		grid.label = "random, lava in the middle";
+		grid.r = grid.c = 1024;
+		grid.steps = 100;
+		randomLavaField(1024, 1024, 1, 0.0, 0.0, grid.z, grid.h);
+		for (int i = 500; i < 524; i++)
+			for (int j = 500; j < 524; j++)
+				grid.h[i * 1024 + j] = 10.0;
+		return true;
+	};
+	int failures = benchStep(zPath, lPath, grids, 200, compareSparse);
+
+	sparseVolcano(100000, 500);
+	return reportFailures(failures);
+}
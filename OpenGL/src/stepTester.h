@@ -0,0 +1,147 @@
+#pragma once
+
+#include "globals.h"
+#include "gridBinary.h"
+#include "region.h"
+#include "threadedExecutor.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+The fixture of the step tests and benches (--test and --bench): every step of the simulation is
+checked against one reference run, the scalar fused sweep of flow.h on the whole grid, which the
+other steps must reproduce bit for bit. A comparison prints its verdict and returns whether it
+passed; the tests count the failures and return them, so that the program exits with a failure
+status when one does not pass.
+
+The benches of the storage backends share their driver, benchStep: it runs the step of a backend
+on a few random grids and then on the input grids, serially and on the simulation pool, against
+the reference run of each grid; a backend only supplies its grids and its step.
+*/
+
+// The thickness after the steps of the reference run, and the seconds they took
+struct ReferenceRun
+{
+	std::vector<double> h;
+	double seconds = 0;
+};
+
+// Runs the steps of the scalar fused sweep on a copy of the thickness of an r x c grid
+ReferenceRun referenceRun(const double* z, const double* h, int r, int c, double nodata, int steps)
+{
+	size_t size = size_t(r) * c;
+	ReferenceRun run;
+	run.h.assign(h, h + size);
+	std::vector<double> so(size * (VON_NEUMANN_NEIGHBORS - 1), 0.0);
+	double* planes[VON_NEUMANN_NEIGHBORS] = { NULL };		// So[0] is not used
+	for (int n = 1; n < VON_NEUMANN_NEIGHBORS; n++)
+		planes[n] = so.data() + (n - 1) * size;
+	Neighborhood V;
+
+	OutflowRowKernel kernel = outflowRowKernel;
+	outflowRowKernel = NULL;
+	util::Timer timer;
+	for (int s = 0; s < steps; s++)
+		globalTransitionFunction(const_cast<double*>(z), run.h.data(), planes, dumping_factor, r, c, V, nodata, gridRegion(r, c), gridRegion(r, c));
+	run.seconds = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	outflowRowKernel = kernel;
+	return run;
+}
+
+// Prints whether a thickness is the one of the reference run: identical, or the cells that differ and by how much; returns whether it is identical
+bool compareWithReference(const std::vector<double>& h, const ReferenceRun& reference)
+{
+	if (h.size() != reference.h.size())
+	{
+		std::cout << "DIFFERS in size";
+		return false;
+	}
+	size_t cells = 0;
+	double largest = 0;
+	for (size_t k = 0; k < h.size(); k++)
+		if (h[k] != reference.h[k])
+		{
+			cells++;
+			largest = std::max(largest, std::fabs(h[k] - reference.h[k]));
+		}
+	if (cells == 0)
+		std::cout << "identical";
+	else
+		std::cout << "DIFFERS in " << cells << " cells, by up to " << largest;
+	return cells == 0;
+}
+
+// Closes a test: reports the failed comparisons and returns their count
+int reportFailures(int failures)
+{
+	if (failures > 0)
+		std::cout << "\t" << failures << " comparisons FAILED" << std::endl;
+	return failures;
+}
+
+// A grid of a bench: index is its place among the random grids, -1 for the input grids
+struct BenchGrid
+{
+	std::string label;
+	std::vector<double> z, h;
+	int r = 0, c = 0;
+	double nodata = -9999.0;
+	int steps = 0;
+	int index = -1;
+};
+
+// Makes the random grid index of a bench; returns false when there is none
+typedef std::function<bool(int index, BenchGrid& grid)> BenchGrids;
+
+// The step of a backend: runs the steps on a copy of the grid, on the simulation pool when threaded, and prints its timings; returns the failed comparisons with the reference run
+typedef std::function<int(const BenchGrid& grid, const ReferenceRun& reference)> BenchStep;
+
+// Runs a step on a grid, serially and then threaded unless serialOnly; returns the failed comparisons
+int compareStep(const BenchGrid& grid, const BenchStep& step, bool serialOnly)
+{
+	std::cout << "\t" << grid.label << " (" << grid.r << "x" << grid.c << ", " << grid.steps << " steps)" << std::endl;
+	ReferenceRun reference = referenceRun(grid.z.data(), grid.h.data(), grid.r, grid.c, grid.nodata, grid.steps);
+	int failures = 0;
+	bool wasThreaded = threaded;
+	for (int backend = 0; backend < (serialOnly ? 1 : 2); backend++)
+	{
+		threaded = backend == 1;
+		std::cout << "\t\t" << (threaded ? "threaded" : "serial") << ": ";
+		failures += step(grid, reference);
+		std::cout << std::endl;
+	}
+	threaded = wasThreaded;
+	return failures;
+}
+
+// Runs a step on the random grids, then for inputSteps steps on the input grids when their sizes match; returns the failed comparisons
+int benchStep(const char* zPath, const char* lPath, const BenchGrids& grids, int inputSteps, const BenchStep& step, bool serialOnly = false)
+{
+	if (!simulationPool)
+		initThreadedExecutor(numThreads);
+
+	BenchGrid grid;
+	int failures = 0;
+	for (grid.index = 0; grids(grid.index, grid); grid.index++)
+		failures += compareStep(grid, step, serialOnly);
+
+	FileData zData, lData;
+	loadLayer(zPath, zData, grid.z);
+	loadLayer(lPath, lData, grid.h);
+	if (zData.nrows != lData.nrows || zData.ncols != lData.ncols)
+		return failures;
+	grid.label = "input grids";
+	grid.r = zData.nrows;
+	grid.c = zData.ncols;
+	grid.nodata = zData.NoDataValue;
+	grid.steps = inputSteps;
+	grid.index = -1;
+	return failures + compareStep(grid, step, serialOnly);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "globals.h"
+#include "ThreadPool.h"
+#include "region.h"
+
+#include "util.hpp"
+#include "flow.h"
+
+/*
+Multi-threaded CPU backend. The outflow and the mass balance passes are split into row bands run
+on a thread pool, and the balance only starts when the outflows are done on every band: kernel1
+writes the outflows of its own cells only, kernel2 the thickness of its own cells only, and each
+reads just what the previous pass wrote, so the bands never race. As in the serial sweep there
+is no reset pass, since kernel1 writes every outflow slot; the two passes are not fused within
+a band because the rows at the band edges need the outflows of the neighbouring bands.
+The regions, the loop bounds and the order of the operations of a cell are the ones of the
+serial version, so the results are identical to it.
+*/
+
+std::unique_ptr<ThreadPool> simulationPool;
+
+// Time spent in each pass by runThreaded, in seconds
+double threadedPassTime[2] = { 0, 0 };
+
+// threads = 0 uses one thread per hardware thread; the calling thread takes a band too
+void initThreadedExecutor(unsigned int threads)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	simulationPool.reset(new ThreadPool(std::max(1u, threads - 1)));
+}
+
+// With change, the balance pass also measures the step: each band into its own, merged at the end of the band
+void runThreaded(double* Sz, double* Sh, double* So[], double dumping_factor, int r, int c, double nodata, const Region& outflow, const Region& balance, StepChange* change = NULL)
+{
+	Region sweep = interiorRegion(r, c);
+	Region k1 = intersect(outflow, sweep);
+	Region k2 = intersect(balance, sweep);
+	if (isEmpty(k1))
+		return;
+
+	util::Timer timer;
+	simulationPool->ParallelFor(k1.row0, k1.row1, [&](int row0, int row1)
+	{
+		Neighborhood V;
+		for (int i = row0; i < row1; i++)
+			if (outflowRowKernel)
+				outflowRowKernel(c, i, k1.col0, k1.col1, Sz, Sh, So, dumping_factor, nodata, V);
+			else
+				for (int j = k1.col0; j < k1.col1; j++)
+					if (Sz[i * c + j] != nodata)
+						kernel1_outflow_computation(c, i, j, Sz, Sh, So, dumping_factor, V);
+	});
+	threadedPassTime[0] += static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+	timer.reset();
+
+	std::mutex changeMutex;
+	simulationPool->ParallelFor(k2.row0, k2.row1, [&](int row0, int row1)
+	{
+		Neighborhood V;
+		StepChange band;
+		for (int i = row0; i < row1; i++)
+			for (int j = k2.col0; j < k2.col1; j++)
+				if (Sz[i * c + j] != nodata)
+					kernel2_mass_balance(c, i, j, Sh, So, V, change ? &band : NULL);
+		if (!change)
+			return;
+		std::lock_guard<std::mutex> lock(changeMutex);
+		change->Merge(band);
+	});
+	threadedPassTime[1] += static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+}